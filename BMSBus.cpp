@@ -0,0 +1,263 @@
+#include "config.h"
+#include "BMSBus.h"
+#include "CRC8.h"
+#if defined(ARDUINO)
+#include "Logger.h"
+#endif
+
+BMSBus::BMSBus()
+{
+    head = 0;
+    count = 0;
+    waiting = false;
+    attempts = 0;
+    chainLength = MAX_MODULE_ADDR;
+    transport = NULL;
+}
+
+void BMSBus::setTransport(BMSTransport *port)
+{
+    transport = port;
+}
+
+BMSTransport *BMSBus::getTransport()
+{
+    return transport;
+}
+
+//How many modules a request to addrByte passes through. Broadcasts and unaddressed boards could be
+//anywhere up to the end of the chain.
+int BMSBus::hopsFor(uint8_t addrByte, int chainLength)
+{
+    int addr = (addrByte >> 1) & 0x3F;
+    if (addr == 0 || addr == 0x3F) return chainLength + 1;
+    return addr;
+}
+
+//Worst case time for a reply to be complete. Every byte on the wire both ways at BMS_BAUD (10 bits a byte)
+//plus the time for the request and reply to be passed along the chain.
+uint32_t BMSBus::replyTimeout(int txLen, int rxLen, int hops)
+{
+    return (((uint32_t)(txLen + rxLen) * 10000000ul) / BMS_BAUD) + (hops * BUS_HOP_ALLOWANCE_US) + BUS_TURNAROUND_US;
+}
+
+BMSBusStats &BMSBus::getStats()
+{
+    return stats;
+}
+
+bool BMSBus::isIdle()
+{
+    return (count == 0);
+}
+
+void BMSBus::setChainLength(int modules)
+{
+    chainLength = modules;
+}
+
+int BMSBus::freeSlots()
+{
+    return BUS_QUEUE_SIZE - count;
+}
+
+//Reads come back as address, register, length, the data bytes, then CRC
+bool BMSBus::queueRead(uint8_t addrByte, uint8_t reg, uint8_t len, BMSReplyCallback callback, void *context, uint8_t flags,
+                       uint8_t maxAttempts)
+{
+    return queue(addrByte, reg, len, false, len + 4, callback, context, flags, maxAttempts);
+}
+
+//Writes are echoed back as address, register, value, CRC
+bool BMSBus::queueWrite(uint8_t addrByte, uint8_t reg, uint8_t value, BMSReplyCallback callback, void *context, uint8_t flags,
+                        uint8_t maxAttempts)
+{
+    return queue(addrByte, reg, value, true, 4, callback, context, flags, maxAttempts);
+}
+
+//Holds off whatever is queued after this. Used to give the modules time to finish an ADC conversion
+bool BMSBus::queuePause(uint32_t pauseMicros)
+{
+    if (!queue(0, 0, 0, false, 0, NULL, NULL, 0, 1)) return false;
+    transactions[(head + count - 1) % BUS_QUEUE_SIZE].timeout = pauseMicros;
+    return true;
+}
+
+bool BMSBus::queue(uint8_t addrByte, uint8_t reg, uint8_t value, bool isWrite, uint8_t replyLen, 
+                   BMSReplyCallback callback, void *context, uint8_t flags, uint8_t maxAttempts)
+{
+    if (count >= BUS_QUEUE_SIZE) return false;
+    if (replyLen > BUS_MAX_REPLY) return false;
+
+    BMSTransaction &trans = transactions[(head + count) % BUS_QUEUE_SIZE];
+    trans.payload[0] = addrByte;
+    trans.payload[1] = reg;
+    trans.payload[2] = value;
+    trans.isWrite = isWrite;
+    trans.replyLen = replyLen;
+    trans.flags = flags;
+    trans.maxAttempts = (maxAttempts < 1) ? 1 : (maxAttempts > BUS_MAX_ATTEMPTS) ? BUS_MAX_ATTEMPTS : maxAttempts;
+    trans.timeout = replyTimeout(isWrite ? 4 : 3, replyLen, hopsFor(addrByte, chainLength));
+    trans.silentTimeout = trans.timeout;
+    if (flags & BUS_FLAG_FAST_FAIL) trans.silentTimeout = replyTimeout(isWrite ? 4 : 3, 1, hopsFor(addrByte, chainLength));
+    trans.callback = callback;
+    trans.context = context;
+    count++;
+    return true;
+}
+
+void BMSBus::send()
+{
+    BMSTransaction &trans = transactions[head];
+    uint8_t request[4];
+    int len = 3;
+
+    if (trans.replyLen == 0) //pause, just start the clock
+    {
+        sentAt = transport->now();
+        waiting = true;
+        return;
+    }
+
+    transport->flushInput(); //anything left over from an earlier reply is garbage now
+    parser.expect(trans.payload[0], trans.payload[1]);
+
+    request[0] = trans.payload[0];
+    request[1] = trans.payload[1];
+    request[2] = trans.payload[2];
+    if (trans.isWrite)
+    {
+        request[0] |= 1;
+        request[3] = CRC8::calc(request, 3);
+        len = 4;
+    }
+    transport->write(request, len);
+    if (attempts > 0) stats.noteRetry(trans.payload[0], trans.payload[1]);
+
+#if defined(ARDUINO)
+    if (Logger::isDebug())
+    {
+        SERIALCONSOLE.print("Sending: ");
+        for (int x = 0; x < len; x++) {
+            SERIALCONSOLE.print(request[x], HEX);
+            SERIALCONSOLE.print(" ");
+        }
+        SERIALCONSOLE.println();
+    }
+#endif
+
+    sentAt = transport->now();
+    attempts++;
+    waiting = true;
+}
+
+void BMSBus::complete(BUS_STATUS status, const uint8_t *data, int len)
+{
+    BMSTransaction &trans = transactions[head];
+    BMSReply reply;
+
+#if defined(ARDUINO)
+    if (Logger::isDebug() && trans.replyLen > 0)
+    {
+        SERIALCONSOLE.print("Reply after ");
+        SERIALCONSOLE.print(transport->now() - sentAt);
+        SERIALCONSOLE.print("us: ");
+        for (int x = 0; x < len; x++)
+        {
+            SERIALCONSOLE.print(data[x], HEX);
+            SERIALCONSOLE.print(" ");
+        }
+        SERIALCONSOLE.println();
+    }
+#endif
+
+    reply.data = data;
+    reply.length = len;
+    reply.addrByte = trans.payload[0];
+    reply.reg = trans.payload[1];
+    reply.attempts = attempts;
+    reply.status = status;
+
+    if (trans.replyLen > 0) stats.noteComplete(trans.payload[0], trans.payload[1], status == BUS_OK);
+    uint32_t overruns = transport->takeOverruns();
+    if (overruns) stats.noteOverruns(overruns);
+
+    //pop before calling back so the callback is free to queue follow up transactions
+    head = (head + 1) % BUS_QUEUE_SIZE;
+    count--;
+    waiting = false;
+    attempts = 0;
+
+    if (trans.callback) trans.callback(trans.context, reply);
+}
+
+void BMSBus::loop()
+{
+    BMSFrame frame;
+
+    while (count > 0)
+    {
+        if (!waiting)
+        {
+            send();
+            return;
+        }
+
+        BMSTransaction &trans = transactions[head];
+        bool gotFrame = false;
+
+        if (trans.replyLen == 0)
+        {
+            if ((transport->now() - sentAt) < trans.timeout) return;
+            complete(BUS_OK, NULL, 0);
+            continue;
+        }
+
+        while (transport->available())
+        {
+            if (parser.feed(transport->read(), frame)) 
+            {
+                gotFrame = true;
+                break;
+            }
+        }
+
+        if (gotFrame)
+        {
+            BUS_STATUS status = BUS_OK;
+            if (frame.length != trans.replyLen) status = BUS_SHORT_REPLY;
+            else if (!frame.crcGood && (trans.flags & BUS_FLAG_CHECK_CRC)) status = BUS_CRC_ERROR;
+
+            if (status == BUS_SHORT_REPLY) stats.noteShortReply(trans.payload[0], trans.payload[1]);
+            else if (status == BUS_CRC_ERROR) stats.noteCRCError(trans.payload[0], trans.payload[1]);
+            else stats.noteLatency(trans.payload[0], transport->now() - sentAt);
+
+            if (status != BUS_OK && attempts < trans.maxAttempts)
+            {
+                send();
+                return;
+            }
+            complete(status, frame.data, frame.length);
+            continue; //the next transaction can go out right away
+        }
+
+        //still waiting on the rest of the reply, or for it to start
+        if ((transport->now() - sentAt) < ((parser.pending() > 0) ? trans.timeout : trans.silentTimeout)) return;
+
+        if (parser.pending() > 0) stats.noteShortReply(trans.payload[0], trans.payload[1]);
+        else stats.noteTimeout(trans.payload[0], trans.payload[1]);
+
+        if (attempts < trans.maxAttempts) send();
+        else complete((parser.pending() > 0) ? BUS_SHORT_REPLY : BUS_TIMEOUT, parser.buffer(), parser.pending());
+        return;
+    }
+}
+
+/*
+ * Run the queue until everything in it is done. Only for code that still needs to own the bus
+ * outright (enumeration) and so must not start until queued traffic has cleared.
+ */
+void BMSBus::flush()
+{
+    while (count > 0) loop();
+}
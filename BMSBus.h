@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "BMSFrameParser.h"
+#include "BMSTransport.h"
+#include "BMSBusStats.h"
+
+#define BUS_QUEUE_SIZE      16  //number of transactions that can be waiting on the bus at once
+#define BUS_MAX_REPLY       FRAME_MAX_LEN  //largest reply we ever expect back from a module (header + data + CRC)
+#define BUS_MAX_ATTEMPTS    3   //how many times a transaction is sent before giving up on it
+#define BUS_RESERVED_SLOTS  4   //pack wide passes leave this many slots free so commands can always be queued
+
+#define BUS_FLAG_CHECK_CRC  1   //treat a CRC mismatch in the reply as a failure and retry
+#define BUS_FLAG_FAST_FAIL  2   //give up on an attempt once the first reply byte is overdue instead of waiting out the whole reply
+
+enum BUS_STATUS {
+    BUS_OK = 0,
+    BUS_SHORT_REPLY = 1,
+    BUS_CRC_ERROR = 2,
+    BUS_TIMEOUT = 3         //nothing at all came back
+};
+
+typedef struct {
+    const uint8_t *data;    //reply bytes, only valid for the duration of the callback
+    int length;         //how many bytes actually arrived
+    uint8_t addrByte;   //first byte of the request that produced this reply
+    uint8_t reg;
+    uint8_t attempts;
+    BUS_STATUS status;
+} BMSReply;
+
+typedef void (*BMSReplyCallback)(void *context, BMSReply &reply);
+
+typedef struct {
+    uint8_t payload[3];
+    bool isWrite;
+    uint8_t replyLen;           //0 for a pause, nothing is sent and it completes once timeout has passed
+    uint8_t flags;
+    uint8_t maxAttempts;        //how many times it is sent before giving up, at most BUS_MAX_ATTEMPTS
+    uint32_t timeout;           //microseconds to wait for the full reply before retrying
+    uint32_t silentTimeout;     //microseconds to wait while nothing at all has come back, timeout unless BUS_FLAG_FAST_FAIL
+    BMSReplyCallback callback;
+    void *context;
+} BMSTransaction;
+
+/*
+ * Queue of transactions for the module bus. Nothing in here ever waits. loop() is called as often as possible
+ * and will send the next transaction when the bus is free, collect reply bytes as they show up and fire the
+ * completion callback once the expected number of bytes is in or the transaction ran out of time and retries.
+ * All traffic goes through a BMSTransport so the same code runs against the real chain or a simulated one.
+ */
+class BMSBus
+{
+public:
+    BMSBus();
+    void loop();
+    void flush();
+    bool isIdle();
+    int freeSlots();
+    void setChainLength(int modules);
+    void setTransport(BMSTransport *port);
+    BMSTransport *getTransport();
+    BMSBusStats &getStats();
+    static int hopsFor(uint8_t addrByte, int chainLength);
+    static uint32_t replyTimeout(int txLen, int rxLen, int hops);
+    bool queueRead(uint8_t addrByte, uint8_t reg, uint8_t len, BMSReplyCallback callback, void *context, uint8_t flags = 0,
+                   uint8_t maxAttempts = BUS_MAX_ATTEMPTS);
+    bool queueWrite(uint8_t addrByte, uint8_t reg, uint8_t value, BMSReplyCallback callback, void *context, uint8_t flags = 0,
+                    uint8_t maxAttempts = BUS_MAX_ATTEMPTS);
+    bool queuePause(uint32_t pauseMicros);
+
+private:
+    BMSTransaction transactions[BUS_QUEUE_SIZE];
+    int head;
+    int count;
+    bool waiting;           //true while the transaction at head has been sent and we're collecting the reply
+    uint8_t attempts;
+    uint32_t sentAt;
+    int chainLength;        //how many modules are on the chain, used to work out reply timeouts
+    BMSTransport *transport;
+    BMSFrameParser parser;
+    BMSBusStats stats;
+
+    bool queue(uint8_t addrByte, uint8_t reg, uint8_t value, bool isWrite, uint8_t replyLen, 
+               BMSReplyCallback callback, void *context, uint8_t flags, uint8_t maxAttempts);
+    void send();
+    void complete(BUS_STATUS status, const uint8_t *data, int len);
+};
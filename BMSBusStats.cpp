@@ -0,0 +1,144 @@
+#include "BMSBusStats.h"
+#include <string.h>
+
+//Everything is indexed by the 6 bit module address or the 6 registers bits. The reset command (0x3C) is the
+//only thing sent to a register above 0x3B and nothing real lives there.
+#define ADDR_SLOT(addrByte)     (((addrByte) >> 1) & 0x3F)
+#define REG_SLOT(reg)           ((reg) & 0x3F)
+
+BMSBusStats::BMSBusStats()
+{
+    reset();
+}
+
+void BMSBusStats::reset()
+{
+    memset(modules, 0, sizeof(modules));
+    memset(registers, 0, sizeof(registers));
+    memset(latency, 0, sizeof(latency));
+    overruns = 0;
+}
+
+void BMSBusStats::noteRetry(uint8_t addrByte, uint8_t reg)
+{
+    modules[ADDR_SLOT(addrByte)].retries++;
+    registers[REG_SLOT(reg)].retries++;
+}
+
+void BMSBusStats::noteCRCError(uint8_t addrByte, uint8_t reg)
+{
+    modules[ADDR_SLOT(addrByte)].crcErrors++;
+    registers[REG_SLOT(reg)].crcErrors++;
+}
+
+void BMSBusStats::noteShortReply(uint8_t addrByte, uint8_t reg)
+{
+    modules[ADDR_SLOT(addrByte)].shortReplies++;
+    registers[REG_SLOT(reg)].shortReplies++;
+}
+
+void BMSBusStats::noteTimeout(uint8_t addrByte, uint8_t reg)
+{
+    modules[ADDR_SLOT(addrByte)].timeouts++;
+    registers[REG_SLOT(reg)].timeouts++;
+}
+
+void BMSBusStats::noteLatency(uint8_t addrByte, uint32_t micros)
+{
+    uint16_t &bucket = latency[ADDR_SLOT(addrByte)][latencyBucket(micros)];
+    if (bucket < 0xFFFF) bucket++;
+}
+
+void BMSBusStats::noteComplete(uint8_t addrByte, uint8_t reg, bool good)
+{
+    modules[ADDR_SLOT(addrByte)].transactions++;
+    registers[REG_SLOT(reg)].transactions++;
+    if (!good)
+    {
+        modules[ADDR_SLOT(addrByte)].failures++;
+        registers[REG_SLOT(reg)].failures++;
+    }
+}
+
+void BMSBusStats::noteOverruns(uint32_t count)
+{
+    overruns += count;
+}
+
+uint32_t BMSBusStats::getOverruns()
+{
+    return overruns;
+}
+
+const BusCounters &BMSBusStats::getModule(int addr)
+{
+    return modules[addr & 0x3F];
+}
+
+const BusCounters &BMSBusStats::getRegister(int reg)
+{
+    return registers[reg & 0x3F];
+}
+
+const uint16_t *BMSBusStats::getLatency(int addr)
+{
+    return latency[addr & 0x3F];
+}
+
+void BMSBusStats::getTotals(BusCounters &totals)
+{
+    memset(&totals, 0, sizeof(totals));
+    for (int i = 0; i < STATS_SLOTS; i++)
+    {
+        totals.transactions += modules[i].transactions;
+        totals.retries += modules[i].retries;
+        totals.crcErrors += modules[i].crcErrors;
+        totals.shortReplies += modules[i].shortReplies;
+        totals.timeouts += modules[i].timeouts;
+        totals.failures += modules[i].failures;
+    }
+}
+
+void BMSBusStats::getTotalLatency(uint16_t *buckets)
+{
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+    {
+        uint32_t sum = 0;
+        for (int i = 0; i < STATS_SLOTS; i++) sum += latency[i][b];
+        buckets[b] = (sum > 0xFFFF) ? 0xFFFF : sum;
+    }
+}
+
+//Bucket 0 is under 64us, bucket 1 is 64-127us, bucket 2 128-255us and so on. The last bucket takes everything longer.
+int BMSBusStats::latencyBucket(uint32_t micros)
+{
+    int bucket = 0;
+    micros >>= 6;
+    while (micros && bucket < STATS_LATENCY_BUCKETS - 1)
+    {
+        micros >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+//Upper end of a bucket in microseconds (exclusive)
+uint32_t BMSBusStats::bucketLimit(int bucket)
+{
+    return 64ul << bucket;
+}
+
+//Which bucket the given percentage of samples falls at or under. -1 if there are no samples.
+int BMSBusStats::percentileBucket(const uint16_t *buckets, int percent)
+{
+    uint32_t total = 0;
+    uint32_t running = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) total += buckets[b];
+    if (total == 0) return -1;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+    {
+        running += buckets[b];
+        if (running * 100 >= total * percent) return b;
+    }
+    return STATS_LATENCY_BUCKETS - 1;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+#define STATS_SLOTS             64  //one per possible address (0 = unaddressed, 0x3F = broadcast) and one per register
+#define STATS_LATENCY_BUCKETS   12  //bucket 0 is anything under 64us, each one after covers twice the time of the last
+
+typedef struct {
+    uint32_t transactions;  //completed transactions, however they ended
+    uint32_t retries;       //extra sends after the first
+    uint32_t crcErrors;     //replies that arrived whole but failed the CRC check
+    uint32_t shortReplies;  //replies that were the wrong length or stopped part way through
+    uint32_t timeouts;      //attempts where nothing at all came back
+    uint32_t failures;      //transactions that were still bad after the last retry
+} BusCounters;
+
+/*
+ * Counts what happens on the module bus, per module address and per register, along with a histogram of
+ * round trip times for good replies to each module. Every attempt is counted so a link that only gets
+ * through on the second or third try still shows up here long before it starts costing whole scans.
+ */
+class BMSBusStats
+{
+public:
+    BMSBusStats();
+    void reset();
+    void noteRetry(uint8_t addrByte, uint8_t reg);
+    void noteCRCError(uint8_t addrByte, uint8_t reg);
+    void noteShortReply(uint8_t addrByte, uint8_t reg);
+    void noteTimeout(uint8_t addrByte, uint8_t reg);
+    void noteLatency(uint8_t addrByte, uint32_t micros);
+    void noteComplete(uint8_t addrByte, uint8_t reg, bool good);
+    void noteOverruns(uint32_t count);
+    uint32_t getOverruns();
+    const BusCounters &getModule(int addr);
+    const BusCounters &getRegister(int reg);
+    const uint16_t *getLatency(int addr);
+    void getTotals(BusCounters &totals);
+    void getTotalLatency(uint16_t *buckets);
+    static int latencyBucket(uint32_t micros);
+    static uint32_t bucketLimit(int bucket);
+    static int percentileBucket(const uint16_t *buckets, int percent);
+
+private:
+    BusCounters modules[STATS_SLOTS];
+    BusCounters registers[STATS_SLOTS];
+    uint16_t latency[STATS_SLOTS][STATS_LATENCY_BUCKETS];   //saturates rather than wrapping
+    uint32_t overruns;      //times the port lost received bytes, not tied to any one module
+};
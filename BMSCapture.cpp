@@ -0,0 +1,152 @@
+#include "BMSCapture.h"
+#include <stddef.h>
+
+BMSCapture::BMSCapture()
+{
+    clear();
+}
+
+void BMSCapture::clear()
+{
+    head = 0;
+    tail = 0;
+    used = 0;
+    records = 0;
+    dropped = 0;
+}
+
+void BMSCapture::dropOldest()
+{
+    uint32_t len = CAPTURE_HEADER_LEN + buff[(tail + 1) & (CAPTURE_BUFF_SIZE - 1)];
+    tail = (tail + len) & (CAPTURE_BUFF_SIZE - 1);
+    used -= len;
+    records--;
+    dropped++;
+}
+
+void BMSCapture::record(uint8_t type, uint32_t time, const uint8_t *data, int len)
+{
+    uint8_t header[CAPTURE_HEADER_LEN];
+
+    if (len <= 0 || len > 0xFF) return;
+    uint32_t need = CAPTURE_HEADER_LEN + len;
+    while ((CAPTURE_BUFF_SIZE - used) < need) dropOldest();
+
+    header[0] = type;
+    header[1] = len;
+    header[2] = time & 0xFF;
+    header[3] = (time >> 8) & 0xFF;
+    header[4] = (time >> 16) & 0xFF;
+    header[5] = (time >> 24) & 0xFF;
+    for (int i = 0; i < CAPTURE_HEADER_LEN; i++) buff[(head + i) & (CAPTURE_BUFF_SIZE - 1)] = header[i];
+    for (int i = 0; i < len; i++) buff[(head + CAPTURE_HEADER_LEN + i) & (CAPTURE_BUFF_SIZE - 1)] = data[i];
+    head = (head + need) & (CAPTURE_BUFF_SIZE - 1);
+    used += need;
+    records++;
+}
+
+//Bytes held, oldest record first
+int BMSCapture::size()
+{
+    return used;
+}
+
+uint8_t BMSCapture::byteAt(int offset)
+{
+    return buff[(tail + offset) & (CAPTURE_BUFF_SIZE - 1)];
+}
+
+uint32_t BMSCapture::getRecordCount()
+{
+    return records;
+}
+
+uint32_t BMSCapture::getDroppedCount()
+{
+    return dropped;
+}
+
+BMSCaptureTransport::BMSCaptureTransport()
+{
+    inner = NULL;
+    capture = NULL;
+    chainIndex = 0;
+    rxLen = 0;
+    rxTime = 0;
+}
+
+void BMSCaptureTransport::attach(BMSTransport *port, BMSCapture *store, uint8_t chain)
+{
+    inner = port;
+    capture = store;
+    chainIndex = chain & 0x0F;
+    rxLen = 0;
+}
+
+BMSTransport *BMSCaptureTransport::getInner()
+{
+    return inner;
+}
+
+//Write out whatever has been received since the last request
+void BMSCaptureTransport::flushPending()
+{
+    if (rxLen == 0) return;
+    capture->record(CAPTURE_RX | chainIndex, rxTime, rxChunk, rxLen);
+    rxLen = 0;
+}
+
+int BMSCaptureTransport::available()
+{
+    return inner->available();
+}
+
+int BMSCaptureTransport::read()
+{
+    int data = inner->read();
+    if (data < 0) return data;
+    if (rxLen == 0) rxTime = inner->now();
+    rxChunk[rxLen++] = data;
+    if (rxLen == FRAME_MAX_LEN) flushPending();
+    return data;
+}
+
+void BMSCaptureTransport::write(const uint8_t *data, int len)
+{
+    flushPending();
+    capture->record(CAPTURE_TX | chainIndex, inner->now(), data, len);
+    inner->write(data, len);
+}
+
+//Read out what would have been dropped so it can be recorded as well
+void BMSCaptureTransport::flushInput()
+{
+    uint8_t junk[FRAME_MAX_LEN];
+    int len = 0;
+    uint32_t time = inner->now();
+
+    flushPending();
+    while (inner->available() && len < FRAME_MAX_LEN) junk[len++] = inner->read();
+    if (len > 0) capture->record(CAPTURE_DISCARD | chainIndex, time, junk, len);
+    inner->flushInput();
+}
+
+uint32_t BMSCaptureTransport::now()
+{
+    return inner->now();
+}
+
+uint16_t BMSCaptureTransport::getBaudDivisor()
+{
+    return inner->getBaudDivisor();
+}
+
+bool BMSCaptureTransport::setBaudDivisor(uint16_t divisor)
+{
+    return inner->setBaudDivisor(divisor);
+}
+
+uint32_t BMSCaptureTransport::takeOverruns()
+{
+    return inner->takeOverruns();
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include "BMSTransport.h"
+#include "BMSFrameParser.h"
+
+#define CAPTURE_BUFF_SIZE       4096    //must be a power of two
+#define CAPTURE_HEADER_LEN      6       //type, length, 32 bit timestamp
+
+//Record types live in the top nibble, the low nibble is the chain the traffic was on
+#define CAPTURE_TX              0x10    //bytes written to the chain
+#define CAPTURE_RX              0x20    //bytes read back from the chain
+#define CAPTURE_DISCARD         0x30    //bytes thrown away unread by flushInput
+
+/*
+ * Ring buffer of raw module bus traffic. Each record is a type byte, a length byte, the microsecond timestamp
+ * (little endian) and then the bytes themselves. Once full the oldest records are dropped to make room so
+ * the buffer always holds the most recent traffic.
+ *
+ * Plain C++ so the same layout can be read back by tools/replay.cpp on a PC.
+ */
+class BMSCapture
+{
+public:
+    BMSCapture();
+    void clear();
+    void record(uint8_t type, uint32_t time, const uint8_t *data, int len);
+    int size();
+    uint8_t byteAt(int offset);
+    uint32_t getRecordCount();
+    uint32_t getDroppedCount();
+
+private:
+    uint8_t buff[CAPTURE_BUFF_SIZE];
+    uint32_t head;          //where the next record goes
+    uint32_t tail;          //start of the oldest record
+    uint32_t used;
+    uint32_t records;
+    uint32_t dropped;       //records pushed out by newer ones
+
+    void dropOldest();
+};
+
+/*
+ * Sits between a chain and its real transport and copies everything going either way into a BMSCapture.
+ * Received bytes are gathered up and written as one record when the next request goes out so a reply
+ * normally ends up as a single record.
+ */
+class BMSCaptureTransport : public BMSTransport
+{
+public:
+    BMSCaptureTransport();
+    void attach(BMSTransport *port, BMSCapture *store, uint8_t chain);
+    BMSTransport *getInner();
+    void flushPending();
+
+    int available();
+    int read();
+    void write(const uint8_t *data, int len);
+    void flushInput();
+    uint32_t now();
+    uint16_t getBaudDivisor();
+    bool setBaudDivisor(uint16_t divisor);
+    uint32_t takeOverruns();
+
+private:
+    BMSTransport *inner;
+    BMSCapture *capture;
+    uint8_t chainIndex;
+    uint8_t rxChunk[FRAME_MAX_LEN];
+    int rxLen;
+    uint32_t rxTime;        //when the first byte of the chunk was read
+};
@@ -0,0 +1,141 @@
+#include "BMSCellStats.h"
+#include <string.h>
+#include <math.h>
+
+BMSCellStats::BMSCellStats()
+{
+    clear();
+}
+
+void BMSCellStats::clear()
+{
+    memset(cells, 0, sizeof(cells));
+    memset(offsetCells, 0, sizeof(offsetCells));
+    memset(erraticCells, 0, sizeof(erraticCells));
+    peerMean = peerMeanSD = peerSpread = peerSpreadSD = 0.0f;
+}
+
+/*
+ * Add one scan's cell readings, six per module. Once a cell has ANOMALY_WINDOW readings older ones start
+ * to fade out so the figures follow a cell that changes with age. Each cell's mean and standard deviation
+ * are then compared with those of every other cell: one that is zLimit standard deviations and minCounts
+ * away from the rest is flagged. A cell only counts once it has ANOMALY_MIN_SAMPLES readings. Modules that
+ * aren't live (not read yet, quarantined or past a break) keep their statistics but don't add to them, and
+ * their readings aren't part of the pack average either.
+ */
+void BMSCellStats::update(const uint16_t *cellCounts, const bool *live, int modules, float zLimit, float minCounts,
+                          CellFlagCallback callback, void *context)
+{
+    uint32_t sum = 0;
+    int liveCells = 0;
+    for (int m = 0; m < modules; m++)
+    {
+        if (!live[m]) continue;
+        for (int c = 0; c < 6; c++) sum += cellCounts[(m * 6) + c];
+        liveCells += 6;
+    }
+    if (liveCells == 0) return;
+    float packAvg = (float)sum / (float)liveCells;
+    float sumMean = 0.0f, sumMean2 = 0.0f, sumSpread = 0.0f, sumSpread2 = 0.0f;
+    int counted = 0;
+
+    for (int m = 0; m < modules; m++)
+    {
+        for (int c = 0; c < 6; c++)
+        {
+            CellStats &s = cells[(m * 6) + c];
+            if (live[m])
+            {
+                float dev = cellCounts[(m * 6) + c] - packAvg;
+                if (s.samples < ANOMALY_WINDOW) s.samples++;
+                else s.m2 -= s.m2 / ANOMALY_WINDOW;
+                float delta = dev - s.mean;
+                s.mean += delta / s.samples;
+                s.m2 += delta * (dev - s.mean);
+            }
+            if (s.samples < ANOMALY_MIN_SAMPLES) continue;
+            float spread = sqrtf(s.m2 / (s.samples - 1));
+            sumMean += s.mean;
+            sumMean2 += s.mean * s.mean;
+            sumSpread += spread;
+            sumSpread2 += spread * spread;
+            counted++;
+        }
+    }
+
+    if (counted < 2) return;
+    peerMean = sumMean / counted;
+    peerMeanSD = sqrtf(fabsf((sumMean2 / counted) - (peerMean * peerMean)));
+    peerSpread = sumSpread / counted;
+    peerSpreadSD = sqrtf(fabsf((sumSpread2 / counted) - (peerSpread * peerSpread)));
+
+    for (int m = 0; m < modules; m++)
+    {
+        uint8_t offset = 0, erratic = 0;
+        for (int c = 0; c < 6 && zLimit > 0.0f; c++)
+        {
+            CellStats &s = cells[(m * 6) + c];
+            if (s.samples < ANOMALY_MIN_SAMPLES) continue;
+            //compared with every other cell but this one so a lone bad cell doesn't hide itself by widening the spread
+            float spread = sqrtf(s.m2 / (s.samples - 1));
+            float others = (sumMean - s.mean) / (counted - 1);
+            float othersSD = sqrtf(fabsf(((sumMean2 - (s.mean * s.mean)) / (counted - 1)) - (others * others)));
+            float away = fabsf(s.mean - others);
+            if (away >= minCounts && away >= zLimit * othersSD) offset |= (1 << c);
+            others = (sumSpread - spread) / (counted - 1);
+            othersSD = sqrtf(fabsf(((sumSpread2 - (spread * spread)) / (counted - 1)) - (others * others)));
+            away = spread - others;
+            if (away >= minCounts && away >= zLimit * othersSD) erratic |= (1 << c);
+        }
+        uint8_t fresh = (offset & ~offsetCells[m]) | (erratic & ~erraticCells[m]);
+        for (int c = 0; c < 6 && callback; c++)
+        {
+            if (fresh & (1 << c)) callback(context, m, c, (offset & (1 << c)) != 0);
+        }
+        offsetCells[m] = offset;
+        erraticCells[m] = erratic;
+    }
+}
+
+//A pack cell's average distance from the pack average and how much that moves about, both in counts
+bool BMSCellStats::getDeviation(int packCell, float &mean, float &spread)
+{
+    if (packCell < 0 || packCell >= PACK_MODULES * 6) return false;
+    CellStats &s = cells[packCell];
+    if (s.samples < 2) return false;
+    mean = s.mean;
+    spread = sqrtf(s.m2 / (s.samples - 1));
+    return true;
+}
+
+uint8_t BMSCellStats::getOffsetCells(int slot)
+{
+    if (slot < 0 || slot >= PACK_MODULES) return 0;
+    return offsetCells[slot];
+}
+
+uint8_t BMSCellStats::getErraticCells(int slot)
+{
+    if (slot < 0 || slot >= PACK_MODULES) return 0;
+    return erraticCells[slot];
+}
+
+float BMSCellStats::getPeerMean()
+{
+    return peerMean;
+}
+
+float BMSCellStats::getPeerMeanSD()
+{
+    return peerMeanSD;
+}
+
+float BMSCellStats::getPeerSpread()
+{
+    return peerSpread;
+}
+
+float BMSCellStats::getPeerSpreadSD()
+{
+    return peerSpreadSD;
+}
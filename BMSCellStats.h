@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+#define ANOMALY_WINDOW          256     //readings a cell's statistics are built over, older ones fade out after this
+#define ANOMALY_MIN_SAMPLES     30      //readings a cell needs before it can be flagged
+
+//Running statistics of how far one cell sits from the pack average, in counts
+typedef struct {
+    uint16_t samples;   //up to ANOMALY_WINDOW
+    float mean;
+    float m2;           //sum of squared differences from the mean (Welford)
+} CellStats;
+
+//Called for every cell that wasn't flagged before and is now. slot is the module's position in the readings passed to update
+typedef void (*CellFlagCallback)(void *context, int slot, int cell, bool offset);
+
+/*
+ * Weak or high resistance cells show up as sitting away from the rest of the pack, either all the time or
+ * only when the pack is worked. Every cell keeps a Welford running mean and variance of how far it is from
+ * the pack average, a constant amount of work per cell per scan. Cells are kept by position, six to a
+ * module, so whoever feeds the readings in has to clear the statistics when the modules move about.
+ */
+class BMSCellStats
+{
+public:
+    BMSCellStats();
+    void clear();
+    void update(const uint16_t *cellCounts, const bool *live, int modules, float zLimit, float minCounts,
+                CellFlagCallback callback = 0, void *context = 0);
+    bool getDeviation(int packCell, float &mean, float &spread);
+    uint8_t getOffsetCells(int slot);
+    uint8_t getErraticCells(int slot);
+    float getPeerMean();
+    float getPeerMeanSD();
+    float getPeerSpread();
+    float getPeerSpreadSD();
+
+private:
+    CellStats cells[PACK_MODULES * 6];  // in pack cell order
+    uint8_t offsetCells[PACK_MODULES];  // bit per cell sitting away from the rest, by module position
+    uint8_t erraticCells[PACK_MODULES]; // and swinging more than the rest
+    float peerMean;                     // average and standard deviation across the pack of every cell's mean deviation
+    float peerMeanSD;
+    float peerSpread;                   // and of every cell's own standard deviation
+    float peerSpreadSD;
+};
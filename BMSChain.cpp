@@ -0,0 +1,871 @@
+#include "config.h"
+#include "BMSChain.h"
+#include "BMSUtil.h"
+#include "BMSUart.h"
+#include "Logger.h"
+
+BMSChain::BMSChain()
+{
+    for (int i = 1; i <= MAX_MODULE_ADDR; i++) {
+        modules[i].setExists(false);
+        modules[i].setAddress(i);
+        modules[i].setBus(&bus);
+    }
+    numFoundModules = 0;
+    index = 0;
+    transport = NULL;
+    balanceCursor = MAX_MODULE_ADDR;
+    scanCursor = MAX_MODULE_ADDR;
+    scanMode = SCAN_BROADCAST;
+    scanWithStatus = false;
+    scanVerify = false;
+    scanProbe = false;
+    checkedTransactions = 0;
+    checkedErrors = 0;
+    calStep = -1;
+    calDone = false;
+    calResult = 0;
+    linkChanged = false;
+    lastOutage = 0;
+    lastRecovery = 0;
+    enumerating = false;
+    discoverCursor = 0;
+    discoverPending = false;
+    layoutVersion = 0;
+    activeCount = 0;
+    resetLink();
+    rebuildActive();
+}
+
+/*
+ * Refresh the list of addresses that have a module. Everything that walks the chain uses the list so the work
+ * follows the modules actually there rather than every possible address. Has to be called whenever a module may
+ * have been added or dropped. The layout version only moves if the list really came out different.
+ */
+void BMSChain::rebuildActive()
+{
+    int count = 0;
+    bool changed = false;
+
+    for (int x = 1; x <= MAX_MODULE_ADDR; x++)
+    {
+        if (!modules[x].isExisting()) continue;
+        if (count >= activeCount || active[count] != x) changed = true;
+        active[count++] = x;
+    }
+    if (count != activeCount) changed = true;
+    activeCount = count;
+    numFoundModules = activeCount;
+    if (!changed) return;
+
+    layoutVersion++;
+    if (searchHigh >= 0) searchHigh = -1; //positions in the old list mean nothing now, checkLink starts again if the tail is still silent
+}
+
+//Goes up every time modules are added or dropped so users of the active list know to refresh their own copies
+uint16_t BMSChain::getLayoutVersion()
+{
+    return layoutVersion;
+}
+
+int BMSChain::getActiveCount()
+{
+    return activeCount;
+}
+
+//Address of the nth module on the chain, in address order
+int BMSChain::getActiveAddress(int n)
+{
+    if (n < 0 || n >= activeCount) return 0;
+    return active[n];
+}
+
+void BMSChain::setIndex(int chainIndex)
+{
+    index = chainIndex;
+}
+
+//Point all module traffic on this chain at a different port, real or simulated
+void BMSChain::setTransport(BMSTransport *port)
+{
+    if (transport) bus.flush();
+    transport = port;
+    bus.setTransport(port);
+}
+
+BMSTransport *BMSChain::getTransport()
+{
+    return transport;
+}
+
+BMSBus &BMSChain::getBus()
+{
+    return bus;
+}
+
+//addr is the module address on this chain, 1 to MAX_MODULE_ADDR
+BMSModule &BMSChain::getModule(int addr)
+{
+    if (addr < 1 || addr > MAX_MODULE_ADDR) addr = 0;
+    return modules[addr];
+}
+
+int BMSChain::getNumFoundModules()
+{
+    return numFoundModules;
+}
+
+/*
+ * Call as often as possible. Runs the bus and keeps it fed with whatever work has been asked for.
+ * Modules are only queued when the bus has room for everything they need so the queue never overflows
+ * no matter how many modules are on the chain.
+ */
+void BMSChain::loop()
+{
+    if (!transport) return;
+
+    bus.loop();
+
+    if (calStep >= 0)
+    {
+        runBaudCal();
+        return; //everything else waits so nothing but calibration reads goes out at a test setting
+    }
+
+    //break search probes go out one at a time as each answer decides where the next one goes
+    if (searchHigh >= 0 && !probePending && bus.freeSlots() > BUS_RESERVED_SLOTS) queueLinkProbe();
+    //discovery is the same, whether to carry on depends on the last answer
+    if (discoverCursor > 0 && !discoverPending && bus.freeSlots() > BUS_RESERVED_SLOTS) queueDiscoverProbe();
+
+    while (balanceCursor < activeCount && bus.freeSlots() >= MODULE_BALANCE_TRANSACTIONS + BUS_RESERVED_SLOTS)
+    {
+        int addr = active[balanceCursor++];
+        if (!modules[addr].isQuarantined() && isReachable(addr)) modules[addr].balanceCells();
+    }
+
+    if (balanceCursor < activeCount) return; //balancing gets queued before readings are taken
+
+    if (scanCursor < 0)
+    {
+        if (bus.freeSlots() < 4 + BUS_RESERVED_SLOTS) return;
+        broadcastConfig(REG_ADC_CTRL, ADC_CTRL_SETTING);
+        broadcastConfig(REG_IO_CTRL, IO_CTRL_SETTING);
+        bus.queueWrite(0x7F, REG_ADC_CONV, 1, NULL, NULL); //every module on the chain starts converting at the same moment
+        bus.queuePause(ADC_CONVERSION_US);
+        scanCursor = 0;
+    }
+
+    if (scanMode == SCAN_BROADCAST)
+    {
+        while (scanCursor < activeCount && bus.freeSlots() >= MODULE_RESULT_TRANSACTIONS + 1 + BUS_RESERVED_SLOTS)
+        {
+            int addr = active[scanCursor++];
+            if (isReachable(addr) && (scanProbe || !modules[addr].isQuarantined()))
+            {
+                modules[addr].readConversionResults(scanWithStatus);
+                if (scanVerify) modules[addr].verifyShadow();
+            }
+        }
+    }
+    else
+    {
+        while (scanCursor < activeCount && bus.freeSlots() >= MODULE_READ_TRANSACTIONS + 1 + BUS_RESERVED_SLOTS)
+        {
+            int addr = active[scanCursor++];
+            if (isReachable(addr) && (scanProbe || !modules[addr].isQuarantined()))
+            {
+                modules[addr].readModuleValues();
+                if (scanVerify) modules[addr].verifyShadow();
+            }
+        }
+    }
+}
+
+//Begin a pass over every module on the chain. Progress is made in loop(). Quarantined modules are
+//skipped unless probe is set, in which case they get a single attempt at the same reads as everyone else.
+//Modules past a break are always skipped. Instead the first of them gets one cheap read every scan.
+void BMSChain::startScan(uint8_t mode, bool withStatus, bool verify, bool probe)
+{
+    if (linkBreak > 0 && !probePending && calStep < 0) queueLinkProbe();
+    if (reconnectAt != 0) recoveryScan = true;
+    scanMode = mode;
+    scanProbe = probe;
+    scanWithStatus = withStatus;
+    scanVerify = verify;
+    scanCursor = (mode == SCAN_BROADCAST) ? -1 : 0;
+}
+
+void BMSChain::startBalance()
+{
+    balanceCursor = 0;
+}
+
+/*
+ * Look for modules that have been plugged in since the chain was numbered without disturbing the ones already
+ * numbered. Runs through the bus alongside everything else: a read of address 0, and if an unaddressed module
+ * answers it gets the address after the last one in use and address 0 is checked again, until nobody answers.
+ */
+void BMSChain::startEnumerate()
+{
+    if (!transport || enumerating || calStep >= 0) return;
+    queueEnumerateCheck();
+}
+
+bool BMSChain::isEnumerating()
+{
+    return enumerating;
+}
+
+void BMSChain::queueEnumerateCheck()
+{
+    enumerating = bus.queueRead(0, REG_DEV_STATUS, 1, enumerateReply, this, 0, 1);
+}
+
+//Same test setupBoards uses, an unaddressed module answers with 0x80 as its address byte
+void BMSChain::enumerateReply(void *context, BMSReply &reply)
+{
+    BMSChain *chain = (BMSChain *)context;
+
+    chain->enumerating = false;
+    if (reply.status != BUS_OK || reply.length < 4 || reply.data[0] != 0x80) return;
+
+    int y = chain->nextFreeAddress();
+    if (y == 0)
+    {
+        Logger::warn("Unaddressed module on chain %i but every address is taken", chain->index);
+        return;
+    }
+    chain->enumerating = chain->bus.queueWrite(0, REG_ADDR_CTRL, y | 0x80, addressReply, chain);
+}
+
+/*
+ * Address for a newly found module. A renumber gives out addresses in wiring order and the break search
+ * relies on that, so a new module gets the one after the highest in use: new modules normally go on the
+ * end of the chain. Only once the top address is taken does it fall back to the lowest free one. A module
+ * spliced into the middle of the chain still needs a renumber to put the order right. 0 if all are taken.
+ */
+int BMSChain::nextFreeAddress()
+{
+    int y = MAX_MODULE_ADDR;
+    while (y >= 1 && !modules[y].isExisting()) y--;
+    if (y < MAX_MODULE_ADDR) return y + 1;
+
+    for (y = 1; y <= MAX_MODULE_ADDR; y++)
+    {
+        if (modules[y].isExisting()) continue;
+        Logger::warn("Chain %i: new module given address %i out of wiring order, renumber (R) to keep break finding accurate", index, y);
+        return y;
+    }
+    return 0;
+}
+
+void BMSChain::addressReply(void *context, BMSReply &reply)
+{
+    BMSChain *chain = (BMSChain *)context;
+    int addr = reply.data ? (reply.data[2] & 0x3F) : 0;
+
+    chain->enumerating = false;
+    if (reply.status != BUS_OK || reply.length < 3 || reply.data[0] != 0x81 || reply.data[1] != REG_ADDR_CTRL || addr == 0) return;
+
+    chain->modules[addr].setExists(true);
+    chain->rebuildActive();
+    chain->bus.setChainLength(chain->numFoundModules);
+    Logger::info("New module on chain %i given address %i", chain->index, addr);
+    chain->queueEnumerateCheck(); //there may be more than one
+}
+
+//True once every read for the current scan has been queued and answered
+bool BMSChain::isScanDone()
+{
+    return (calStep < 0) && (scanCursor >= activeCount) && bus.isIdle();
+}
+
+/*
+ * Try to set up any unitialized boards. Send a command to address 0 and see if there is a response. If there is then there is
+ * still at least one unitialized board. Go ahead and give it the next ID, see nextFreeAddress.
+ * If we send a command to address 0 and no one responds then every board is inialized and this routine stops.
+ * Don't run this routine until after the boards have already been enumerated.\
+ * Note: The 0x80 conversion it is looking might in theory block the message from being forwarded so it might be required
+ * To do all of this differently. Try with multiple boards. The alternative method would be to try to set the next unused
+ * address and see if any boards respond back saying that they set the address. 
+ */
+void BMSChain::setupBoards()
+{
+    uint8_t payload[3];
+    uint8_t buff[10];
+    int retLen;
+
+    bus.flush();
+
+    payload[0] = 0;
+    payload[1] = 0;
+    payload[2] = 1;
+
+    while (1 == 1)
+    {
+        payload[0] = 0;
+        payload[1] = 0;
+        payload[2] = 1;
+        retLen = BMSUtil::sendDataWithReply(transport, payload, 3, false, buff, 5, NULL, &bus.getStats()); //whole reply so no CRC is left behind
+        if (retLen == 5)
+        {
+            if (buff[0] == 0x80 && buff[1] == 0 && buff[2] == 1)
+            {
+                Logger::debug("00 found");
+                int y = nextFreeAddress();
+                if (y == 0) break; //every address is taken
+                payload[0] = 0;
+                payload[1] = REG_ADDR_CTRL;
+                payload[2] = y | 0x80;
+                BMSUtil::sendData(transport, payload, 3, true);
+                BMSUtil::waitForReply(transport, 4, BMSBus::replyTimeout(8, 4, numFoundModules + 1));
+                if (BMSUtil::getReply(transport, buff, 10) > 2)
+                {
+                    if (buff[0] == (0x81) && buff[1] == REG_ADDR_CTRL && buff[2] == (y + 0x80)) 
+                    {
+                        modules[y].setExists(true);
+                        numFoundModules++;
+                        bus.setChainLength(numFoundModules);
+                        Logger::debug("Address assigned");
+                    }
+                }
+            }
+            else break; //nobody responded properly to the zero address so our work here is done.
+        }
+        else break;
+    }
+    rebuildActive();
+}
+
+/*
+ * Find out which addresses have a module behind them. Runs in the background through the bus, one address at a
+ * time from 1 up, and stops after DISCOVERY_MISSES addresses in a row don't answer. After a renumber the addresses
+ * have no gaps so this takes as long as the modules actually there need, not all MAX_MODULE_ADDR of them. The extra
+ * miss allowed keeps one dead module from hiding everything after it. Modules already known carry on being scanned
+ * while this runs and only the ones past the end it finds are dropped.
+ */
+void BMSChain::findBoards()
+{
+    if (!transport || discoverCursor > 0) return;
+    discoverCursor = 1;
+    discoverMisses = 0;
+    discoverStart = micros();
+}
+
+bool BMSChain::isDiscovering()
+{
+    return discoverCursor > 0;
+}
+
+void BMSChain::queueDiscoverProbe()
+{
+    if (bus.queueRead(discoverCursor << 1, REG_DEV_STATUS, 1, discoverReply, this, BUS_FLAG_CHECK_CRC, 2)) discoverPending = true;
+}
+
+void BMSChain::discoverReply(void *context, BMSReply &reply)
+{
+    BMSChain *chain = (BMSChain *)context;
+    int addr = (reply.addrByte >> 1) & 0x3F;
+
+    chain->discoverPending = false;
+    if (chain->discoverCursor != addr) return; //discovery was restarted or called off while this was on the bus
+
+    if (reply.status == BUS_OK)
+    {
+        if (!chain->modules[addr].isExisting()) 
+        {
+            chain->modules[addr].setExists(true);
+            chain->rebuildActive();
+            Logger::debug("Found module with address: %X on chain %i", addr, chain->index);
+        }
+        chain->discoverMisses = 0;
+    }
+    else chain->discoverMisses++;
+
+    chain->discoverCursor++;
+    if (chain->discoverMisses < DISCOVERY_MISSES && chain->discoverCursor <= MAX_MODULE_ADDR) return; //loop() sends the next probe
+
+    for (int x = chain->discoverCursor - chain->discoverMisses; x <= MAX_MODULE_ADDR; x++) 
+    {
+        if (chain->modules[x].isExisting()) chain->modules[x].setExists(false);
+    }
+    chain->rebuildActive();
+    chain->bus.setChainLength(chain->numFoundModules);
+    if (chain->linkBreak > 0 && !chain->modules[chain->linkBreak].isExisting()) chain->resetLink(); //nothing left past it to wait for
+    chain->discoverCursor = 0;
+    Logger::info("Chain %i: found %i modules in %i us", chain->index, chain->numFoundModules, micros() - chain->discoverStart);
+}
+
+
+/*
+ * Force all modules to reset back to address 0 then set them all up in order so that the first module
+ * in line from the master board is 1, the second one 2, and so on.
+*/
+void BMSChain::renumberBoardIDs()
+{
+    uint8_t payload[3];
+    uint8_t buff[8];
+    int attempts = 1;
+
+    bus.flush();
+    resetLink();
+    discoverCursor = 0;
+
+    for (int y = 1; y < 63; y++) 
+    {
+        modules[y].setExists(false);
+        numFoundModules = 0;
+    }
+
+    while (attempts < 3)
+    {
+        payload[0] = 0x3F << 1; //broadcast the reset command
+        payload[1] = 0x3C;//reset
+        payload[2] = 0xA5;//data to cause a reset
+        BMSUtil::sendData(transport, payload, 3, true);
+        delay(100);
+        BMSUtil::getReply(transport, buff, 8);
+        if (buff[0] == 0x7F && buff[1] == 0x3C && buff[2] == 0xA5 && buff[3] == 0x57) break;
+        attempts++;
+    }
+
+    setupBoards();
+}
+
+//8 bytes, bit (addr & 7) of byte (addr >> 3) set for every module that exists
+void BMSChain::getAddressMap(uint8_t *addressMap)
+{
+    memset(addressMap, 0, 8);
+    for (int x = 1; x <= MAX_MODULE_ADDR; x++) if (modules[x].isExisting()) addressMap[x >> 3] |= 1 << (x & 7);
+}
+
+//Replies come back in the order they were queued so each one shifts its result in from the right
+void BMSChain::verifyReply(void *context, BMSReply &reply)
+{
+    uint8_t *answered = (uint8_t *)context;
+    int addr = (reply.addrByte >> 1) & 0x3F;
+    bool ok = (reply.status == BUS_OK);
+
+    //addressed modules report their own address with bit 7 set in REG_ADDR_CTRL
+    if (ok && addr != 0 && reply.data[3] != (addr | 0x80)) ok = false;
+    *answered = (*answered << 1) | (ok ? 1 : 0);
+}
+
+/*
+ * Take the modules from a saved address map instead of renumbering, as long as the chain still looks the same.
+ * That is checked with five quick reads: address 0 must not answer (a module that lost power would have lost its
+ * address), the first, middle and last modules must answer with their own address in REG_ADDR_CTRL and the address
+ * after the last must not answer. Nothing is reset and no faults are cleared. Returns false and forgets every
+ * module if anything doesn't match, in which case a renumber is needed. A NULL map just forgets every module.
+ */
+bool BMSChain::restoreBoards(const uint8_t *addressMap)
+{
+    uint8_t expected = 0b0111;    //address 0 silent, first, middle and last answering
+    uint8_t answered = 0;
+    int first;
+    int middle;
+    int last;
+
+    if (!transport) return false;
+    bus.flush();
+    resetLink();
+    discoverCursor = 0;
+
+    for (int x = 1; x <= MAX_MODULE_ADDR; x++) modules[x].setExists(addressMap && (addressMap[x >> 3] & (1 << (x & 7))));
+    rebuildActive();
+    if (activeCount == 0) return false;
+    bus.setChainLength(numFoundModules);
+    first = active[0];
+    middle = active[(activeCount - 1) / 2];
+    last = active[activeCount - 1];
+
+    bus.queueRead(0, REG_DEV_STATUS, 1, verifyReply, &answered, 0, 1);
+    bus.queueRead(first << 1, REG_ADDR_CTRL, 1, verifyReply, &answered, BUS_FLAG_CHECK_CRC);
+    bus.queueRead(middle << 1, REG_ADDR_CTRL, 1, verifyReply, &answered, BUS_FLAG_CHECK_CRC);
+    bus.queueRead(last << 1, REG_ADDR_CTRL, 1, verifyReply, &answered, BUS_FLAG_CHECK_CRC);
+    if (last < MAX_MODULE_ADDR) 
+    {
+        bus.queueRead((last + 1) << 1, REG_ADDR_CTRL, 1, verifyReply, &answered, 0, 1);
+        expected <<= 1; //and the address after the last silent
+    }
+    bus.flush();
+
+    if (answered == expected) 
+    {
+        Logger::info("Chain %i: %i modules from the saved topology all in place", index, numFoundModules);
+        return true;
+    }
+
+    Logger::info("Chain %i doesn't match the saved topology", index);
+    for (int x = 1; x <= MAX_MODULE_ADDR; x++) modules[x].setExists(false);
+    rebuildActive();
+    bus.setChainLength(MAX_MODULE_ADDR);
+    return false;
+}
+
+/*
+After a RESET boards have their faults written due to the hard restart or first time power up, this clears thier faults
+*/
+void BMSChain::clearFaults()
+{
+    bus.queueWrite(0x7F, REG_ALERT_STATUS, 0xFF, NULL, NULL); //broadcast data to cause a reset
+    bus.queueWrite(0x7F, REG_ALERT_STATUS, 0x00, NULL, NULL); //data to clear
+    bus.queueWrite(0x7F, REG_FAULT_STATUS, 0xFF, NULL, NULL); //Fault Status
+    bus.queueWrite(0x7F, REG_FAULT_STATUS, 0x00, NULL, NULL);
+
+}
+
+/*
+Puts all boards on the bus into a Sleep state, very good to use when the vehicle is a rest state. 
+Pulling the boards out of sleep only to check voltage decay and temperature when the contactors are open.
+*/
+
+void BMSChain::sleepBoards()
+{
+    broadcastWrite(REG_IO_CTRL, 0x04); //broadcast write of the sleep bit
+}
+
+/*
+Wakes all the boards up and clears thier SLEEP state bit in the Alert Status Registery
+*/
+
+void BMSChain::wakeBoards()
+{
+    broadcastWrite(REG_IO_CTRL, 0x00); //clear sleep bit
+    bus.queueWrite(0x7F, REG_ALERT_STATUS, 0x04, NULL, NULL); //data to cause a reset
+    bus.queueWrite(0x7F, REG_ALERT_STATUS, 0x00, NULL, NULL); //data to clear
+}
+
+/*
+ * Broadcast a config register write, but only if at least one module might not already hold that value.
+ */
+bool BMSChain::broadcastConfig(uint8_t reg, uint8_t value)
+{
+    bool needed = false;
+    for (int i = 0; i < activeCount; i++)
+    {
+        if (modules[active[i]].needsWrite(reg, value)) needed = true;
+    }
+    if (!needed) return false;
+    return broadcastWrite(reg, value);
+}
+
+//Broadcast a register write and keep every module's register shadow in step with it
+bool BMSChain::broadcastWrite(uint8_t reg, uint8_t value)
+{
+    if (!bus.queueWrite(0x7F, reg, value, broadcastReply, this)) return false;
+    for (int x = 1; x <= MAX_MODULE_ADDR; x++) modules[x].noteWrite(reg, value);
+    return true;
+}
+
+//If a broadcast didn't make it back we can't be sure which modules got it
+void BMSChain::broadcastReply(void *context, BMSReply &reply)
+{
+    BMSChain *chain = (BMSChain *)context;
+    if (reply.status == BUS_OK) return;
+    for (int x = 1; x <= MAX_MODULE_ADDR; x++) chain->modules[x].invalidateShadow(reply.reg);
+}
+
+//Every attempt but the last one of a good reply went wrong somehow
+void BMSChain::calibrationReply(void *context, BMSReply &reply)
+{
+    BMSChain *chain = (BMSChain *)context;
+    chain->calAttempts += reply.attempts;
+    chain->calBadAttempts += reply.attempts - ((reply.status == BUS_OK) ? 1 : 0);
+}
+
+/*
+ * Sweep the USART divisor either side of where it is now and keep the setting that gets the fewest bad
+ * replies from real snapshot reads. Runs from loop() a step at a time, and while it does the chain's scans,
+ * balancing and searches wait so none of their traffic goes out at a test setting. The whole sweep takes
+ * well under a second. Returns false if the port can't be tuned, there is nothing to talk to or a calibration
+ * is already running. takeBaudCal gives the result once it's done.
+ */
+bool BMSChain::startBaudCal()
+{
+    if (!transport || activeCount == 0 || calStep >= 0) return false;
+    calNominal = transport->getBaudDivisor();
+    if (calNominal == 0) return false;
+
+    calStep = 0;
+    calQueued = 0;
+    calCursor = 0;
+    calDone = false;
+    return true;
+}
+
+bool BMSChain::isCalibrating()
+{
+    return calStep >= 0;
+}
+
+//True once after a calibration finishes, divisor is the one it chose or 0 if the port refused every setting
+bool BMSChain::takeBaudCal(uint16_t &divisor)
+{
+    if (!calDone) return false;
+    calDone = false;
+    divisor = calResult;
+    return true;
+}
+
+//The divisor is only changed with nothing in flight, then BAUD_CAL_READS reads go out at it as the bus has room
+void BMSChain::runBaudCal()
+{
+    if (calQueued == 0 || activeCount == 0)
+    {
+        if (!bus.isIdle()) return;
+        if (calStep > BAUD_CAL_SPAN * 2 || activeCount == 0)
+        {
+            finishBaudCal();
+            return;
+        }
+        if (!transport->setBaudDivisor(calNominal + calStep - BAUD_CAL_SPAN))
+        {
+            calErrors[calStep++] = 0xFFFFFFFF;
+            return;
+        }
+        calAttempts = 0;
+        calBadAttempts = 0;
+    }
+
+    while (calQueued < BAUD_CAL_READS && bus.freeSlots() > BUS_RESERVED_SLOTS)
+    {
+        calCursor = (calCursor + 1) % activeCount;
+        bus.queueRead(active[calCursor] << 1, REG_DEV_STATUS, SNAPSHOT_LEN, calibrationReply, this, BUS_FLAG_CHECK_CRC);
+        calQueued++;
+    }
+    if (calQueued < BAUD_CAL_READS || !bus.isIdle()) return;
+
+    calErrors[calStep] = calBadAttempts;
+    Logger::info("Chain %i baud divisor %i: %i bad attempts out of %i", index, calNominal + calStep - BAUD_CAL_SPAN, 
+                 calBadAttempts, calAttempts);
+    calStep++;
+    calQueued = 0;
+}
+
+/*
+ * The edges of the usable range are marginal so out of the settings that tie for fewest errors the middle of
+ * the longest run of them is taken. If the port refused every setting it goes back to where it started.
+ */
+void BMSChain::finishBaudCal()
+{
+    int steps = calStep; //short of the full sweep if the modules went away part way
+    int best = 0;
+    int bestRun = 0;
+    int bestStart = 0;
+    int run = 0;
+
+    calStep = -1;
+    calDone = true;
+
+    for (int step = 1; step < steps; step++) if (calErrors[step] < calErrors[best]) best = step;
+    if (steps == 0 || calErrors[best] == 0xFFFFFFFF)
+    {
+        transport->setBaudDivisor(calNominal);
+        calResult = 0;
+        Logger::warn("Chain %i baud calibration failed, staying at divisor %i", index, calNominal);
+        return;
+    }
+    for (int step = 0; step < steps; step++)
+    {
+        if (calErrors[step] == calErrors[best]) 
+        {
+            run++;
+            if (run > bestRun)
+            {
+                bestRun = run;
+                bestStart = step - run + 1;
+            }
+        }
+        else run = 0;
+    }
+    best = bestStart + (bestRun - 1) / 2;
+
+    calResult = calNominal + best - BAUD_CAL_SPAN;
+    transport->setBaudDivisor(calResult);
+    Logger::info("Chain %i baud divisor set to %i (%i bad attempts while testing)", index, calResult, calErrors[best]);
+
+    BusCounters totals;
+    bus.getStats().getTotals(totals);
+    checkedTransactions = totals.transactions;
+    checkedErrors = errorCount(totals);
+}
+
+uint32_t BMSChain::errorCount(const BusCounters &counters)
+{
+    return counters.crcErrors + counters.shortReplies + counters.timeouts;
+}
+
+/*
+ * Has the error rate since the last check gone over BAUD_RECAL_PERMILLE? Only answers once BAUD_CHECK_TRANSACTIONS
+ * have gone by so a single bad patch doesn't set off a calibration.
+ */
+bool BMSChain::baudDegraded()
+{
+    BusCounters totals;
+    bus.getStats().getTotals(totals);
+
+    if (totals.transactions < checkedTransactions) //telemetry was cleared
+    {
+        checkedTransactions = totals.transactions;
+        checkedErrors = errorCount(totals);
+        return false;
+    }
+    uint32_t transactions = totals.transactions - checkedTransactions;
+    if (transactions < BAUD_CHECK_TRANSACTIONS) return false;
+    uint32_t errors = errorCount(totals) - checkedErrors;
+
+    checkedTransactions = totals.transactions;
+    checkedErrors = errorCount(totals);
+    return (errors * 1000) > (transactions * BAUD_RECAL_PERMILLE);
+}
+
+void BMSChain::resetLink()
+{
+    linkBreak = 0;
+    searchLow = -1;
+    searchHigh = -1;
+    searchEnd = 0;
+    searchProbe = 0;
+    probePending = false;
+    recoveryScan = false;
+    reconnectAt = 0;
+}
+
+//False for modules past a break in the chain. Those are left out of scans and balancing until the link is back.
+bool BMSChain::isReachable(int addr)
+{
+    return (linkBreak == 0) || (addr < linkBreak);
+}
+
+//First address that can't be reached or 0 if the whole chain is answering
+int BMSChain::getLinkBreak()
+{
+    return linkBreak;
+}
+
+bool BMSChain::isLocatingBreak()
+{
+    return searchHigh >= 0;
+}
+
+//How long the current break has lasted in ms, or how long the last one did if the link is whole
+uint32_t BMSChain::getOutageTime()
+{
+    if (linkBreak > 0) return millis() - brokenSince;
+    return lastOutage;
+}
+
+//Microseconds from the link coming back to the end of the first scan that got an answer from every module
+uint32_t BMSChain::getRecoveryTime()
+{
+    return lastRecovery;
+}
+
+//True once for every time a break is found or heals so it can be reported
+bool BMSChain::takeLinkChange()
+{
+    bool changed = linkChanged;
+    linkChanged = false;
+    return changed;
+}
+
+/*
+ * Call at the end of every scan. A break in the chain silences every module past it so the last module is the one
+ * to watch. If it got nothing back the break is found by bisecting the chain with single byte reads that are only
+ * tried once, which takes 1 + log2(modules) probes, 7 for a full chain. Everything before the break answers and
+ * nothing past it does, so one probe per halving is enough. The halving is over positions in the active list rather
+ * than addresses so gaps left by missing modules never get probed. That relies on the addresses following the
+ * wiring as a renumber leaves them.
+ */
+void BMSChain::checkLink()
+{
+    int tail;
+
+    if (recoveryScan)
+    {
+        bool allAnswered = true;
+        for (int i = 0; i < activeCount; i++)
+        {
+            if (modules[active[i]].isSilent() && !modules[active[i]].isQuarantined()) allAnswered = false;
+        }
+        if (allAnswered)
+        {
+            lastRecovery = micros() - reconnectAt;
+            Logger::info("Chain %i fully scanned %i us after the link came back", index, lastRecovery);
+        }
+        recoveryScan = false;
+        reconnectAt = 0;
+    }
+
+    if (linkBreak > 0 || searchHigh >= 0) return;
+
+    //quarantined modules are only read now and then and their own probe looks after them, so the tail here
+    //is the last module in the normal scan. A break before it still shows up as that module going silent.
+    tail = activeCount - 1;
+    while (tail >= 0 && modules[active[tail]].isQuarantined()) tail--;
+    if (tail < 0 || !modules[active[tail]].isSilent()) return;
+
+    Logger::info("Chain %i: module %i stopped answering, looking for a break in the chain", index, active[tail]);
+    searchLow = -1;
+    searchHigh = tail + 1;
+    searchEnd = tail + 1;
+}
+
+//The tail is checked first so one unlucky read doesn't set off a search of the whole chain
+void BMSChain::queueLinkProbe()
+{
+    int addr;
+    if (linkBreak > 0) addr = linkBreak;
+    else
+    {
+        if (searchHigh == searchEnd) searchProbe = searchHigh - 1;
+        else searchProbe = (searchLow + searchHigh) / 2;
+        addr = active[searchProbe];
+    }
+
+    if (bus.queueRead(addr << 1, REG_DEV_STATUS, 1, linkProbeReply, this, 0, 1)) probePending = true;
+}
+
+//Any reply at all, even a mangled one, means the module is on our side of the break
+void BMSChain::linkProbeReply(void *context, BMSReply &reply)
+{
+    BMSChain *chain = (BMSChain *)context;
+    int addr = (reply.addrByte >> 1) & 0x3F;
+    bool answered = (reply.status != BUS_TIMEOUT);
+
+    chain->probePending = false;
+
+    if (chain->linkBreak > 0)
+    {
+        if (!answered) return;
+        //their health was run down when the link went and whatever they were set to is unknown, so start them fresh
+        for (int x = chain->linkBreak; x <= MAX_MODULE_ADDR; x++) if (chain->modules[x].isExisting()) chain->modules[x].setExists(true);
+        chain->lastOutage = millis() - chain->brokenSince;
+        chain->reconnectAt = micros();
+        //otherwise they have already been passed over this scan
+        chain->recoveryScan = (chain->scanCursor < chain->activeCount) && (chain->scanCursor < 0 || chain->active[chain->scanCursor] <= chain->linkBreak);
+        Logger::info("Chain %i: module %i is answering again, link restored after %l ms", chain->index, addr, chain->lastOutage);
+        chain->linkBreak = 0;
+        chain->linkChanged = true;
+        return;
+    }
+
+    if (chain->searchHigh < 0) return; //search was called off by a renumber or the modules changing
+
+    if (answered) chain->searchLow = chain->searchProbe;
+    else chain->searchHigh = chain->searchProbe;
+    if (chain->searchHigh - chain->searchLow > 1) return; //loop() sends the next probe
+
+    if (chain->searchHigh == chain->searchEnd) Logger::info("Chain %i: last module answered after all, chain is intact", chain->index);
+    else
+    {
+        chain->linkBreak = chain->active[chain->searchHigh];
+        chain->brokenSince = millis();
+        chain->linkChanged = true;
+        if (chain->searchLow < 0) Logger::warn("Chain %i is broken between the BMS board and module %i", chain->index, chain->linkBreak);
+        else Logger::warn("Chain %i is broken between module %i and module %i", chain->index, chain->active[chain->searchLow], chain->linkBreak);
+        Logger::warn("Modules from %i on are only probed until the link is fixed", chain->linkBreak);
+    }
+    chain->searchHigh = -1;
+}
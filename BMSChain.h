@@ -0,0 +1,113 @@
+#pragma once
+#include "config.h"
+#include "BMSModule.h"
+#include "BMSBus.h"
+
+/*
+ * One daisy chain of modules on its own serial port. Every chain has its own bus, address space (1-62) and
+ * module table so the chains never wait on each other. BMSModuleManager runs all of them side by side and
+ * presents them to everything else as a single pack.
+ */
+class BMSChain
+{
+public:
+    BMSChain();
+    void loop();
+    void setIndex(int chainIndex);
+    void setTransport(BMSTransport *port);
+    BMSTransport *getTransport();
+    BMSBus &getBus();
+    BMSModule &getModule(int addr);
+    int getNumFoundModules();
+    int getActiveCount();
+    int getActiveAddress(int n);
+    uint16_t getLayoutVersion();
+    void setupBoards();
+    void findBoards();
+    bool isDiscovering();
+    void renumberBoardIDs();
+    bool restoreBoards(const uint8_t *addressMap);
+    void getAddressMap(uint8_t *addressMap);
+    void clearFaults();
+    void sleepBoards();
+    void wakeBoards();
+    void startScan(uint8_t mode, bool withStatus, bool verify, bool probe);
+    void startBalance();
+    void startEnumerate();
+    bool isEnumerating();
+    bool isScanDone();
+    bool startBaudCal();
+    bool isCalibrating();
+    bool takeBaudCal(uint16_t &divisor);
+    bool baudDegraded();
+    void checkLink();
+    bool isReachable(int addr);
+    int getLinkBreak();
+    bool isLocatingBreak();
+    uint32_t getOutageTime();
+    uint32_t getRecoveryTime();
+    bool takeLinkChange();
+
+private:
+    BMSModule modules[MAX_MODULE_ADDR + 1]; // store data for as many modules as we've configured for.
+    int numFoundModules;                    // The number of modules that seem to exist
+    uint8_t active[MAX_MODULE_ADDR];        // addresses of the modules that exist, lowest first
+    int activeCount;                        // entries in active, same as numFoundModules
+    uint16_t layoutVersion;                 // bumped whenever active changes
+    int index;                              // which chain this is, only used for log messages
+    BMSBus bus;
+    BMSTransport *transport;
+    int balanceCursor;                      // position in active of the next module to queue balancing for, past the end when idle
+    int scanCursor;                         // position in active of the next module to read, -1 if the broadcast conversion is still to be queued
+    uint8_t scanMode;                       // mode the scan in progress was started with
+    bool scanWithStatus;                    // broadcast scans also pick up the status registers
+    bool scanVerify;                        // read back the config registers of every module this scan
+    bool scanProbe;                         // quarantined modules are included this scan
+    uint32_t checkedTransactions;           // bus totals when the error rate was last checked
+    uint32_t checkedErrors;
+    int calStep;                            // divisor step being tested while calibrating, -1 when not calibrating
+    int calQueued;                          // reads queued so far at this step
+    int calCursor;                          // position in active of the last module read while calibrating
+    uint16_t calNominal;                    // divisor before calibration started, the steps are either side of it
+    uint32_t calAttempts;                   // bus attempts at this step and how many of them went wrong
+    uint32_t calBadAttempts;
+    uint32_t calErrors[(BAUD_CAL_SPAN * 2) + 1]; // bad attempts at each step, 0xFFFFFFFF where the port refused the divisor
+    bool calDone;                           // calibration finished since takeBaudCal was last called
+    uint16_t calResult;                     // divisor it settled on, 0 if none could be used
+    int linkBreak;                          // first address that can't be reached, 0 while the whole chain answers
+    int searchLow;                          // while locating a break: position in active of the last module known to answer, -1 for just us
+    int searchHigh;                         // position of the first module known not to answer, -1 when not locating
+    int searchEnd;                          // one past the position of the silent module that started the search, it is probed first
+    int searchProbe;                        // position of the module the search probe on the bus went to
+    bool probePending;                      // a link probe is on the bus
+    bool linkChanged;                       // a break was found or has healed since takeLinkChange was last called
+    bool recoveryScan;                      // the scan in progress is the first since the link came back
+    uint32_t brokenSince;                   // millis() when the break was found
+    uint32_t lastOutage;                    // how long the last break lasted in ms
+    uint32_t reconnectAt;                   // micros() when a probe past the break first got an answer, 0 if not recovering
+    uint32_t lastRecovery;                  // us from that answer to the end of the first scan every module answered
+    bool enumerating;                       // background check of address 0 for new modules is on the bus
+    int discoverCursor;                     // next address findBoards will probe, 0 when it isn't running
+    int discoverMisses;                     // addresses in a row that haven't answered
+    bool discoverPending;                   // a discovery probe is on the bus
+    uint32_t discoverStart;                 // micros() when findBoards started
+
+    bool broadcastConfig(uint8_t reg, uint8_t value);
+    bool broadcastWrite(uint8_t reg, uint8_t value);
+    static void broadcastReply(void *context, BMSReply &reply);
+    static void calibrationReply(void *context, BMSReply &reply);
+    void runBaudCal();
+    void finishBaudCal();
+    static uint32_t errorCount(const BusCounters &counters);
+    void rebuildActive();
+    void resetLink();
+    void queueLinkProbe();
+    static void linkProbeReply(void *context, BMSReply &reply);
+    void queueEnumerateCheck();
+    int nextFreeAddress();
+    void queueDiscoverProbe();
+    static void discoverReply(void *context, BMSReply &reply);
+    static void enumerateReply(void *context, BMSReply &reply);
+    static void addressReply(void *context, BMSReply &reply);
+    static void verifyReply(void *context, BMSReply &reply);
+};
@@ -0,0 +1,40 @@
+#include "BMSFilter.h"
+
+uint16_t BMSFilter::median3(uint16_t a, uint16_t b, uint16_t c)
+{
+    if (a > b) { uint16_t t = a; a = b; b = t; }
+    if (b > c) b = c;
+    return (a > b) ? a : b;
+}
+
+/*
+ * Run one new reading through the filter and return the cleaned up value. primed is how many readings
+ * this channel has had before this one, capped at FILTER_PRIME. The very first reading is taken as is.
+ */
+uint16_t BMSFilter::apply(FilterState &state, uint16_t raw, uint8_t primed, const FilterConfig &config)
+{
+    int32_t value = raw;
+
+    if (primed == 0)
+    {
+        state.recent[0] = raw;
+        state.recent[1] = raw;
+        state.acc = value << FILTER_FRAC_BITS;
+        return raw;
+    }
+
+    //with only one reading before this one the median of three would just be one of the two, so skip it
+    if (config.median && primed >= FILTER_PRIME) value = median3(raw, state.recent[0], state.recent[1]);
+    state.recent[1] = state.recent[0];
+    state.recent[0] = raw;
+
+    int32_t out = (state.acc + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+    if (config.maxStep)
+    {
+        if (value > out + config.maxStep) value = out + config.maxStep;
+        if (value < out - config.maxStep) value = out - config.maxStep;
+    }
+
+    state.acc += ((value << FILTER_FRAC_BITS) - state.acc) >> config.shift;
+    return (state.acc + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FILTER_FRAC_BITS    8   //fraction bits kept in the low pass so small steps aren't lost to rounding
+#define FILTER_PRIME        2   //samples a channel needs before the median has a full window
+
+typedef struct {
+    uint8_t median;     //1 to take the median of the last 3 readings first
+    uint8_t shift;      //low pass, each sample moves the output 1/2^shift of the way to it. 0 for none
+    uint16_t maxStep;   //most the output may move in one sample in counts. 0 for no limit
+} FilterConfig;
+
+typedef struct {
+    uint16_t recent[2]; //the last two raw readings, newest first
+    int32_t acc;        //low pass output << FILTER_FRAC_BITS
+} FilterState;
+
+/*
+ * Cleans up a stream of raw ADC counts in integer arithmetic only. A 3 sample median throws out single
+ * reading spikes, the rate clamp stops anything that gets past it from moving the output more than a set
+ * amount per sample, and a first order low pass smooths what is left. Each stage can be turned off.
+ * The state has no idea how many samples it has seen so the caller passes that in as primed, which lets
+ * every channel of a module share one count.
+ */
+class BMSFilter
+{
+public:
+    static uint16_t apply(FilterState &state, uint16_t raw, uint8_t primed, const FilterConfig &config);
+    static uint16_t median3(uint16_t a, uint16_t b, uint16_t c);
+};
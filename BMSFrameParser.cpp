@@ -0,0 +1,110 @@
+#include "BMSFrameParser.h"
+
+BMSFrameParser::BMSFrameParser()
+{
+    discarded = 0;
+    filter = false;
+    expectAddr = 0;
+    expectReg = 0;
+    reset();
+}
+
+//Forget any partial frame and stop filtering on a particular reply
+void BMSFrameParser::reset()
+{
+    len = 0;
+    frameLen = 0;
+    crc.reset();
+    crcBeforeLast = 0;
+    filter = false;
+}
+
+/*
+ * Only accept a frame that answers a request starting with addrByte and reg. The modules can set the top bit
+ * of the address (0x80 from unaddressed boards) and set bit 0 on write echos so only the address bits are compared.
+ */
+void BMSFrameParser::expect(uint8_t addrByte, uint8_t reg)
+{
+    reset();
+    filter = true;
+    expectAddr = addrByte & 0x7E;
+    expectReg = reg;
+}
+
+int BMSFrameParser::pending()
+{
+    return len;
+}
+
+const uint8_t *BMSFrameParser::buffer()
+{
+    return buff;
+}
+
+uint32_t BMSFrameParser::getDiscarded()
+{
+    return discarded;
+}
+
+//Add a byte to the frame under construction. Returns false if the byte can't be the start of a frame
+bool BMSFrameParser::accept(uint8_t data)
+{
+    if (len == 0)
+    {
+        if (filter && (data & 0x7E) != expectAddr) return false;
+        frameLen = (data & 1) ? 4 : 0;
+        crc.reset();
+    }
+    else if (len == 1)
+    {
+        if (filter && data != expectReg) return false;
+    }
+    else if (len == 2 && frameLen == 0)
+    {
+        if (data + 4 > FRAME_MAX_LEN) return false;
+        frameLen = data + 4;
+    }
+
+    buff[len++] = data;
+    crcBeforeLast = crc.get();
+    crc.update(data);
+    return true;
+}
+
+/*
+ * Feed one received byte in. Returns true and fills in frame when that byte completes a frame.
+ */
+bool BMSFrameParser::feed(uint8_t data, BMSFrame &frame)
+{
+    if (!accept(data))
+    {
+        if (len == 0) 
+        {
+            discarded++;
+            return false;
+        }
+        //The header went bad part way through. Drop what we had and see if this byte starts a new frame instead
+        discarded += len;
+        len = 0;
+        if (!accept(data))
+        {
+            discarded++;
+            return false;
+        }
+    }
+
+    if (frameLen == 0 || len < frameLen) return false;
+
+    frame.data = buff;
+    frame.length = len;
+    frame.addrByte = buff[0];
+    frame.reg = buff[1];
+    frame.isWrite = (buff[0] & 1);
+    frame.payload = frame.isWrite ? &buff[2] : &buff[3];
+    frame.payloadLen = frame.isWrite ? 1 : buff[2];
+    frame.crcGood = (buff[len - 1] == crcBeforeLast);
+
+    len = 0;
+    frameLen = 0;
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include "CRC8.h"
+
+#define FRAME_MAX_LEN   48  //3 header bytes + up to 44 data bytes + CRC
+
+/*
+ * View of one complete frame from the module bus. The pointers point into the parser that produced
+ * the frame and stay valid until that parser is fed again or reset.
+ */
+typedef struct {
+    const uint8_t *data;        //whole frame starting at the address byte
+    uint8_t length;             //total bytes including the CRC
+    uint8_t addrByte;
+    uint8_t reg;
+    const uint8_t *payload;     //data bytes for a read reply, the written value for a write echo
+    uint8_t payloadLen;
+    bool isWrite;
+    bool crcGood;
+} BMSFrame;
+
+/*
+ * Reassembles replies from the module bus one byte at a time. Replies to reads are address, register,
+ * length, data, CRC. Writes are echoed back as address, register, value, CRC. An odd address byte marks
+ * a write. The CRC is folded in as each byte arrives so it is known the moment the frame is complete.
+ *
+ * When told what reply to expect it drops anything that can't be the start of that reply. That way stray
+ * bytes left over from a previous transaction can't be mistaken for the next one.
+ *
+ * Plain C++ with no Arduino dependencies so it can be built and exercised on a PC.
+ */
+class BMSFrameParser
+{
+public:
+    BMSFrameParser();
+    void reset();
+    void expect(uint8_t addrByte, uint8_t reg);
+    bool feed(uint8_t data, BMSFrame &frame);
+    int pending();
+    const uint8_t *buffer();
+    uint32_t getDiscarded();
+
+private:
+    uint8_t buff[FRAME_MAX_LEN];
+    uint8_t len;
+    uint8_t frameLen;           //0 until the header says how long the frame is
+    CRC8 crc;
+    uint8_t crcBeforeLast;
+    bool filter;
+    uint8_t expectAddr;
+    uint8_t expectReg;
+    uint32_t discarded;         //bytes thrown away while looking for a frame start
+
+    bool accept(uint8_t data);
+};
@@ -0,0 +1,175 @@
+#include "BMSHistory.h"
+#include <string.h>
+
+static_assert((HISTORY_SAMPLES % 2) == 0 && HISTORY_SAMPLES <= 255, "HISTORY_SAMPLES has to be even and fit in a byte");
+static_assert(HISTORY_DECIMATION <= 16, "the decimation sums are 16 bit");
+static_assert(HISTORY_TIERS >= 1 && HISTORY_TIERS <= 8, "one bit per tier in due and fresh");
+static_assert(HISTORY_ESCAPES >= 1 && HISTORY_ESCAPES <= 255, "the escape ring is indexed with a byte");
+
+BMSHistory::BMSHistory()
+{
+    clear();
+}
+
+//Forget everything. Needed whenever the channels stop lining up with the same cells
+void BMSHistory::clear()
+{
+    memset(channels, 0, sizeof(channels));
+    memset(times, 0, sizeof(times));
+    memset(head, 0, sizeof(head));
+    memset(filled, 0, sizeof(filled));
+    due = 0;
+    fresh = 0;
+    scans = 0;
+}
+
+/*
+ * Call once a scan before adding that scan's readings. Moves on a slot in the first tier and in
+ * every tier whose turn it is, so add() only has to fill in the new slots.
+ */
+void BMSHistory::startSample(uint32_t now)
+{
+    uint32_t every = 1;
+    due = 0;
+    fresh = 0;
+    for (int t = 0; t < HISTORY_TIERS; t++)
+    {
+        if ((scans % every) == (every - 1))
+        {
+            due |= (1 << t);
+            if (filled[t] == 0) fresh |= (1 << t);
+            else head[t] = (head[t] + 1) % HISTORY_SAMPLES;
+            if (filled[t] < HISTORY_SAMPLES) filled[t]++;
+            times[t][head[t]] = now;
+        }
+        every *= HISTORY_DECIMATION;
+    }
+    scans++;
+}
+
+void BMSHistory::add(int channel, uint16_t counts)
+{
+    if (channel < 0 || channel >= HISTORY_CHANNELS) return;
+    HistoryChannel &ch = channels[channel];
+    uint16_t value = counts >> HISTORY_SHIFT;
+
+    for (int t = 0; t < HISTORY_TIERS; t++)
+    {
+        if (!(due & (1 << t))) break; //a tier can only be due when the one below it is
+        if (t > 0)
+        {
+            value = (ch.sum[t - 1] + (HISTORY_DECIMATION / 2)) / HISTORY_DECIMATION;
+            ch.sum[t - 1] = 0;
+        }
+        push(ch, t, value);
+        if (t < HISTORY_TIERS - 1) ch.sum[t] += value;
+    }
+}
+
+void BMSHistory::push(HistoryChannel &ch, int tier, uint16_t value)
+{
+    int step = 0;
+    uint8_t nibble;
+
+    //the step being written over belonged to a sample that has just dropped out
+    if (nibbleAt(ch, tier, head[tier]) == HISTORY_ESCAPE && ch.escapeCount[tier] > 0) ch.escapeCount[tier]--;
+
+    if (fresh & (1 << tier)) ch.last[tier] = value;
+    else step = (int)value - (int)ch.last[tier];
+
+    if (step >= -7 && step <= 7) nibble = step & 0x0F;
+    else if (ch.escapeCount[tier] < HISTORY_ESCAPES)
+    {
+        ch.escapes[tier][ch.escapeNext[tier]] = step;
+        ch.escapeNext[tier] = (ch.escapeNext[tier] + 1) % HISTORY_ESCAPES;
+        ch.escapeCount[tier]++;
+        nibble = HISTORY_ESCAPE;
+    }
+    else
+    {
+        step = (step > 0) ? 7 : -7;
+        nibble = step & 0x0F;
+    }
+    ch.last[tier] += step;
+
+    uint8_t &slot = ch.deltas[tier][head[tier] >> 1];
+    if (head[tier] & 1) slot = (slot & 0x0F) | (nibble << 4);
+    else slot = (slot & 0xF0) | nibble;
+}
+
+uint8_t BMSHistory::nibbleAt(const HistoryChannel &ch, int tier, int slot)
+{
+    uint8_t nibble = ch.deltas[tier][slot >> 1];
+    return (slot & 1) ? (nibble >> 4) : (nibble & 0x0F);
+}
+
+//How far back a tier currently goes in ms
+uint32_t BMSHistory::getSpan(int tier)
+{
+    if (tier < 0 || tier >= HISTORY_TIERS || filled[tier] == 0) return 0;
+    int oldest = (head[tier] + HISTORY_SAMPLES - filled[tier] + 1) % HISTORY_SAMPLES;
+    return times[tier][head[tier]] - times[tier][oldest];
+}
+
+/*
+ * Figures for the last window ms of a channel, from the finest tier that goes back that far or, if none
+ * does yet, the one that goes back furthest. Walks back from the newest sample undoing each step.
+ * False if the channel doesn't exist or nothing has been stored yet.
+ */
+bool BMSHistory::getWindow(int channel, uint32_t window, HistoryWindow &result)
+{
+    if (channel < 0 || channel >= HISTORY_CHANNELS || filled[0] == 0) return false;
+    const HistoryChannel &ch = channels[channel];
+
+    int tier = 0;
+    for (int t = 0; t < HISTORY_TIERS; t++)
+    {
+        if (filled[t] == 0) break;
+        if (getSpan(t) > getSpan(tier)) tier = t;
+        if (getSpan(t) >= window) 
+        {
+            tier = t;
+            break;
+        }
+    }
+
+    uint32_t newest = times[tier][head[tier]];
+    int slot = head[tier];
+    int value = ch.last[tier];
+    int escape = ch.escapeNext[tier];
+    float sumT = 0.0f, sumV = 0.0f, sumTT = 0.0f, sumTV = 0.0f;
+
+    result.tier = tier;
+    result.samples = 0;
+    result.minimum = 0xFFFF;
+    result.maximum = 0;
+    result.newest = value << HISTORY_SHIFT;
+    for (int n = 0; n < filled[tier]; n++)
+    {
+        uint32_t age = newest - times[tier][slot];
+        if (age > window) break;
+        float t = age / -1000.0f;
+        sumT += t;
+        sumV += value;
+        sumTT += t * t;
+        sumTV += t * value;
+        if ((value << HISTORY_SHIFT) < result.minimum) result.minimum = value << HISTORY_SHIFT;
+        if ((value << HISTORY_SHIFT) > result.maximum) result.maximum = value << HISTORY_SHIFT;
+        result.oldest = value << HISTORY_SHIFT;
+        result.span = age;
+        result.samples++;
+        uint8_t nibble = nibbleAt(ch, tier, slot);
+        if (nibble == HISTORY_ESCAPE)
+        {
+            escape = (escape + HISTORY_ESCAPES - 1) % HISTORY_ESCAPES;
+            value -= ch.escapes[tier][escape];
+        }
+        else value -= (nibble & 0x08) ? (int)nibble - 16 : nibble;
+        slot = (slot + HISTORY_SAMPLES - 1) % HISTORY_SAMPLES;
+    }
+
+    float denom = (result.samples * sumTT) - (sumT * sumT);
+    result.slope = 0.0f;
+    if (result.samples > 1 && denom != 0.0f) result.slope = (((result.samples * sumTV) - (sumT * sumV)) / denom) * (1 << HISTORY_SHIFT);
+    return true;
+}
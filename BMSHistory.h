@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+#define HISTORY_CHANNELS        (HISTORY_MODULES * 8)   //6 cells then the 2 thermistors of each module
+#define HISTORY_ESCAPE          0x08                    //step nibble meaning the step is kept whole in escapes
+
+typedef struct {
+    uint8_t deltas[HISTORY_TIERS][HISTORY_SAMPLES / 2]; //two 4 bit steps a byte, the step into each sample from the one before
+    uint16_t last[HISTORY_TIERS];                       //newest sample in each tier, in counts >> HISTORY_SHIFT
+    uint16_t sum[HISTORY_TIERS - 1];                    //samples gathered towards the next one in the tier above
+    int16_t escapes[HISTORY_TIERS][HISTORY_ESCAPES];    //whole steps for HISTORY_ESCAPE nibbles, a ring per tier
+    uint8_t escapeNext[HISTORY_TIERS];                  //where the next one goes in the ring
+    uint8_t escapeCount[HISTORY_TIERS];                 //ring entries still needed to walk back over the kept samples
+} HistoryChannel;
+
+//What a channel did over a window. Values are raw counts, the slope is counts per second
+typedef struct {
+    int samples;        //0 if there is no history yet
+    int tier;           //which tier the figures came from
+    uint32_t span;      //ms from the oldest sample used to the newest
+    uint16_t minimum;
+    uint16_t maximum;
+    uint16_t oldest;
+    uint16_t newest;
+    float slope;        //least squares fit over every sample in the window
+} HistoryWindow;
+
+/*
+ * Rolling history of every cell and thermistor reading, one sample a scan. Each sample is stored as a 4 bit
+ * step from the one before so a channel costs a quarter of what raw counts would. A step too big for 4 bits,
+ * like the jump when the pack is loaded, is marked with HISTORY_ESCAPE and kept whole in a small ring so it
+ * comes back exactly. Only if more than HISTORY_ESCAPES of them are in a tier's samples at once is a step
+ * clamped, with the rest made up over the following samples, so the stored values never drift away from
+ * the real ones. Every tier above the first holds the mean of HISTORY_DECIMATION samples of the tier
+ * below, so longer windows are answered from fewer, smoother samples. Appending is the same small amount
+ * of work for every channel every scan however much history there is.
+ */
+class BMSHistory
+{
+public:
+    BMSHistory();
+    void clear();
+    void startSample(uint32_t now);
+    void add(int channel, uint16_t counts);
+    bool getWindow(int channel, uint32_t window, HistoryWindow &result);
+    uint32_t getSpan(int tier);
+
+private:
+    HistoryChannel channels[HISTORY_CHANNELS];
+    uint32_t times[HISTORY_TIERS][HISTORY_SAMPLES]; //millis() of each sample, shared by every channel
+    uint8_t head[HISTORY_TIERS];                    //slot of the newest sample
+    uint8_t filled[HISTORY_TIERS];
+    uint8_t due;                                    //bit for each tier taking a sample this scan
+    uint8_t fresh;                                  //bit for each tier taking its very first sample this scan
+    uint32_t scans;
+
+    void push(HistoryChannel &ch, int tier, uint16_t value);
+    uint8_t nibbleAt(const HistoryChannel &ch, int tier, int slot);
+};
@@ -1,7 +1,7 @@
 #include "config.h"
 #include "BMSModule.h"
-#include "BMSUtil.h"
 #include "Logger.h"
+#include "ModuleDecode.h"
 
 extern EEPROMSettings settings;
 
@@ -9,39 +9,70 @@ BMSModule::BMSModule()
 {
     for (int i = 0; i < 6; i++)
     {
-        cellVolt[i] = 0.0f;
-        lowestCellVolt[i] = 5.0f;
-        highestCellVolt[i] = 0.0f;
+        cellCounts[i] = 0;
+        rawCellCounts[i] = 0;
+        lowestCellCounts[i] = NO_MIN_COUNTS;
+        highestCellCounts[i] = NO_MAX_COUNTS;
         balanceState[i] = 0;
     }
-    moduleVolt = 0.0f;
-    temperatures[0] = 0.0f;
-    temperatures[1] = 0.0f;
-    lowestTemperature = 200.0f;
-    highestTemperature = -100.0f;
-    lowestModuleVolt = 200.0f;
-    highestModuleVolt = 0.0f;
+    moduleCounts = 0;
+    rawModuleCounts = 0;
+    lowestModuleCounts = NO_MIN_COUNTS;
+    highestModuleCounts = NO_MAX_COUNTS;
+    for (int i = 0; i < 2; i++)
+    {
+        tempCounts[i] = 0;
+        rawTempCounts[i] = 0;
+        lowestTempCounts[i] = NO_MIN_COUNTS;
+        highestTempCounts[i] = NO_MAX_COUNTS;
+    }
     exists = false;
     moduleAddress = 0;
     goodPackets = 0;
     badPackets = 0;
+    bus = NULL;
+    shadowValid = 0;
+    balanceWritten = 0;
+    health = HEALTH_MAX;
+    quarantined = false;
+    silent = false;
+    filterPrimed = 0;
+}
+
+void BMSModule::setBus(BMSBus *moduleBus)
+{
+    bus = moduleBus;
 }
 
 /*
 Reading the status of the board to identify any flags, will be more useful when implementing a sleep cycle
 */
-void BMSModule::readStatus()
+bool BMSModule::readStatus()
 {
-  uint8_t payload[3];
-  uint8_t buff[8];
-  payload[0] = moduleAddress << 1; //adresss
-  payload[1] = REG_ALERT_STATUS;//Alert Status start
-  payload[2] = 0x04;
-  BMSUtil::sendDataWithReply(payload, 3, false, buff, 7);
-  alerts = buff[3];
-  faults = buff[4];
-  COVFaults = buff[5];
-  CUVFaults = buff[6];
+    return bus->queueRead(moduleAddress << 1, REG_ALERT_STATUS, 0x04, statusReply, this, waitFlags(), attemptBudget()); //Alert Status start, 4 registers
+}
+
+void BMSModule::statusReply(void *context, BMSReply &reply)
+{
+    ((BMSModule *)context)->noteResult(reply);
+    ((BMSModule *)context)->decodeStatus(reply);
+}
+
+void BMSModule::decodeStatus(BMSReply &reply)
+{
+    if (reply.length < 7 || reply.status != BUS_OK) return;
+    decodeStatusRegs(&reply.data[3]);
+}
+
+//regs points at the four status registers starting with REG_ALERT_STATUS
+void BMSModule::decodeStatusRegs(const uint8_t *regs)
+{
+    alerts = regs[0];
+    faults = regs[1];
+    COVFaults = regs[2];
+    CUVFaults = regs[3];
+    if (faults & 0x08) invalidateShadow(); //power on reset, config registers are back to their defaults
+    Logger::debug("Module %i   alerts=%X   faults=%X   COV=%X   CUV=%X", moduleAddress, alerts, faults, COVFaults, CUVFaults);
 }
 
 uint8_t BMSModule::getFaults()
@@ -85,186 +116,330 @@ void BMSModule::readSetpoint()
   Tset = 35 + (5 * (buff[9] >> 4));
 } */
 
+/*
+Queues up everything needed to get a fresh set of readings. The values are decoded once the final reply
+comes back which will be some time after this returns. Returns false if the bus didn't have room.
+*/
 bool BMSModule::readModuleValues()
 {
-    uint8_t payload[4];
-    uint8_t buff[50];
-    uint8_t calcCRC;
-    bool retVal = false;
-    int retLen;
-    float tempCalc;
-    float tempTemp;
+    uint8_t addrByte = moduleAddress << 1;
 
-    payload[0] = moduleAddress << 1;
+    if (bus->freeSlots() < MODULE_READ_TRANSACTIONS) return false;
 
-    readStatus();
-    Logger::debug("Module %i   alerts=%X   faults=%X   COV=%X   CUV=%X", moduleAddress, alerts, faults, COVFaults, CUVFaults);
+    if (settings.readMode != READ_SNAPSHOT) readStatus(); //the snapshot brings the status along with it
 
-    payload[1] = REG_ADC_CTRL;
-    payload[2] = 0b00111101; //ADC Auto mode, read every ADC input we can (Both Temps, Pack, 6 cells)
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 3);
+    writeRegister(REG_ADC_CTRL, ADC_CTRL_SETTING);
+    writeRegister(REG_IO_CTRL, IO_CTRL_SETTING);
+    bus->queueWrite(addrByte, REG_ADC_CONV, 1, writeReply, this, waitFlags(), attemptBudget()); //start all ADC conversions
+    bus->queuePause(ADC_CONVERSION_US);
 
-    payload[1] = REG_IO_CTRL;
-    payload[2] = 0b00000011; //enable temperature measurement VSS pins
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 3);
+    readConversionResults(false);
 
-    payload[1] = REG_ADC_CONV; //start all ADC conversions
-    payload[2] = 1;
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 3);
+     //turning the temperature wires off here seems to cause weird temperature glitches
+   // bus->queueWrite(addrByte, REG_IO_CTRL, 0b00000000, NULL, NULL); //turn off temperature measurement pins
 
-    payload[1] = REG_GPAI; //start reading registers at the module voltage registers
-    payload[2] = 0x12; //read 18 bytes (Each value takes 2 - ModuleV, CellV1-6, Temp1, Temp2)
-    retLen = BMSUtil::sendDataWithReply(payload, 3, false, buff, 22);
+    return true;
+}
 
-    calcCRC = BMSUtil::genCRC(buff, retLen-1);
-    Logger::debug("Sent CRC: %x     Calculated CRC: %x", buff[21], calcCRC);
+/*
+Queues the read of the results of a conversion that has already been started, either by readModuleValues
+or by a broadcast conversion to the whole pack. Optionally picks up the status registers too. 
+In snapshot mode the status and results come back together in a single read.
+*/
+bool BMSModule::readConversionResults(bool withStatus)
+{
+    if (bus->freeSlots() < MODULE_RESULT_TRANSACTIONS) return false;
+
+    if (settings.readMode == READ_SNAPSHOT)
+    {
+        return bus->queueRead(moduleAddress << 1, REG_DEV_STATUS, SNAPSHOT_LEN, snapshotReply, this, BUS_FLAG_CHECK_CRC | waitFlags(), attemptBudget());
+    }
+
+    if (withStatus) readStatus();
+
+    //start reading registers at the module voltage registers
+    //read 18 bytes (Each value takes 2 - ModuleV, CellV1-6, Temp1, Temp2)
+    bus->queueRead(moduleAddress << 1, REG_GPAI, MEASUREMENT_LEN, valuesReply, this, BUS_FLAG_CHECK_CRC | waitFlags(), attemptBudget());
+    return true;
+}
+
+void BMSModule::valuesReply(void *context, BMSReply &reply)
+{
+    ((BMSModule *)context)->noteResult(reply);
+    ((BMSModule *)context)->decodeValues(reply);
+}
+
+void BMSModule::decodeValues(BMSReply &reply)
+{
+    const uint8_t *buff = reply.data;
 
     //18 data bytes, address, command, length, and CRC = 22 bytes returned
-    //Also validate CRC to ensure we didn't get garbage data.
-    if ( (retLen == 22) && (buff[21] == calcCRC) )
+    //The bus already validated the CRC to ensure we didn't get garbage data.
+    //Also ensure this is actually the reply to our intended query
+    if ( (reply.length == 22) && (reply.status == BUS_OK) && 
+         buff[0] == (moduleAddress << 1) && buff[1] == REG_GPAI && buff[2] == MEASUREMENT_LEN)
     {
-        if (buff[0] == (moduleAddress << 1) && buff[1] == REG_GPAI && buff[2] == 0x12) //Also ensure this is actually the reply to our intended query
-        {
-            //payload is 2 bytes gpai, 2 bytes for each of 6 cell voltages, 2 bytes for each of two temperatures (18 bytes of data)
-            moduleVolt = (buff[3] * 256 + buff[4]) * 0.002034609f;
-            if (moduleVolt > highestModuleVolt) highestModuleVolt = moduleVolt;
-            if (moduleVolt < lowestModuleVolt) lowestModuleVolt = moduleVolt;            
-            for (int i = 0; i < 6; i++) 
-            {
-                cellVolt[i] = (buff[5 + (i * 2)] * 256 + buff[6 + (i * 2)]) * 0.000381493f;
-                if (lowestCellVolt[i] > cellVolt[i]) lowestCellVolt[i] = cellVolt[i];
-                if (highestCellVolt[i] < cellVolt[i]) highestCellVolt[i] = cellVolt[i];
-            }
-
-            //Now using steinhart/hart equation for temperatures. We'll see if it is better than old code.
-            tempTemp = (1.78f / ((buff[17] * 256 + buff[18] + 2) / 33046.0f) - 3.57f);
-            tempTemp *= 1000.0f;
-            tempCalc =  1.0f / (0.0007610373573f + (0.0002728524832 * logf(tempTemp)) + (powf(logf(tempTemp), 3) * 0.0000001022822735f));            
-
-            temperatures[0] = tempCalc - 273.15f;            
-
-            tempTemp = 1.78f / ((buff[19] * 256 + buff[20] + 9) / 33068.0f) - 3.57f;
-            tempTemp *= 1000.0f;
-            tempCalc = 1.0f / (0.0007610373573f + (0.0002728524832 * logf(tempTemp)) + (powf(logf(tempTemp), 3) * 0.0000001022822735f));
-            temperatures[1] = tempCalc - 273.15f;
-
-            if (getLowTemp() < lowestTemperature) lowestTemperature = getLowTemp();
-            if (getHighTemp() > highestTemperature) highestTemperature = getHighTemp();
-
-            Logger::debug("Got voltage and temperature readings");
-            goodPackets++;
-            retVal = true;
-        }
+        decodeMeasurements(&buff[3]);
+        goodPackets++;
     }
     else
     {
-        Logger::error("Invalid module response received for module %i  len: %i   crc: %i   calc: %i", 
-                      moduleAddress, retLen, buff[21], calcCRC);
+        Logger::error("Invalid module response received for module %i  len: %i   status: %i", 
+                      moduleAddress, reply.length, reply.status);
         badPackets++;
     }
 
     Logger::debug("Good RX: %d       Bad RX: %d", goodPackets, badPackets);
+}
 
-     //turning the temperature wires off here seems to cause weird temperature glitches
-   // payload[1] = REG_IO_CTRL;
-   // payload[2] = 0b00000000; //turn off temperature measurement pins
-   // BMSUtil::sendData(payload, 3, true);
-   // delay(3);        
-   // BMSUtil::getReply(buff, 50);    //TODO: we're not validating the reply here. Perhaps check to see if a valid reply came back    
+void BMSModule::snapshotReply(void *context, BMSReply &reply)
+{
+    ((BMSModule *)context)->noteResult(reply);
+    ((BMSModule *)context)->decodeSnapshot(reply);
+}
+
+/*
+The snapshot is every register from REG_DEV_STATUS through REG_CUV_FAULT in one go. 36 data bytes, 
+address, command, length, and CRC = 40 bytes returned. Measurements start at register 1 and the status 
+registers at 0x20 so they can be decoded straight out of the reply.
+*/
+void BMSModule::decodeSnapshot(BMSReply &reply)
+{
+    const uint8_t *buff = reply.data;
+
+    if ( (reply.length == SNAPSHOT_LEN + 4) && (reply.status == BUS_OK) && 
+         buff[0] == (moduleAddress << 1) && buff[1] == REG_DEV_STATUS && buff[2] == SNAPSHOT_LEN)
+    {
+        decodeStatusRegs(&buff[3 + REG_ALERT_STATUS]);
+        decodeMeasurements(&buff[3 + REG_GPAI]);
+        goodPackets++;
+    }
+    else
+    {
+        Logger::error("Invalid snapshot received for module %i  len: %i   status: %i", 
+                      moduleAddress, reply.length, reply.status);
+        badPackets++;
+    }
 
-    return retVal;
+    Logger::debug("Good RX: %d       Bad RX: %d", goodPackets, badPackets);
+}
+
+//regs points at REG_GPAI and holds the 18 bytes through the end of REG_TEMPERATURE2
+//Only counts are stored here, raw and filtered. Nothing is converted until someone asks for volts or degrees.
+void BMSModule::decodeMeasurements(const uint8_t *regs)
+{
+    FilterConfig cellFilter = { settings.filterMedian, settings.filterCellShift, settings.filterCellStep };
+    FilterConfig tempFilter = { settings.filterMedian, settings.filterTempShift, settings.filterTempStep };
+
+    ModuleMeasurements raw;
+    ModuleDecode::measurements(regs, raw);
+
+    rawModuleCounts = raw.moduleCounts;
+    moduleCounts = BMSFilter::apply(filters[6], rawModuleCounts, filterPrimed, cellFilter);
+    if (moduleCounts > highestModuleCounts) highestModuleCounts = moduleCounts;
+    if (moduleCounts < lowestModuleCounts) lowestModuleCounts = moduleCounts;
+    for (int i = 0; i < 6; i++) 
+    {
+        rawCellCounts[i] = raw.cellCounts[i];
+        cellCounts[i] = BMSFilter::apply(filters[i], rawCellCounts[i], filterPrimed, cellFilter);
+        if (lowestCellCounts[i] > cellCounts[i]) lowestCellCounts[i] = cellCounts[i];
+        if (highestCellCounts[i] < cellCounts[i]) highestCellCounts[i] = cellCounts[i];
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        rawTempCounts[i] = raw.tempCounts[i];
+        tempCounts[i] = BMSFilter::apply(filters[7 + i], rawTempCounts[i], filterPrimed, tempFilter);
+        if (lowestTempCounts[i] > tempCounts[i]) lowestTempCounts[i] = tempCounts[i];
+        if (highestTempCounts[i] < tempCounts[i]) highestTempCounts[i] = tempCounts[i];
+    }
+    if (filterPrimed < FILTER_PRIME) filterPrimed++;
+
+    Logger::debug("Got voltage and temperature readings");
+}
+
+//The conversions themselves live in ModuleDecode so the tools on a PC use the same ones
+float BMSModule::cellCountsToVolts(uint16_t counts)
+{
+    return ModuleDecode::cellVolts(counts);
+}
+
+uint16_t BMSModule::cellVoltsToCounts(float volts)
+{
+    return ModuleDecode::cellCounts(volts);
+}
+
+float BMSModule::moduleCountsToVolts(uint16_t counts)
+{
+    return ModuleDecode::moduleVolts(counts);
+}
+
+float BMSModule::countsToTemperature(int temp, uint16_t counts)
+{
+    return ModuleDecode::celsius(temp, counts);
+}
+
+//cells are 6.25V full scale so centivolts = counts * 625 / 16383. Same truncation as the old float path.
+uint16_t BMSModule::getCellCentivolts(int cell)
+{
+    if (cell < 0 || cell > 5) return 0;
+    return ((uint32_t)cellCounts[cell] * 625ul) / 16383ul;
+}
+
+uint16_t BMSModule::getHighestCellCentivolts(int cell)
+{
+    if (cell < 0 || cell > 5) return 0;
+    return ((uint32_t)highestCellCounts[cell] * 625ul) / 16383ul;
+}
+
+uint16_t BMSModule::getLowestCellCentivolts(int cell)
+{
+    if (cell < 0 || cell > 5 || lowestCellCounts[cell] == NO_MIN_COUNTS) return 500;
+    return ((uint32_t)lowestCellCounts[cell] * 625ul) / 16383ul;
+}
+
+//module is 33.333V full scale so centivolts = counts * 33333 / 163830
+uint16_t BMSModule::getModuleCentivolts()
+{
+    return ((uint32_t)moduleCounts * 33333ul) / 163830ul;
+}
+
+uint16_t BMSModule::getCellCounts(int cell)
+{
+    if (cell < 0 || cell > 5) return 0;
+    return cellCounts[cell];
+}
+
+uint16_t BMSModule::getModuleCounts()
+{
+    return moduleCounts;
+}
+
+uint16_t BMSModule::getTemperatureCounts(int temp)
+{
+    if (temp < 0 || temp > 1) return 0;
+    return tempCounts[temp];
+}
+
+//What the module last sent before any filtering
+uint16_t BMSModule::getRawCellCounts(int cell)
+{
+    if (cell < 0 || cell > 5) return 0;
+    return rawCellCounts[cell];
+}
+
+uint16_t BMSModule::getRawModuleCounts()
+{
+    return rawModuleCounts;
+}
+
+uint16_t BMSModule::getRawTemperatureCounts(int temp)
+{
+    if (temp < 0 || temp > 1) return 0;
+    return rawTempCounts[temp];
 }
 
 float BMSModule::getCellVoltage(int cell)
 {
     if (cell < 0 || cell > 5) return 0.0f;
-    return cellVolt[cell];
+    return cellCountsToVolts(cellCounts[cell]);
 }
 
 float BMSModule::getLowCellV()
 {
-    float lowVal = 10.0f;
-    for (int i = 0; i < 6; i++) if (cellVolt[i] < lowVal) lowVal = cellVolt[i];
-    return lowVal;
+    uint16_t lowVal = 0xFFFF;
+    for (int i = 0; i < 6; i++) if (cellCounts[i] < lowVal) lowVal = cellCounts[i];
+    return cellCountsToVolts(lowVal);
 }
 
 float BMSModule::getHighCellV()
 {
-    float hiVal = 0.0f;
-    for (int i = 0; i < 6; i++) if (cellVolt[i] > hiVal) hiVal = cellVolt[i];
-    return hiVal;
+    uint16_t hiVal = 0;
+    for (int i = 0; i < 6; i++) if (cellCounts[i] > hiVal) hiVal = cellCounts[i];
+    return cellCountsToVolts(hiVal);
 }
 
 float BMSModule::getAverageV()
 {
-    float avgVal = 0.0f;
-    for (int i = 0; i < 6; i++) avgVal += cellVolt[i];
-    avgVal /= 6.0f;
-    return avgVal;
+    uint32_t total = 0;
+    for (int i = 0; i < 6; i++) total += cellCounts[i];
+    return (total * CELL_VOLTS_PER_COUNT) / 6.0f;
 }
 
 float BMSModule::getHighestModuleVolt()
 {
-    return highestModuleVolt;
+    return moduleCountsToVolts(highestModuleCounts);
 }
 
 float BMSModule::getLowestModuleVolt()
 {
-    return lowestModuleVolt;
+    if (lowestModuleCounts == NO_MIN_COUNTS) return 200.0f;
+    return moduleCountsToVolts(lowestModuleCounts);
 }
 
 float BMSModule::getHighestCellVolt(int cell)
 {
     if (cell < 0 || cell > 5) return 0.0f;
-    return highestCellVolt[cell];
+    return cellCountsToVolts(highestCellCounts[cell]);
 }
 
 float BMSModule::getLowestCellVolt(int cell)
 {
     if (cell < 0 || cell > 5) return 0.0f;
-    return lowestCellVolt[cell];
+    if (lowestCellCounts[cell] == NO_MIN_COUNTS) return 5.0f;
+    return cellCountsToVolts(lowestCellCounts[cell]);
 }
 
 float BMSModule::getHighestTemp()
 {
-    return highestTemperature;
+    if (highestTempCounts[0] == NO_MAX_COUNTS && highestTempCounts[1] == NO_MAX_COUNTS) return -100.0f;
+    float t0 = countsToTemperature(0, highestTempCounts[0]);
+    float t1 = countsToTemperature(1, highestTempCounts[1]);
+    return (t0 < t1) ? t1 : t0;
 }
 
 float BMSModule::getLowestTemp()
 {
-    return lowestTemperature;
+    if (lowestTempCounts[0] == NO_MIN_COUNTS && lowestTempCounts[1] == NO_MIN_COUNTS) return 200.0f;
+    float t0 = countsToTemperature(0, lowestTempCounts[0]);
+    float t1 = countsToTemperature(1, lowestTempCounts[1]);
+    return (t0 < t1) ? t0 : t1;
 }
 
 float BMSModule::getLowTemp()
 {
-   return (temperatures[0] < temperatures[1]) ? temperatures[0] : temperatures[1]; 
+    float t0 = getTemperature(0);
+    float t1 = getTemperature(1);
+    return (t0 < t1) ? t0 : t1; 
 }
 
 float BMSModule::getHighTemp()
 {
-   return (temperatures[0] < temperatures[1]) ? temperatures[1] : temperatures[0];
+    float t0 = getTemperature(0);
+    float t1 = getTemperature(1);
+    return (t0 < t1) ? t1 : t0;
 }
 
 float BMSModule::getAvgTemp()
 {
-    return (temperatures[0] + temperatures[1]) / 2.0f;
+    return (getTemperature(0) + getTemperature(1)) / 2.0f;
 }
 
 float BMSModule::getModuleVoltage()
 {
-    return moduleVolt;
+    return moduleCountsToVolts(moduleCounts);
 }
 
 float BMSModule::getTemperature(int temp)
 {
     if (temp < 0 || temp > 1) return 0.0f;
-    return temperatures[temp];
+    return countsToTemperature(temp, tempCounts[temp]);
 }
 
 void BMSModule::setAddress(int newAddr)
 {
     if (newAddr < 0 || newAddr > MAX_MODULE_ADDR) return;
     moduleAddress = newAddr;
+    invalidateShadow();
 }
 
 int BMSModule::getAddress()
@@ -281,65 +456,132 @@ bool BMSModule::isExisting()
 void BMSModule::setExists(bool ex)
 {
     exists = ex;
+    health = HEALTH_MAX; //fresh start whether it just showed up or went away
+    quarantined = false;
+    silent = false;
+    filterPrimed = 0; //readings from before it went away or from whatever used to be here mean nothing now
+    invalidateShadow(); //either new to us or gone. Either way we no longer know what is in its registers
+}
+
+bool BMSModule::needsWrite(uint8_t reg, uint8_t value)
+{
+    if (reg < SHADOW_FIRST_REG || reg >= SHADOW_FIRST_REG + SHADOW_REG_COUNT) return true;
+    int idx = reg - SHADOW_FIRST_REG;
+    return !(shadowValid & (1 << idx)) || shadowRegs[idx] != value;
+}
+
+//Record a value as written. Done when the write is queued so later decisions see it, undone if the write fails.
+void BMSModule::noteWrite(uint8_t reg, uint8_t value)
+{
+    if (reg < SHADOW_FIRST_REG || reg >= SHADOW_FIRST_REG + SHADOW_REG_COUNT) return;
+    int idx = reg - SHADOW_FIRST_REG;
+    shadowRegs[idx] = value;
+    shadowValid |= (1 << idx);
+}
+
+void BMSModule::invalidateShadow()
+{
+    shadowValid = 0;
+}
+
+void BMSModule::invalidateShadow(uint8_t reg)
+{
+    if (reg < SHADOW_FIRST_REG || reg >= SHADOW_FIRST_REG + SHADOW_REG_COUNT) return;
+    shadowValid &= ~(1 << (reg - SHADOW_FIRST_REG));
+}
+
+/*
+Write a register only if the module doesn't already hold that value. Returns true if a write was queued.
+*/
+bool BMSModule::writeRegister(uint8_t reg, uint8_t value)
+{
+    if (!needsWrite(reg, value)) return false;
+    if (!bus->queueWrite(moduleAddress << 1, reg, value, writeReply, this, waitFlags(), attemptBudget())) return false;
+    noteWrite(reg, value);
+    return true;
+}
+
+//Nothing to decode, the reply only counts towards the health score
+void BMSModule::resultReply(void *context, BMSReply &reply)
+{
+    ((BMSModule *)context)->noteResult(reply);
+}
+
+void BMSModule::writeReply(void *context, BMSReply &reply)
+{
+    ((BMSModule *)context)->noteResult(reply);
+    if (reply.status != BUS_OK) ((BMSModule *)context)->invalidateShadow(reply.reg);
+}
+
+/*
+Read the shadowed registers back and make sure the module really holds what we think it does.
+Anything that doesn't match gets written again next time it is used.
+*/
+bool BMSModule::verifyShadow()
+{
+    return bus->queueRead(moduleAddress << 1, SHADOW_FIRST_REG, SHADOW_REG_COUNT, verifyReply, this, BUS_FLAG_CHECK_CRC | waitFlags(), attemptBudget());
+}
+
+void BMSModule::verifyReply(void *context, BMSReply &reply)
+{
+    BMSModule *module = (BMSModule *)context;
+
+    module->noteResult(reply);
+    if (reply.status != BUS_OK || reply.length != SHADOW_REG_COUNT + 4) return;
+
+    for (int i = 0; i < SHADOW_REG_COUNT; i++)
+    {
+        if ((module->shadowValid & (1 << i)) && module->shadowRegs[i] != reply.data[3 + i])
+        {
+            Logger::warn("Module %i register %X holds %X, expected %X", module->moduleAddress, SHADOW_FIRST_REG + i, 
+                         reply.data[3 + i], module->shadowRegs[i]);
+            module->shadowValid &= ~(1 << i);
+        }
+    }
 }
 
-void BMSModule::balanceCells()
+bool BMSModule::balanceCells()
 {
-    uint8_t payload[4];
-    uint8_t buff[30];
+    uint8_t addrByte = moduleAddress << 1;
     uint8_t balance = 0;//bit 0 - 5 are to activate cell balancing 1-6
 
-    payload[0] = moduleAddress << 1;
-    payload[1] = REG_BAL_CTRL;
-    payload[2] = 0; //writing zero to this register resets balance time and must be done before setting balance resistors again.
-    BMSUtil::sendData(payload, 3, true);
-    delay(2);
-    BMSUtil::getReply(buff, 30);
+    if (bus->freeSlots() < MODULE_BALANCE_TRANSACTIONS) return false;
+
+    //compare in counts so no cell needs converting
+    uint16_t balanceOn = cellVoltsToCounts(settings.balanceVoltage);
+    uint16_t balanceOff = cellVoltsToCounts(settings.balanceVoltage - settings.balanceHyst);
 
     for (int i = 0; i < 6; i++)
     {
-        if ( (balanceState[i] == 0) && (getCellVoltage(i) > settings.balanceVoltage) ) balanceState[i] = 1;
+        if ( (balanceState[i] == 0) && (cellCounts[i] > balanceOn) ) balanceState[i] = 1;
 
-        if ( /*(balanceState[i] == 1) &&*/ (getCellVoltage(i) < (settings.balanceVoltage - settings.balanceHyst)) ) balanceState[i] = 0;
+        if ( /*(balanceState[i] == 1) &&*/ (cellCounts[i] < balanceOff) ) balanceState[i] = 0;
 
         if (balanceState[i] == 1) balance |= (1<<i);
     }
 
+    //Nothing to do if the module is already balancing exactly these cells and the balance timer is nowhere near running out
+    if (!needsWrite(REG_BAL_CTRL, balance) && (balance == 0 || (millis() - balanceWritten) < BALANCE_REFRESH_MS)) return true;
+
+    //writing zero to this register resets balance time and must be done before setting balance resistors again.
+    bus->queueWrite(addrByte, REG_BAL_CTRL, 0, writeReply, this, waitFlags(), attemptBudget());
+    noteWrite(REG_BAL_CTRL, 0);
+
     if (balance != 0) //only send balance command when needed
     {
-        payload[0] = moduleAddress << 1;
-        payload[1] = REG_BAL_TIME;
-        payload[2] = 0x82; //balance for two minutes if nobody says otherwise before then
-        BMSUtil::sendData(payload, 3, true);
-        delay(2);
-        BMSUtil::getReply(buff, 30);
-
-        payload[0] = moduleAddress << 1;
-        payload[1] = REG_BAL_CTRL;
-        payload[2] = balance; //write balance state to register
-        BMSUtil::sendData(payload, 3, true);
-        delay(2);
-        BMSUtil::getReply(buff, 30);
-
-        if (Logger::isDebug()) //read registers back out to check if everthing is good
+        writeRegister(REG_BAL_TIME, 0x82); //balance for two minutes if nobody says otherwise before then
+        bus->queueWrite(addrByte, REG_BAL_CTRL, balance, writeReply, this, waitFlags(), attemptBudget()); //write balance state to register
+        noteWrite(REG_BAL_CTRL, balance);
+        balanceWritten = millis();
+
+        if (Logger::isDebug()) //read registers back out to check if everthing is good. The bus prints the replies.
         {
             Logger::debug("Reading back balancing registers:");
-            delay(50);
-            payload[0] = moduleAddress << 1;
-            payload[1] = REG_BAL_TIME;
-            payload[2] = 1; //expecting only 1 byte back
-            BMSUtil::sendData(payload, 3, false);
-            delay(2);
-            BMSUtil::getReply(buff, 30);
-
-            payload[0] = moduleAddress << 1;
-            payload[1] = REG_BAL_CTRL;
-            payload[2] = 1; //also only gets one byte
-            BMSUtil::sendData(payload, 3, false);
-            delay(2);
-            BMSUtil::getReply(buff, 30);
+            bus->queueRead(addrByte, REG_BAL_TIME, 1, resultReply, this, waitFlags(), attemptBudget()); //expecting only 1 byte back
+            bus->queueRead(addrByte, REG_BAL_CTRL, 1, resultReply, this, waitFlags(), attemptBudget()); //also only gets one byte
         }
     }
+    return true;
 }
 
 uint8_t BMSModule::getBalancingState(int cell)
@@ -347,3 +589,93 @@ uint8_t BMSModule::getBalancingState(int cell)
     if (cell < 0 || cell > 5) return 0;
     return balanceState[cell];
 }
+
+int BMSModule::getGoodPackets()
+{
+    return goodPackets;
+}
+
+int BMSModule::getBadPackets()
+{
+    return badPackets;
+}
+
+void BMSModule::resetPacketCounts()
+{
+    goodPackets = 0;
+    badPackets = 0;
+}
+
+/*
+ * Health goes up a quarter of the way back to HEALTH_MAX for every clean transaction and is halved for every failed one,
+ * so a few failures in a row count for much more than the odd one now and then. A transaction that only got through
+ * on a retry costs a little too. Quarantine has hysteresis so a module on the edge doesn't flap in and out of it.
+ */
+void BMSModule::noteResult(BMSReply &reply)
+{
+    silent = (reply.status == BUS_TIMEOUT);
+    if (reply.status == BUS_OK)
+    {
+        if (reply.attempts > 1) health -= health / 8;
+        else health += ((HEALTH_MAX - health) / 4) + 1;
+        if (health > HEALTH_MAX) health = HEALTH_MAX;
+    }
+    else health /= 2;
+
+    if (!quarantined && health < HEALTH_QUARANTINE)
+    {
+        quarantined = true;
+        Logger::warn("Module %i keeps failing to answer. Quarantined, it will only be probed occasionally", moduleAddress);
+    }
+    else if (quarantined && health >= HEALTH_RELEASE)
+    {
+        quarantined = false;
+        filterPrimed = 0; //its readings have been few and far between, start the filters again from this one
+        Logger::info("Module %i is answering again and is back in the normal scan", moduleAddress);
+    }
+}
+
+uint8_t BMSModule::getHealth()
+{
+    return health;
+}
+
+bool BMSModule::isDegraded()
+{
+    return health < HEALTH_DEGRADED;
+}
+
+bool BMSModule::isQuarantined()
+{
+    return quarantined;
+}
+
+//A module that got the wrong answer back is still on the wire. One that got nothing may be past a break in the chain.
+bool BMSModule::isSilent()
+{
+    return silent;
+}
+
+//False from when the module is found or restored until its first measurements come in
+bool BMSModule::hasReading()
+{
+    return filterPrimed > 0;
+}
+
+//Healthy modules get the full set of retries. Ones that have been struggling get fewer so they can't hold up the rest of the pack.
+uint8_t BMSModule::attemptBudget()
+{
+    if (quarantined) return 1;
+    if (health < HEALTH_DEGRADED) return 2;
+    return BUS_MAX_ATTEMPTS;
+}
+
+/*
+ * Once a module is degraded an attempt is given up as soon as the first byte of its reply is overdue rather
+ * than after the time a whole reply would take. A module that answers at all starts well inside that and
+ * then gets the full time, one that has gone quiet no longer costs the bus the wire time of a reply it never sends.
+ */
+uint8_t BMSModule::waitFlags()
+{
+    return (health < HEALTH_DEGRADED) ? BUS_FLAG_FAST_FAIL : 0;
+}
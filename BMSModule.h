@@ -1,11 +1,29 @@
 #pragma once
 
+#include "BMSBus.h"
+#include "BMSFilter.h"
+
+#define MODULE_READ_TRANSACTIONS    6   //bus slots readModuleValues needs
+#define MODULE_RESULT_TRANSACTIONS  2   //bus slots readConversionResults needs
+#define SHADOW_FIRST_REG            REG_ADC_CTRL //writable config registers REG_ADC_CTRL through REG_BAL_TIME are shadowed
+#define SHADOW_REG_COUNT            4
+#define BALANCE_REFRESH_MS          60000 //balancing is rewritten this often even if unchanged so the two minute balance timer never runs out
+#define MODULE_BALANCE_TRANSACTIONS 5   //worst case bus slots balanceCells needs
+#define HEALTH_MAX                  100 //score of a module with a clean recent history
+#define HEALTH_DEGRADED             60  //below this a module only gets one retry
+#define HEALTH_QUARANTINE           25  //below this a module is dropped from the normal scan and only probed now and then
+#define HEALTH_RELEASE              50  //a quarantined module goes back into the normal scan once it climbs back to here
+#define NO_MIN_COUNTS               0xFFFF //lowest counts before anything has been read
+#define NO_MAX_COUNTS               0   //highest counts before anything has been read
+
 class BMSModule
 {
 public:
     BMSModule();
-    void readStatus();
+    void setBus(BMSBus *moduleBus);
+    bool readStatus();
     bool readModuleValues();
+    bool readConversionResults(bool withStatus);
     float getCellVoltage(int cell);
     float getLowCellV();
     float getHighCellV();
@@ -21,6 +39,20 @@ public:
     float getAvgTemp();
     float getModuleVoltage();
     float getTemperature(int temp);
+    uint16_t getCellCounts(int cell);
+    uint16_t getModuleCounts();
+    uint16_t getTemperatureCounts(int temp);
+    uint16_t getRawCellCounts(int cell);
+    uint16_t getRawModuleCounts();
+    uint16_t getRawTemperatureCounts(int temp);
+    uint16_t getCellCentivolts(int cell);
+    uint16_t getHighestCellCentivolts(int cell);
+    uint16_t getLowestCellCentivolts(int cell);
+    uint16_t getModuleCentivolts();
+    static float cellCountsToVolts(uint16_t counts);
+    static uint16_t cellVoltsToCounts(float volts);
+    static float moduleCountsToVolts(uint16_t counts);
+    static float countsToTemperature(int temp, uint16_t counts);
     uint8_t getFaults();
     uint8_t getAlerts();
     uint8_t getCOVCells();
@@ -29,19 +61,42 @@ public:
     int getAddress();
     bool isExisting();
     void setExists(bool ex);
-    void balanceCells();
+    bool balanceCells();
+    bool writeRegister(uint8_t reg, uint8_t value);
+    bool needsWrite(uint8_t reg, uint8_t value);
+    void noteWrite(uint8_t reg, uint8_t value);
+    void invalidateShadow();
+    void invalidateShadow(uint8_t reg);
+    bool verifyShadow();
     uint8_t getBalancingState(int cell);
+    int getGoodPackets();
+    int getBadPackets();
+    void resetPacketCounts();
+    uint8_t getHealth();
+    bool isDegraded();
+    bool isQuarantined();
+    bool isSilent();
+    bool hasReading();
+    uint8_t attemptBudget();
+    uint8_t waitFlags();
 
 private:
-    float cellVolt[6];          // calculated as 16 bit value * 6.250 / 16383 = volts
-    float lowestCellVolt[6];
-    float highestCellVolt[6];
-    float moduleVolt;          // calculated as 16 bit value * 33.333 / 16383 = volts
-    float temperatures[2];     // Don't know the proper scaling at this point    
-    float lowestTemperature;
-    float highestTemperature;
-    float lowestModuleVolt;
-    float highestModuleVolt;
+    //Everything is kept as ADC counts and only turned into volts or degrees when asked for. The counts below are
+    //after BMSFilter, which is what everything else works from. What the module actually sent is in the raw arrays.
+    uint16_t cellCounts[6];     // volts = counts * 6.250 / 16383
+    uint16_t lowestCellCounts[6];
+    uint16_t highestCellCounts[6];
+    uint16_t moduleCounts;      // volts = counts * 33.333 / 16383
+    uint16_t lowestModuleCounts;
+    uint16_t highestModuleCounts;
+    uint16_t tempCounts[2];     // thermistor readings, higher counts are warmer
+    uint16_t lowestTempCounts[2];  // tracked per sensor as the two channels have slightly different offsets
+    uint16_t highestTempCounts[2];
+    uint16_t rawCellCounts[6];
+    uint16_t rawModuleCounts;
+    uint16_t rawTempCounts[2];
+    FilterState filters[9];     // cells, then the module voltage, then the two thermistors
+    uint8_t filterPrimed;       // readings the filters have had, up to FILTER_PRIME
     uint8_t balanceState[6]; //0 = balancing off for this cell, 1 = balancing currently on
     bool exists;
     int alerts;
@@ -52,4 +107,24 @@ private:
     int badPackets;
 
     uint8_t moduleAddress;     //1 to 0x3E
+    BMSBus *bus;
+    uint8_t shadowRegs[SHADOW_REG_COUNT];   //what we last wrote to each config register
+    uint8_t shadowValid;                    //bit per register, set when the shadow is known to match the module
+    uint32_t balanceWritten;                //millis() when balancing was last written to the module
+    uint8_t health;                         //0 - HEALTH_MAX, built from how recent transactions went
+    bool quarantined;
+    bool silent;                            //nothing at all came back for the last transaction
+
+    static void statusReply(void *context, BMSReply &reply);
+    static void valuesReply(void *context, BMSReply &reply);
+    static void snapshotReply(void *context, BMSReply &reply);
+    static void writeReply(void *context, BMSReply &reply);
+    static void resultReply(void *context, BMSReply &reply);
+    static void verifyReply(void *context, BMSReply &reply);
+    void noteResult(BMSReply &reply);
+    void decodeStatus(BMSReply &reply);
+    void decodeValues(BMSReply &reply);
+    void decodeSnapshot(BMSReply &reply);
+    void decodeStatusRegs(const uint8_t *regs);
+    void decodeMeasurements(const uint8_t *regs);
 };
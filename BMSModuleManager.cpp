@@ -1,247 +1,371 @@
 #include "config.h"
 #include "BMSModuleManager.h"
-#include "BMSUtil.h"
+#include "BMSUart.h"
+#include "Thermistor.h"
+#include "ModuleDecode.h"
 #include "Logger.h"
+#include <Wire_EEPROM.h>
 
 extern EEPROMSettings settings;
 
 BMSModuleManager::BMSModuleManager()
 {
-    for (int i = 1; i <= MAX_MODULE_ADDR; i++) {
-        modules[i].setExists(false);
-        modules[i].setAddress(i);
-    }
     lowestPackVolt = 1000.0f;
     highestPackVolt = 0.0f;
     lowestPackTemp = 200.0f;
     highestPackTemp = -100.0f;
     isFaulted = false;
+    numFoundModules = 0;
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].setIndex(c);
+    chains[0].setTransport(&bmsUart);
+#if BMS_CHAIN_COUNT > 1
+    chains[1].setTransport(&bmsUart2);
+#endif
+#if BMS_CHAIN_COUNT > 2
+    chains[2].setTransport(&bmsUart3);
+#endif
+    scanInProgress = false;
+    capturing = false;
+    scanCount = 0;
+    lastScanTime = 0;
+    savedFingerprint = 0;
+    activeCount = 0;
+    layoutSeen = 0;
+    memset(&pack, 0, sizeof(pack));
+    avgTempValid = false;
+    detailCursor = PACK_MODULES;
+    detailCell = 0;
+    detailSentAt = 0;
 }
 
-void BMSModuleManager::balanceCells()
-{  
-    for (int address = 1; address <= MAX_MODULE_ADDR; address++)
-    {
-        if (modules[address].isExisting()) modules[address].balanceCells();
-    }
+/*
+ * Modules are numbered across the whole pack with each chain taking the next MAX_MODULE_ADDR numbers.
+ * With one chain pack numbers are just the module addresses. Returns NULL for a number that can't exist.
+ */
+BMSModule *BMSModuleManager::getModule(int packModule)
+{
+    if (packModule < 1 || packModule > PACK_MODULES) return NULL;
+    return &chains[(packModule - 1) / MAX_MODULE_ADDR].getModule(((packModule - 1) % MAX_MODULE_ADDR) + 1);
+}
+
+//False if the module is past a break in its chain
+bool BMSModuleManager::isReachable(int packModule)
+{
+    if (packModule < 1 || packModule > PACK_MODULES) return false;
+    return chains[(packModule - 1) / MAX_MODULE_ADDR].isReachable(((packModule - 1) % MAX_MODULE_ADDR) + 1);
 }
 
 /*
- * Try to set up any unitialized boards. Send a command to address 0 and see if there is a response. If there is then there is
- * still at least one unitialized board. Go ahead and give it the first ID not registered as already taken.
- * If we send a command to address 0 and no one responds then every board is inialized and this routine stops.
- * Don't run this routine until after the boards have already been enumerated.\
- * Note: The 0x80 conversion it is looking might in theory block the message from being forwarded so it might be required
- * To do all of this differently. Try with multiple boards. The alternative method would be to try to set the next unused
- * address and see if any boards respond back saying that they set the address. 
+ * Call as often as possible. Every chain runs its own bus so they all have traffic in flight at once
+ * and a full pack scan takes about as long as the longest chain.
  */
-void BMSModuleManager::setupBoards()
+void BMSModuleManager::loop()
 {
-    uint8_t payload[3];
-    uint8_t buff[10];
-    int retLen;
+    bool scanDone = true;
+
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        chains[c].loop();
+        if (!chains[c].isScanDone()) scanDone = false;
+    }
 
-    payload[0] = 0;
-    payload[1] = 0;
-    payload[2] = 1;
+    saveBaudResults();
+    sendQueuedDetails();
+    if (scanInProgress && scanDone) finishScan();
+}
 
-    while (1 == 1)
+//Point all module traffic for one chain at a different port, real or simulated
+void BMSModuleManager::setTransport(BMSTransport *port, int chain)
+{
+    if (chain < 0 || chain >= BMS_CHAIN_COUNT) return;
+    if (capturing)
     {
-        payload[0] = 0;
-        payload[1] = 0;
-        payload[2] = 1;
-        retLen = BMSUtil::sendDataWithReply(payload, 3, false, buff, 4);
-        if (retLen == 4)
-        {
-            if (buff[0] == 0x80 && buff[1] == 0 && buff[2] == 1)
-            {
-                Logger::debug("00 found");
-                //look for a free address to use
-                for (int y = 1; y < 63; y++) 
-                {
-                    if (!modules[y].isExisting())
-                    {
-                        payload[0] = 0;
-                        payload[1] = REG_ADDR_CTRL;
-                        payload[2] = y | 0x80;
-                        BMSUtil::sendData(payload, 3, true);
-                        delay(3);
-                        if (BMSUtil::getReply(buff, 10) > 2)
-                        {
-                            if (buff[0] == (0x81) && buff[1] == REG_ADDR_CTRL && buff[2] == (y + 0x80)) 
-                            {
-                                modules[y].setExists(true);
-                                numFoundModules++;
-                                Logger::debug("Address assigned");
-                            }
-                        }
-                        break; //quit the for loop
-                    }
-                }
-            }
-            else break; //nobody responded properly to the zero address so our work here is done.
-        }
-        else break;
+        captureTaps[chain].flushPending();
+        captureTaps[chain].attach(port, &capture, chain);
+        return;
     }
+    chains[chain].setTransport(port);
 }
 
 /*
- * Iterate through all 62 possible board addresses (1-62) to see if they respond
+ * Start or stop recording raw traffic on every chain. Starting clears anything captured before.
+ * Capture works by putting a BMSCaptureTransport in front of each chain's own transport.
  */
-void BMSModuleManager::findBoards()
+void BMSModuleManager::setCapture(bool enable)
 {
-    uint8_t payload[3];
-    uint8_t buff[8];
-
-    numFoundModules = 0;
-    payload[0] = 0;
-    payload[1] = 0; //read registers starting at 0
-    payload[2] = 1; //read one byte
-    for (int x = 1; x <= MAX_MODULE_ADDR; x++)
-    {
-        modules[x].setExists(false);
-        payload[0] = x << 1;
-        BMSUtil::sendData(payload, 3, false);
-        delay(20);
-        if (BMSUtil::getReply(buff, 8) > 4)
+    if (enable == capturing) return;
+    if (enable)
+    {
+        capture.clear();
+        for (int c = 0; c < BMS_CHAIN_COUNT; c++)
         {
-            if (buff[0] == (x << 1) && buff[1] == 0 && buff[2] == 1 && buff[4] > 0) {
-                modules[x].setExists(true);
-                numFoundModules++;
-                Logger::debug("Found module with address: %X", x); 
-            }
+            captureTaps[c].attach(chains[c].getTransport(), &capture, c);
+            chains[c].setTransport(&captureTaps[c]);
+        }
+    }
+    else
+    {
+        for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+        {
+            chains[c].setTransport(captureTaps[c].getInner());
+            captureTaps[c].flushPending();
         }
-        delay(5);
     }
+    capturing = enable;
 }
 
+bool BMSModuleManager::isCapturing()
+{
+    return capturing;
+}
 
 /*
- * Force all modules to reset back to address 0 then set them all up in order so that the first module
- * in line from the master board is 1, the second one 2, and so on.
-*/
-void BMSModuleManager::renumberBoardIDs()
+ * Print the capture buffer as hex, oldest record first, between BEGIN and END marker lines.
+ * Save the console output to a file and hand it to tools/replay to decode it on a PC.
+ */
+void BMSModuleManager::dumpCapture()
 {
-    uint8_t payload[3];
-    uint8_t buff[8];
-    int attempts = 1;
+    if (capturing) for (int c = 0; c < BMS_CHAIN_COUNT; c++) captureTaps[c].flushPending();
 
-    for (int y = 1; y < 63; y++) 
+    Logger::console("CAPTURE BEGIN records=%l dropped=%l bytes=%i", capture.getRecordCount(), capture.getDroppedCount(), capture.size());
+    for (int i = 0; i < capture.size(); i++)
     {
-        modules[y].setExists(false);
-        numFoundModules = 0;
+        uint8_t data = capture.byteAt(i);
+        if (data < 0x10) SERIALCONSOLE.print("0");
+        SERIALCONSOLE.print(data, HEX);
+        if ((i & 31) == 31 || i == capture.size() - 1) SERIALCONSOLE.println();
     }
+    Logger::console("CAPTURE END");
+}
+
+void BMSModuleManager::balanceCells()
+{  
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].startBalance();
+}
+
+void BMSModuleManager::setupBoards()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].setupBoards();
+    refreshIndex();
+}
+
+//Returns right away. Every chain looks for its modules in the background and the count is picked up at the end of a scan.
+void BMSModuleManager::findBoards()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].findBoards();
+}
+
+void BMSModuleManager::renumberBoardIDs()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].renumberBoardIDs();
+    refreshIndex();
+    saveTopology();
+}
+
+//FNV-1a over everything but the fingerprint itself
+static uint32_t topologyFingerprint(const ChainTopology &topology)
+{
+    const uint8_t *bytes = (const uint8_t *)&topology;
+    uint32_t hash = 2166136261ul;
+    for (unsigned int i = 0; i < offsetof(ChainTopology, fingerprint); i++) hash = (hash ^ bytes[i]) * 16777619ul;
+    return hash;
+}
 
-    while (attempts < 3)
+static void buildTopology(ChainTopology &topology, BMSChain *chains)
+{
+    memset(&topology, 0, sizeof(topology));
+    topology.version = TOPOLOGY_VERSION;
+    topology.chainCount = BMS_CHAIN_COUNT;
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
     {
-        payload[0] = 0x3F << 1; //broadcast the reset command
-        payload[1] = 0x3C;//reset
-        payload[2] = 0xA5;//data to cause a reset
-        BMSUtil::sendData(payload, 3, true);
-        delay(100);
-        BMSUtil::getReply(buff, 8);
-        if (buff[0] == 0x7F && buff[1] == 0x3C && buff[2] == 0xA5 && buff[3] == 0x57) break;
-        attempts++;
+        topology.moduleCount[c] = chains[c].getNumFoundModules();
+        chains[c].getAddressMap(topology.addressMap[c]);
     }
-
-    setupBoards();
+    topology.fingerprint = topologyFingerprint(topology);
 }
 
 /*
-After a RESET boards have their faults written due to the hard restart or first time power up, this clears thier faults
-*/
-void BMSModuleManager::clearFaults()
+ * Carry on with the module addresses saved from the last run instead of renumbering. Every chain is checked with a
+ * few quick reads first (see BMSChain::restoreBoards). Returns false if there is no usable saved topology or any
+ * chain doesn't match it, in which case nothing is known about any module and a renumber is needed.
+ */
+bool BMSModuleManager::warmBoot()
 {
-    uint8_t payload[3];
-    uint8_t buff[8];
-    payload[0] = 0x7F; //broadcast
-    payload[1] = REG_ALERT_STATUS;//Alert Status
-    payload[2] = 0xFF;//data to cause a reset
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 4);
+    ChainTopology topology;
+    uint32_t start = millis();
 
-    payload[0] = 0x7F; //broadcast
-    payload[2] = 0x00;//data to clear
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 4);
+    EEPROM.read(TOPOLOGY_PAGE, topology);
+    if (topology.version != TOPOLOGY_VERSION || topology.chainCount != BMS_CHAIN_COUNT || 
+        topology.fingerprint != topologyFingerprint(topology)) 
+    {
+        Logger::info("No saved chain topology to start from");
+        return false;
+    }
 
-    payload[0] = 0x7F; //broadcast
-    payload[1] = REG_FAULT_STATUS;//Fault Status
-    payload[2] = 0xFF;//data to cause a reset
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 4);
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        if (!chains[c].restoreBoards(topology.addressMap[c]) || chains[c].getNumFoundModules() != topology.moduleCount[c])
+        {
+            for (int d = 0; d < BMS_CHAIN_COUNT; d++) chains[d].restoreBoards(NULL);
+            refreshIndex();
+            return false;
+        }
+    }
+    refreshIndex();
+    savedFingerprint = topology.fingerprint;
+    Logger::info("Using saved chain topology, %i modules checked in %i ms", numFoundModules, millis() - start);
+    return true;
+}
 
-    payload[0] = 0x7F; //broadcast
-    payload[2] = 0x00;//data to clear
-    BMSUtil::sendDataWithReply(payload, 3, true, buff, 4);
+//Write the current module addresses to EEPROM if they differ from what is there
+void BMSModuleManager::saveTopology()
+{
+    ChainTopology topology;
 
-    isFaulted = false;
+    buildTopology(topology, chains);
+    if (topology.fingerprint == savedFingerprint) return;
+    EEPROM.write(TOPOLOGY_PAGE, topology);
+    savedFingerprint = topology.fingerprint;
+    Logger::debug("Saved chain topology, %i modules", numFoundModules);
 }
 
-/*
-Puts all boards on the bus into a Sleep state, very good to use when the vehicle is a rest state. 
-Pulling the boards out of sleep only to check voltage decay and temperature when the contactors are open.
-*/
+void BMSModuleManager::clearFaults()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].clearFaults();
+    isFaulted = false;
+}
 
 void BMSModuleManager::sleepBoards()
 {
-    uint8_t payload[3];
-    uint8_t buff[8];
-    payload[0] = 0x7F; //broadcast
-    payload[1] = REG_IO_CTRL;//IO ctrl start
-    payload[2] = 0x04;//write sleep bit
-    BMSUtil::sendData(payload, 3, true);
-    delay(2);
-    BMSUtil::getReply(buff, 8);
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].sleepBoards();
 }
 
-/*
-Wakes all the boards up and clears thier SLEEP state bit in the Alert Status Registery
-*/
-
 void BMSModuleManager::wakeBoards()
 {
-    uint8_t payload[3];
-    uint8_t buff[8];
-    payload[0] = 0x7F; //broadcast
-    payload[1] = REG_IO_CTRL;//IO ctrl start
-    payload[2] = 0x00;//write sleep bit
-    BMSUtil::sendData(payload, 3, true);
-    delay(2);
-    BMSUtil::getReply(buff, 8);
-  
-    payload[0] = 0x7F; //broadcast
-    payload[1] = REG_ALERT_STATUS;//Fault Status
-    payload[2] = 0x04;//data to cause a reset
-    BMSUtil::sendData(payload, 3, true);
-    delay(2);
-    BMSUtil::getReply(buff, 8);
-    payload[0] = 0x7F; //broadcast
-    payload[2] = 0x00;//data to clear
-    BMSUtil::sendData(payload, 3, true);
-    delay(2);
-    BMSUtil::getReply(buff, 8);
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].wakeBoards();
 }
 
+//Find the best baud divisor for every chain. Runs in the background, saveBaudResults keeps what it finds in EEPROM
+void BMSModuleManager::calibrateBaud()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        if (!chains[c].startBaudCal()) Logger::console("Chain %i can't be calibrated (no modules found, port can't be tuned or already calibrating)", c);
+    }
+}
+
+//Keep the divisor of any chain that has just finished calibrating so it is used from the next power up on
+void BMSModuleManager::saveBaudResults()
+{
+    bool changed = false;
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        uint16_t divisor;
+        if (!chains[c].takeBaudCal(divisor) || divisor == 0) continue;
+        if (settings.baudDivisor[c] != divisor)
+        {
+            settings.baudDivisor[c] = divisor;
+            changed = true;
+        }
+    }
+    if (changed) EEPROM.write(EEPROM_PAGE, settings);
+}
+
+//Put any calibrated divisors from EEPROM into effect. Has to come after the ports have been set up.
+void BMSModuleManager::applyBaudSettings()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        if (settings.baudDivisor[c] == 0 || !chains[c].getTransport()) continue;
+        if (chains[c].getTransport()->setBaudDivisor(settings.baudDivisor[c])) 
+            Logger::info("Chain %i using calibrated baud divisor %i", c, settings.baudDivisor[c]);
+    }
+}
+
+/*
+ * Starts a pass over every module to get fresh voltages and temperatures. The pack values are updated
+ * in finishScan once every reply has come back. Does nothing if the previous pass hasn't finished yet.
+ */
 void BMSModuleManager::getAllVoltTemp()
 {
-    packVolt = 0.0f;
-    for (int x = 1; x <= MAX_MODULE_ADDR; x++)
+    if (scanInProgress) return;
+    scanInProgress = true;
+    scanStart = micros();
+
+    bool verify = (SHADOW_VERIFY_INTERVAL > 0) && (scanCount % SHADOW_VERIFY_INTERVAL) == (SHADOW_VERIFY_INTERVAL - 1);
+    bool withStatus = (scanCount % STATUS_READ_INTERVAL) == 0 || digitalRead(13) == LOW;
+    bool probe = (scanCount % QUARANTINE_PROBE_INTERVAL) == 0;
+    bool enumerate = (scanCount % ENUMERATE_INTERVAL) == (ENUMERATE_INTERVAL - 1);
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) 
     {
-        if (modules[x].isExisting()) 
+        chains[c].startScan(settings.scanMode, withStatus, verify, probe);
+        if (enumerate) chains[c].startEnumerate();
+    }
+}
+
+//Warn once as each cell starts to stand out, slot is its module's place in activeModules
+static void cellFlagged(void *context, int slot, int cell, bool offset)
+{
+    uint8_t *modules = (uint8_t *)context;
+    Logger::warn("Module %i cell %i stands out from the rest of the pack (%s)", modules[slot], cell + 1, offset ? "offset" : "erratic");
+}
+
+void BMSModuleManager::finishScan()
+{
+    scanInProgress = false;
+    scanCount++;
+    lastScanTime = micros() - scanStart;
+    refreshIndex(); //modules can be added or dropped in the background
+    mirrorModules();
+    recordHistory();
+    //live modules only, the same ones that make up the pack average in mirrorModules
+    cellStats.update(packCellCounts, packLive, activeCount, settings.anomalyZ, BMSModule::cellVoltsToCounts(settings.anomalyMinMV / 1000.0f), 
+                     cellFlagged, activeModules);
+    Logger::debug("Scanned %i modules in %i us", numFoundModules, lastScanTime);
+    if (Logger::isDebug())
+    {
+        for (int m = 0; m < activeCount; m++)
         {
+            int x = activeModules[m];
             Logger::debug("");
-            Logger::debug("Module %i exists. Reading voltage and temperature values", x);
-            modules[x].readModuleValues();
-            Logger::debug("Module voltage: %f", modules[x].getModuleVoltage());
-            Logger::debug("Lowest Cell V: %f     Highest Cell V: %f", modules[x].getLowCellV(), modules[x].getHighCellV());
-            Logger::debug("Temp1: %f       Temp2: %f", modules[x].getTemperature(0), modules[x].getTemperature(1));
-            packVolt += modules[x].getModuleVoltage();
-            if (modules[x].getLowTemp() < lowestPackTemp) lowestPackTemp = modules[x].getLowTemp();
-            if (modules[x].getHighTemp() > highestPackTemp) highestPackTemp = modules[x].getHighTemp();            
+            Logger::debug("Module %i exists. Read voltage and temperature values", x);
+            Logger::debug("Module voltage: %f", getModule(x)->getModuleVoltage());
+            Logger::debug("Lowest Cell V: %f     Highest Cell V: %f", getModule(x)->getLowCellV(), getModule(x)->getHighCellV());
+            Logger::debug("Temp1: %f       Temp2: %f", getModule(x)->getTemperature(0), getModule(x)->getTemperature(1));
         }
     }
 
+    //pack wide figures come from the totals mirrorModules gathered
+    if (pack.tempCount > 0)
+    {
+        if (pack.lowTemp < lowestPackTemp) lowestPackTemp = pack.lowTemp;
+        if (pack.highTemp > highestPackTemp) highestPackTemp = pack.highTemp;
+    }
+    packVolt = pack.moduleCountSum * MODULE_VOLTS_PER_COUNT; //summed in counts first so it's only converted once
+
     if (packVolt > highestPackVolt) highestPackVolt = packVolt;
     if (packVolt < lowestPackVolt) lowestPackVolt = packVolt;
 
+    bool settled = true;
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) if (chains[c].isDiscovering() || chains[c].isEnumerating()) settled = false;
+    if (settled) saveTopology(); //keeps up with modules found or lost in the background
+
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        chains[c].checkLink();
+        if (chains[c].takeLinkChange()) sendChainStatus(c); //tell the rest of the car right away, not just when asked
+    }
+
+    if (settings.autoBaudCal)
+    {
+        for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+        {
+            if (chains[c].isCalibrating() || !chains[c].baudDegraded()) continue;
+            Logger::warn("Error rate on chain %i is too high, recalibrating baud rate", c);
+            chains[c].startBaudCal(); //the next scan of this chain waits until it's done
+        }
+    }
+
     if (digitalRead(13) == LOW) {
         if (!isFaulted) Logger::error("One or more BMS modules have entered the fault state!");
         isFaulted = true;
@@ -258,28 +382,293 @@ float BMSModuleManager::getPackVoltage()
     return packVolt;
 }
 
+uint32_t BMSModuleManager::getLastScanTime()
+{
+    return lastScanTime;
+}
+
+/*
+ * The pack figures below all come from the totals kept for the last complete scan so they cost the same
+ * however big the pack is and can be called as often as needed.
+ */
 float BMSModuleManager::getAvgTemperature()
 {
-    float avg = 0.0f;    
-    for (int x = 1; x <= MAX_MODULE_ADDR; x++)
+    if (pack.tempCount == 0) return 0.0f;
+    //the thermistors aren't linear so every reading has to be converted, but only once per scan and only if asked
+    if (!avgTempValid)
     {
-        if (modules[x].isExisting()) avg += modules[x].getAvgTemp();
+        float sum = 0.0f;
+        for (int i = 0; i < activeCount * 2; i++)
+        {
+            if (packLive[i / 2]) sum += BMSModule::countsToTemperature(i % 2, packTempCounts[i]);
+        }
+        avgTemp = sum / (float)pack.tempCount;
+        avgTempValid = true;
     }
-    avg = avg / (float)numFoundModules;
-
-    return avg;
+    return avgTemp;
 }
 
 float BMSModuleManager::getAvgCellVolt()
 {
-    float avg = 0.0f;    
-    for (int x = 1; x <= MAX_MODULE_ADDR; x++)
+    if (pack.cellCount == 0) return 0.0f;
+    return (pack.cellCountSum * CELL_VOLTS_PER_COUNT) / (float)pack.cellCount;
+}
+
+float BMSModuleManager::getLowCellVolt()
+{
+    if (pack.cellCount == 0) return 0.0f;
+    return BMSModule::cellCountsToVolts(pack.lowCellCounts);
+}
+
+float BMSModuleManager::getHighCellVolt()
+{
+    if (pack.cellCount == 0) return 0.0f;
+    return BMSModule::cellCountsToVolts(pack.highCellCounts);
+}
+
+//Difference between the highest and lowest cell in volts
+float BMSModuleManager::getCellSpread()
+{
+    if (pack.cellCount == 0) return 0.0f;
+    return BMSModule::cellCountsToVolts(pack.highCellCounts - pack.lowCellCounts);
+}
+
+//Pack module number of the lowest cell, 0 before the first scan
+int BMSModuleManager::getLowCellModule()
+{
+    return pack.lowCellModule;
+}
+
+int BMSModuleManager::getLowCellNum()
+{
+    return pack.lowCellNum;
+}
+
+int BMSModuleManager::getHighCellModule()
+{
+    return pack.highCellModule;
+}
+
+int BMSModuleManager::getHighCellNum()
+{
+    return pack.highCellNum;
+}
+
+//Where a pack module number is in activeModules, -1 if it isn't active
+int BMSModuleManager::activeSlot(int module)
+{
+    for (int m = 0; m < activeCount; m++) if (activeModules[m] == module) return m;
+    return -1;
+}
+
+//A pack cell's average distance from the pack average and how much that moves about, both in volts
+bool BMSModuleManager::getCellDeviation(int packCell, float &mean, float &spread)
+{
+    if (packCell < 0 || packCell >= activeCount * 6) return false;
+    if (!cellStats.getDeviation(packCell, mean, spread)) return false;
+    mean *= CELL_VOLTS_PER_COUNT;
+    spread *= CELL_VOLTS_PER_COUNT;
+    return true;
+}
+
+//CAN_FAULT_CELL_OFFSET and CAN_FAULT_CELL_ERRATIC bits for a pack cell
+uint8_t BMSModuleManager::getCellAnomalies(int packCell)
+{
+    if (packCell < 0 || packCell >= activeCount * 6) return 0;
+    uint8_t bit = 1 << (packCell % 6);
+    uint8_t flags = 0;
+    if (cellStats.getOffsetCells(packCell / 6) & bit) flags |= CAN_FAULT_CELL_OFFSET;
+    if (cellStats.getErraticCells(packCell / 6) & bit) flags |= CAN_FAULT_CELL_ERRATIC;
+    return flags;
+}
+
+//Add this scan's readings to the history, a sample for every cell and thermistor of each active module
+void BMSModuleManager::recordHistory()
+{
+    int modules = (activeCount < HISTORY_MODULES) ? activeCount : HISTORY_MODULES;
+    if (modules == 0) return;
+
+    history.startSample(millis());
+    for (int m = 0; m < modules; m++)
     {
-        if (modules[x].isExisting()) avg += modules[x].getAverageV();
+        for (int c = 0; c < 6; c++) history.add((m * 8) + c, packCellCounts[(m * 6) + c]);
+        BMSModule *mod = getModule(activeModules[m]);
+        history.add((m * 8) + 6, mod->getTemperatureCounts(0));
+        history.add((m * 8) + 7, mod->getTemperatureCounts(1));
     }
-    avg = avg / (float)numFoundModules;
+}
 
-    return avg;
+//History of a pack cell over the last window ms. False if the cell doesn't exist or is past HISTORY_MODULES
+bool BMSModuleManager::getCellHistory(int packCell, uint32_t window, HistoryWindow &result)
+{
+    if (packCell < 0 || packCell >= activeCount * 6) return false;
+    return history.getWindow(((packCell / 6) * 8) + (packCell % 6), window, result);
+}
+
+//Same for a thermistor. Pack thermistor numbers run 0 and 1 for the first active module, 2 and 3 for the next and so on
+bool BMSModuleManager::getTempHistory(int packTemp, uint32_t window, HistoryWindow &result)
+{
+    if (packTemp < 0 || packTemp >= activeCount * 2) return false;
+    return history.getWindow(((packTemp / 2) * 8) + 6 + (packTemp % 2), window, result);
+}
+
+/*
+ * Pack cell numbers run from 0 through every cell of every active module in order, the same numbering
+ * the pack details show. They only change when modules are added or dropped.
+ */
+int BMSModuleManager::getPackCellCount()
+{
+    return activeCount * 6;
+}
+
+//Module number and cell (0-5) a pack cell number is on. False if there is no such cell
+bool BMSModuleManager::getCellLocation(int packCell, int &module, int &cell)
+{
+    if (packCell < 0 || packCell >= activeCount * 6) return false;
+    module = activeModules[packCell / 6];
+    cell = packCell % 6;
+    return true;
+}
+
+float BMSModuleManager::getPackCellVoltage(int packCell)
+{
+    if (packCell < 0 || packCell >= activeCount * 6) return 0.0f;
+    return BMSModule::cellCountsToVolts(packCellCounts[packCell]);
+}
+
+//Lowest and highest temperature in the last scan. lowestPackTemp and highestPackTemp are the extremes since power up
+float BMSModuleManager::getLowTemp()
+{
+    return pack.lowTemp;
+}
+
+float BMSModuleManager::getHighTemp()
+{
+    return pack.highTemp;
+}
+
+/*
+ * Rebuild the list of pack module numbers that exist if any chain has gained or lost modules since last time.
+ * Pack wide loops go through this list instead of checking every possible module number.
+ */
+void BMSModuleManager::refreshIndex()
+{
+    uint32_t layout = 0;
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) layout += chains[c].getLayoutVersion();
+    if (layout == layoutSeen) return;
+    layoutSeen = layout;
+
+    int count = 0;
+    bool changed = false;
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        for (int n = 0; n < chains[c].getActiveCount(); n++)
+        {
+            uint8_t module = (c * MAX_MODULE_ADDR) + chains[c].getActiveAddress(n);
+            if (count >= activeCount || activeModules[count] != module) changed = true;
+            activeModules[count++] = module;
+        }
+    }
+    if (count != activeCount) changed = true;
+    activeCount = count;
+    numFoundModules = activeCount;
+    if (!changed) return; //modules that dropped out and came back in the same places keep their history
+
+    history.clear(); //history is kept by position in activeModules so it no longer lines up with the right cells
+    cellStats.clear(); //same for the cell statistics
+}
+
+//Put a pack cell into a list of the PACK_TOP_CELLS lowest or highest kept in order. Most cells fail the first compare
+static void rankCell(uint16_t *list, int filled, uint16_t cell, const uint16_t *counts, bool lowest)
+{
+    int pos = filled;
+    while (pos > 0 && (lowest ? (counts[cell] < counts[list[pos - 1]]) : (counts[cell] > counts[list[pos - 1]]))) pos--;
+    if (pos >= PACK_TOP_CELLS) return;
+    for (int i = (filled < PACK_TOP_CELLS) ? filled : (PACK_TOP_CELLS - 1); i > pos; i--) list[i] = list[i - 1];
+    list[pos] = cell;
+}
+
+//cells are 6.25V full scale so mV = counts * 6250 / 16383
+static uint16_t cellCountsToMillivolts(uint16_t counts)
+{
+    return ((uint32_t)counts * 6250ul) / 16383ul;
+}
+
+/*
+ * Copy the latest readings of every active module into the flat pack arrays, in activeModules order.
+ * Temperatures stay in counts, which rise with temperature, so only the lowest and highest of each thermistor
+ * channel get converted and the pack average waits until something asks for it. The pack totals and extremes
+ * are built up in the same pass as each module is copied and only replace the published ones once the whole
+ * pack is in, so a query never sees half of one scan and half of another.
+ *
+ * Only live modules go into the totals, extremes and rankings. A module isn't live until it has been read
+ * since it was found or restored, and stops being live while it is quarantined or past a break. Its last
+ * readings are still copied so they can be looked at, and packLive says not to trust them.
+ */
+void BMSModuleManager::mirrorModules()
+{
+    PackAggregates agg;
+    memset(&agg, 0, sizeof(agg));
+    agg.lowCellCounts = NO_MIN_COUNTS;
+    agg.highCellCounts = NO_MAX_COUNTS;
+    agg.lowTempCounts[0] = agg.lowTempCounts[1] = NO_MIN_COUNTS;
+    agg.highTempCounts[0] = agg.highTempCounts[1] = NO_MAX_COUNTS;
+
+    for (int m = 0; m < activeCount; m++)
+    {
+        BMSModule *mod = getModule(activeModules[m]);
+        for (int c = 0; c < 6; c++) packCellCounts[(m * 6) + c] = mod->getCellCounts(c);
+        packModuleCounts[m] = mod->getModuleCounts();
+        for (int t = 0; t < 2; t++) packTempCounts[(m * 2) + t] = mod->getTemperatureCounts(t);
+        packFaults[m] = mod->getFaults();
+        packAlerts[m] = mod->getAlerts();
+        packLive[m] = mod->hasReading() && !mod->isQuarantined() && isReachable(activeModules[m]);
+        if (!packLive[m]) continue;
+
+        for (int c = 0; c < 6; c++)
+        {
+            uint16_t counts = packCellCounts[(m * 6) + c];
+            agg.cellCountSum += counts;
+            if (counts < agg.lowCellCounts)
+            {
+                agg.lowCellCounts = counts;
+                agg.lowCellModule = activeModules[m];
+                agg.lowCellNum = c;
+            }
+            if (counts >= agg.highCellCounts)
+            {
+                agg.highCellCounts = counts;
+                agg.highCellModule = activeModules[m];
+                agg.highCellNum = c;
+            }
+            rankCell(agg.lowCells, agg.rankedCells, (m * 6) + c, packCellCounts, true);
+            rankCell(agg.highCells, agg.rankedCells, (m * 6) + c, packCellCounts, false);
+            if (agg.rankedCells < PACK_TOP_CELLS) agg.rankedCells++;
+        }
+        agg.cellCount += 6;
+        agg.moduleCountSum += packModuleCounts[m];
+        for (int t = 0; t < 2; t++)
+        {
+            uint16_t counts = packTempCounts[(m * 2) + t];
+            if (counts < agg.lowTempCounts[t]) agg.lowTempCounts[t] = counts;
+            if (counts > agg.highTempCounts[t]) agg.highTempCounts[t] = counts;
+        }
+        agg.tempCount += 2;
+    }
+
+    agg.lowTemp = 200.0f;
+    agg.highTemp = -100.0f;
+    for (int t = 0; t < 2; t++)
+    {
+        if (agg.lowTempCounts[t] == NO_MIN_COUNTS) continue;
+        float low = BMSModule::countsToTemperature(t, agg.lowTempCounts[t]);
+        float high = BMSModule::countsToTemperature(t, agg.highTempCounts[t]);
+        if (low < agg.lowTemp) agg.lowTemp = low;
+        if (high > agg.highTemp) agg.highTemp = high;
+    }
+
+    pack = agg;
+    avgTempValid = false;
 }
 
 void BMSModuleManager::printPackSummary()
@@ -297,116 +686,134 @@ void BMSModuleManager::printPackSummary()
     else Logger::console("                                   All systems go!");
     Logger::console("Modules: %i    Voltage: %fV   Avg Cell Voltage: %fV     Avg Temp: %fC ", numFoundModules, 
                     getPackVoltage(),getAvgCellVolt(), getAvgTemperature());
+    Logger::console("Last pack scan took %i us (%s, %s)", lastScanTime, (settings.scanMode == SCAN_BROADCAST) ? "broadcast" : "per module",
+                    (settings.readMode == READ_SNAPSHOT) ? "snapshot" : "split reads");
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        if (chains[c].getLinkBreak() > 0) Logger::console("Chain %i BROKEN before module %i for %l ms, modules past it are only probed", c, 
+                                                          chains[c].getLinkBreak(), chains[c].getOutageTime());
+        else if (chains[c].isLocatingBreak()) Logger::console("Chain %i: looking for a break", c);
+        else if (chains[c].getOutageTime() > 0) Logger::console("Chain %i: last break lasted %l ms, full scan %i us after it healed", c, 
+                                                                chains[c].getOutageTime(), chains[c].getRecoveryTime());
+    }
+    if (pack.cellCount > 0)
+    {
+        Logger::console("Lowest cell: %fV (module %i cell %i)   Highest cell: %fV (module %i cell %i)   Spread: %fV", getLowCellVolt(), 
+                        pack.lowCellModule, pack.lowCellNum + 1, getHighCellVolt(), pack.highCellModule, pack.highCellNum + 1, getCellSpread());
+        Logger::console("Temperatures: %fC-%fC", pack.lowTemp, pack.highTemp);
+    }
     Logger::console("");
-    for (int y = 1; y < 63; y++)
+    for (int m = 0; m < activeCount; m++)
     {
-        if (modules[y].isExisting())
-        {
-            faults = modules[y].getFaults();
-            alerts = modules[y].getAlerts();
-            COV = modules[y].getCOVCells();
-            CUV = modules[y].getCUVCells();
-
-            Logger::console("                               Module #%i", y);
-
-            Logger::console("  Voltage: %fV   (%fV-%fV)     Temperatures: (%fC-%fC)", modules[y].getModuleVoltage(), 
-                            modules[y].getLowCellV(), modules[y].getHighCellV(), modules[y].getLowTemp(), modules[y].getHighTemp());
-
-            SerialUSB.print("  Currently balancing cells: ");
-            for (int i = 0; i < 6; i++)
-            {                
-                if (modules[y].getBalancingState(i) == 1) 
-                {                    
-                    SerialUSB.print(i);
-                    SerialUSB.print(" ");
-                }
+        int y = activeModules[m];
+        faults = getModule(y)->getFaults();
+        alerts = getModule(y)->getAlerts();
+        COV = getModule(y)->getCOVCells();
+        CUV = getModule(y)->getCUVCells();
+
+        Logger::console("                               Module #%i", y);
+        if (!isReachable(y)) Logger::console("  UNREACHABLE - past a break in the chain, values are from before it");
+        else if (getModule(y)->isQuarantined()) Logger::console("  QUARANTINED - not answering, only probed every %i scans (health %i)", 
+                                                           QUARANTINE_PROBE_INTERVAL, getModule(y)->getHealth());
+        else if (getModule(y)->isDegraded()) Logger::console("  DEGRADED - communication problems (health %i)", getModule(y)->getHealth());
+
+        Logger::console("  Voltage: %fV   (%fV-%fV)     Temperatures: (%fC-%fC)", getModule(y)->getModuleVoltage(), 
+                        getModule(y)->getLowCellV(), getModule(y)->getHighCellV(), getModule(y)->getLowTemp(), getModule(y)->getHighTemp());
+
+        SerialUSB.print("  Currently balancing cells: ");
+        for (int i = 0; i < 6; i++)
+        {                
+            if (getModule(y)->getBalancingState(i) == 1) 
+            {                    
+                SerialUSB.print(i);
+                SerialUSB.print(" ");
             }
-            SerialUSB.println();
+        }
+        SerialUSB.println();
 
-            if (faults > 0)
+        if (faults > 0)
+        {
+            Logger::console("  MODULE IS FAULTED:");
+            if (faults & 1)
             {
-                Logger::console("  MODULE IS FAULTED:");
-                if (faults & 1)
+                SerialUSB.print("    Overvoltage Cell Numbers (1-6): ");
+                for (int i = 0; i < 6; i++)
                 {
-                    SerialUSB.print("    Overvoltage Cell Numbers (1-6): ");
-                    for (int i = 0; i < 6; i++)
+                    if (COV & (1 << i)) 
                     {
-                        if (COV & (1 << i)) 
-                        {
-                            SerialUSB.print(i+1);
-                            SerialUSB.print(" ");
-                        }
+                        SerialUSB.print(i+1);
+                        SerialUSB.print(" ");
                     }
-                    SerialUSB.println();
                 }
-                if (faults & 2)
+                SerialUSB.println();
+            }
+            if (faults & 2)
+            {
+                SerialUSB.print("    Undervoltage Cell Numbers (1-6): ");
+                for (int i = 0; i < 6; i++)
                 {
-                    SerialUSB.print("    Undervoltage Cell Numbers (1-6): ");
-                    for (int i = 0; i < 6; i++)
+                    if (CUV & (1 << i)) 
                     {
-                        if (CUV & (1 << i)) 
-                        {
-                            SerialUSB.print(i+1);
-                            SerialUSB.print(" ");
-                        }
+                        SerialUSB.print(i+1);
+                        SerialUSB.print(" ");
                     }
-                    SerialUSB.println();
-                }
-                if (faults & 4)
-                {
-                    Logger::console("    CRC error in received packet");
-                }
-                if (faults & 8)
-                {
-                    Logger::console("    Power on reset has occurred");
-                }
-                if (faults & 0x10)
-                {
-                    Logger::console("    Test fault active");
-                }
-                if (faults & 0x20)
-                {
-                    Logger::console("    Internal registers inconsistent");
                 }
+                SerialUSB.println();
             }
-            if (alerts > 0)
+            if (faults & 4)
             {
-                Logger::console("  MODULE HAS ALERTS:");
-                if (alerts & 1)
-                {
-                    Logger::console("    Over temperature on TS1");
-                }
-                if (alerts & 2)
-                {
-                    Logger::console("    Over temperature on TS2");
-                }
-                if (alerts & 4)
-                {
-                    Logger::console("    Sleep mode active");
-                }
-                if (alerts & 8)
-                {
-                    Logger::console("    Thermal shutdown active");
-                }
-                if (alerts & 0x10)
-                {
-                    Logger::console("    Test Alert");
-                }
-                if (alerts & 0x20)
-                {
-                    Logger::console("    OTP EPROM Uncorrectable Error");
-                }
-                if (alerts & 0x40)
-                {
-                    Logger::console("    GROUP3 Regs Invalid");
-                }
-                if (alerts & 0x80)
-                {
-                    Logger::console("    Address not registered");
-                }
+                Logger::console("    CRC error in received packet");
+            }
+            if (faults & 8)
+            {
+                Logger::console("    Power on reset has occurred");
+            }
+            if (faults & 0x10)
+            {
+                Logger::console("    Test fault active");
+            }
+            if (faults & 0x20)
+            {
+                Logger::console("    Internal registers inconsistent");
             }
-            if (faults > 0 || alerts > 0) SerialUSB.println();
         }
+        if (alerts > 0)
+        {
+            Logger::console("  MODULE HAS ALERTS:");
+            if (alerts & 1)
+            {
+                Logger::console("    Over temperature on TS1");
+            }
+            if (alerts & 2)
+            {
+                Logger::console("    Over temperature on TS2");
+            }
+            if (alerts & 4)
+            {
+                Logger::console("    Sleep mode active");
+            }
+            if (alerts & 8)
+            {
+                Logger::console("    Thermal shutdown active");
+            }
+            if (alerts & 0x10)
+            {
+                Logger::console("    Test Alert");
+            }
+            if (alerts & 0x20)
+            {
+                Logger::console("    OTP EPROM Uncorrectable Error");
+            }
+            if (alerts & 0x40)
+            {
+                Logger::console("    GROUP3 Regs Invalid");
+            }
+            if (alerts & 0x80)
+            {
+                Logger::console("    Address not registered");
+            }
+        }
+        if (faults > 0 || alerts > 0) SerialUSB.println();
     }
 }
 
@@ -427,38 +834,36 @@ void BMSModuleManager::printPackDetails()
     Logger::console("Modules: %i    Voltage: %fV   Avg Cell Voltage: %fV     Avg Temp: %fC ", numFoundModules, 
                     getPackVoltage(),getAvgCellVolt(), getAvgTemperature());
     Logger::console("");
-    for (int y = 1; y < 63; y++)
+    for (int m = 0; m < activeCount; m++)
     {
-        if (modules[y].isExisting())
+        int y = activeModules[m];
+        faults = getModule(y)->getFaults();
+        alerts = getModule(y)->getAlerts();
+        COV = getModule(y)->getCOVCells();
+        CUV = getModule(y)->getCUVCells();
+
+        SerialUSB.print("Module #");
+        SerialUSB.print(y);
+        if (y < 10) SerialUSB.print(" ");
+        SerialUSB.print("  ");
+        SerialUSB.print(getModule(y)->getModuleVoltage());
+        SerialUSB.print("V");
+        for (int i = 0; i < 6; i++)
         {
-            faults = modules[y].getFaults();
-            alerts = modules[y].getAlerts();
-            COV = modules[y].getCOVCells();
-            CUV = modules[y].getCUVCells();
-
-            SerialUSB.print("Module #");
-            SerialUSB.print(y);
-            if (y < 10) SerialUSB.print(" ");
-            SerialUSB.print("  ");
-            SerialUSB.print(modules[y].getModuleVoltage());
+            if (cellNum < 10) SerialUSB.print(" ");
+            SerialUSB.print("  Cell");
+            SerialUSB.print(cellNum++);
+            SerialUSB.print(": ");
+            SerialUSB.print(getModule(y)->getCellVoltage(i));
             SerialUSB.print("V");
-            for (int i = 0; i < 6; i++)
-            {
-                if (cellNum < 10) SerialUSB.print(" ");
-                SerialUSB.print("  Cell");
-                SerialUSB.print(cellNum++);
-                SerialUSB.print(": ");
-                SerialUSB.print(modules[y].getCellVoltage(i));
-                SerialUSB.print("V");
-                if (modules[y].getBalancingState(i) == 1) SerialUSB.print("*");
-                else SerialUSB.print(" ");
-            }
-            SerialUSB.print("  Neg Term Temp: ");
-            SerialUSB.print(modules[y].getTemperature(0));
-            SerialUSB.print("C  Pos Term Temp: ");
-            SerialUSB.print(modules[y].getTemperature(1)); 
-            SerialUSB.println("C");
+            if (getModule(y)->getBalancingState(i) == 1) SerialUSB.print("*");
+            else SerialUSB.print(" ");
         }
+        SerialUSB.print("  Neg Term Temp: ");
+        SerialUSB.print(getModule(y)->getTemperature(0));
+        SerialUSB.print("C  Pos Term Temp: ");
+        SerialUSB.print(getModule(y)->getTemperature(1)); 
+        SerialUSB.println("C");
     }
 }
 
@@ -467,29 +872,72 @@ void BMSModuleManager::processCANMsg(CAN_FRAME &frame)
     uint8_t battId = (frame.id >> 16) & 0xF;
     uint8_t moduleId = (frame.id >> 8) & 0xFF;
     uint8_t cellId = (frame.id) & 0xFF;
-    
-    if (moduleId = 0xFF)  //every module
+
+    if (cellId == CAN_BUS_STATS) //bus telemetry for one module or, with module 0xFF, the whole chain
+    {
+        sendBusStats(moduleId);
+        return;
+    }
+    if (cellId == CAN_BUS_STATS_RESET)
+    {
+        resetBusStats();
+        return;
+    }
+    if (cellId == CAN_CHAIN_STATUS)
+    {
+        if (moduleId == 0xFF) for (int c = 0; c < BMS_CHAIN_COUNT; c++) sendChainStatus(c);
+        else sendChainStatus(moduleId);
+        return;
+    }
+    if (cellId == CAN_PACK_EXTREMES)
+    {
+        sendPackExtremes();
+        return;
+    }
+    if (cellId == CAN_HISTORY)
+    {
+        uint32_t window = 60;
+        if (frame.length >= 3) window = frame.data.byte[1] + (frame.data.byte[2] << 8);
+        sendHistory(moduleId, frame.data.byte[0], window * 1000ul);
+        return;
+    }
+    if (cellId == CAN_CELL_OUTLIERS)
+    {
+        if (moduleId == 0xFF) for (int r = 0; r < pack.rankedCells; r++) sendCellOutliers(r);
+        else sendCellOutliers(moduleId);
+        return;
+    }
+    if (cellId != 0xFF && cellId > 5) return; //modules have cells 0-5, anything else isn't a request we know
+
+    if (moduleId == 0xFF)  //every module
     {
         if (cellId == 0xFF) sendBatterySummary();        
         else 
         {
-            for (int i = 1; i <= MAX_MODULE_ADDR; i++) 
-            {
-                if (modules[i].isExisting()) 
-                {
-                    sendCellDetails(i, cellId);
-                    delayMicroseconds(500);
-                }
-            }
+            detailCursor = 0;   //sent a module at a time from loop(), see sendQueuedDetails
+            detailCell = cellId;
         }
     }
     else //a specific module
     {
+        if (moduleId < 1 || moduleId > PACK_MODULES) return; //the id comes straight off the bus, don't index past the modules with it
         if (cellId == 0xFF) sendModuleSummary(moduleId);
         else sendCellDetails(moduleId, cellId);
     }
 }
 
+/*
+ * Cell details for every module go out one module per call, at least CAN_DETAIL_SPACING_US apart, so a
+ * request for the whole pack doesn't hold up loop() or overrun the CAN transmit mailboxes.
+ */
+void BMSModuleManager::sendQueuedDetails()
+{
+    if (detailCursor >= activeCount) return;
+    if ((uint32_t)(micros() - detailSentAt) < CAN_DETAIL_SPACING_US) return;
+    sendCellDetails(activeModules[detailCursor++], detailCell);
+    detailSentAt = micros();
+}
+
 void BMSModuleManager::sendBatterySummary()
 {
     CAN_FRAME outgoing;
@@ -520,25 +968,28 @@ void BMSModuleManager::sendBatterySummary()
 void BMSModuleManager::sendModuleSummary(int module)
 {
     CAN_FRAME outgoing;
+    BMSModule *mod = getModule(module);
+    if (!mod) return;
+
     outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + ((module & 0xFF) << 8) + 0xFF;
     outgoing.rtr = 0;
     outgoing.priority = 1;
     outgoing.extended = true;
     outgoing.length = 8;
 
-    uint16_t battV = uint16_t(modules[module].getModuleVoltage() * 100.0f);
+    uint16_t battV = mod->getModuleCentivolts();
     outgoing.data.byte[0] = battV & 0xFF;
     outgoing.data.byte[1] = battV >> 8;
     outgoing.data.byte[2] = 0;  //instantaneous current. Not measured at this point
     outgoing.data.byte[3] = 0;
     outgoing.data.byte[4] = 50; //state of charge
-    int avgTemp = (int)modules[module].getAvgTemp() + 40;
+    int avgTemp = (int)mod->getAvgTemp() + 40;
     if (avgTemp < 0) avgTemp = 0;
     outgoing.data.byte[5] = avgTemp;
-    avgTemp = (int)modules[module].getLowestTemp() + 40;
+    avgTemp = (int)mod->getLowestTemp() + 40;
     if (avgTemp < 0) avgTemp = 0;
     outgoing.data.byte[6] = avgTemp;
-    avgTemp = (int)modules[module].getHighestTemp() + 40;
+    avgTemp = (int)mod->getHighestTemp() + 40;
     if (avgTemp < 0) avgTemp = 0;
     outgoing.data.byte[7] = avgTemp;
 
@@ -548,28 +999,200 @@ void BMSModuleManager::sendModuleSummary(int module)
 void BMSModuleManager::sendCellDetails(int module, int cell)
 {
     CAN_FRAME outgoing;
+    BMSModule *mod = getModule(module);
+    if (!mod) return;
+
     outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + ((module & 0xFF) << 8) + (cell & 0xFF);
     outgoing.rtr = 0;
     outgoing.priority = 1;
     outgoing.extended = true;
     outgoing.length = 8;
 
-    uint16_t battV = uint16_t(modules[module].getCellVoltage(cell) * 100.0f);
+    uint16_t battV = mod->getCellCentivolts(cell);
     outgoing.data.byte[0] = battV & 0xFF;
     outgoing.data.byte[1] = battV >> 8;
-    battV = uint16_t(modules[module].getHighestCellVolt(cell) * 100.0f);
+    battV = mod->getHighestCellCentivolts(cell);
     outgoing.data.byte[2] = battV & 0xFF;
     outgoing.data.byte[3] = battV >> 8;
-    battV = uint16_t(modules[module].getLowestCellVolt(cell) * 100.0f);
+    battV = mod->getLowestCellCentivolts(cell);
     outgoing.data.byte[4] = battV & 0xFF;
     outgoing.data.byte[5] = battV >> 8;
-    int instTemp = modules[module].getHighTemp() + 40;
+    int instTemp = mod->getHighTemp() + 40;
     outgoing.data.byte[6] = instTemp; // should be nearest temperature reading not highest but this works too.
-    outgoing.data.byte[7] = 0; //Bit encoded fault data. No definitions for this yet.
+    uint8_t faultBits = 0; //Bit encoded fault data
+    if (mod->isDegraded()) faultBits |= CAN_FAULT_DEGRADED;
+    if (mod->isQuarantined()) faultBits |= CAN_FAULT_QUARANTINED;
+    if (!isReachable(module)) faultBits |= CAN_FAULT_UNREACHABLE;
+    int slot = activeSlot(module);
+    if (slot >= 0 && cell >= 0 && cell < 6) faultBits |= getCellAnomalies((slot * 6) + cell);
+    outgoing.data.byte[7] = faultBits;
 
     Can0.sendFrame(outgoing);
 }
 
+static uint16_t saturate16(uint32_t val)
+{
+    return (val > 0xFFFF) ? 0xFFFF : val;
+}
+
+static uint8_t saturate8(uint32_t val)
+{
+    return (val > 0xFF) ? 0xFF : val;
+}
+
+static int16_t saturateSigned16(float val)
+{
+    if (val > 32767.0f) return 32767;
+    if (val < -32768.0f) return -32768;
+    return (int16_t)val;
+}
+
+static void addCounters(BusCounters &total, const BusCounters &add)
+{
+    total.transactions += add.transactions;
+    total.retries += add.retries;
+    total.crcErrors += add.crcErrors;
+    total.shortReplies += add.shortReplies;
+    total.timeouts += add.timeouts;
+    total.failures += add.failures;
+}
+
+/*
+ * Bus telemetry frame. Counters saturate rather than wrap.
+ * bytes 0-1 transactions, 2-3 retries, 4 CRC errors, 5 short replies, 6 timeouts,
+ * byte 7 is the latency bucket 90% of good replies came back within (see BMSBusStats) or 0xFF if there are none yet.
+ * Module 0xFF gives the totals for every chain together.
+ */
+void BMSModuleManager::sendBusStats(int module)
+{
+    CAN_FRAME outgoing;
+    BusCounters counters;
+    uint16_t latency[STATS_LATENCY_BUCKETS];
+
+    if (module == 0xFF)
+    {
+        BusCounters chainCounters;
+        uint16_t chainLatency[STATS_LATENCY_BUCKETS];
+        memset(&counters, 0, sizeof(counters));
+        memset(latency, 0, sizeof(latency));
+        for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+        {
+            chains[c].getBus().getStats().getTotals(chainCounters);
+            chains[c].getBus().getStats().getTotalLatency(chainLatency);
+            addCounters(counters, chainCounters);
+            for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+            {
+                uint32_t sum = latency[b] + chainLatency[b];
+                latency[b] = (sum > 0xFFFF) ? 0xFFFF : sum;
+            }
+        }
+    }
+    else
+    {
+        if (module < 1 || module > PACK_MODULES) return;
+        BMSBusStats &stats = chains[(module - 1) / MAX_MODULE_ADDR].getBus().getStats();
+        int addr = ((module - 1) % MAX_MODULE_ADDR) + 1;
+        counters = stats.getModule(addr);
+        memcpy(latency, stats.getLatency(addr), sizeof(latency));
+    }
+
+    outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + ((module & 0xFF) << 8) + CAN_BUS_STATS;
+    outgoing.rtr = 0;
+    outgoing.priority = 1;
+    outgoing.extended = true;
+    outgoing.length = 8;
+
+    uint16_t val = saturate16(counters.transactions);
+    outgoing.data.byte[0] = val & 0xFF;
+    outgoing.data.byte[1] = val >> 8;
+    val = saturate16(counters.retries);
+    outgoing.data.byte[2] = val & 0xFF;
+    outgoing.data.byte[3] = val >> 8;
+    outgoing.data.byte[4] = saturate8(counters.crcErrors);
+    outgoing.data.byte[5] = saturate8(counters.shortReplies);
+    outgoing.data.byte[6] = saturate8(counters.timeouts);
+    outgoing.data.byte[7] = (uint8_t)BMSBusStats::percentileBucket(latency, 90);
+
+    Can0.sendFrame(outgoing);
+}
+
+void BMSModuleManager::resetBusStats()
+{
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++) chains[c].getBus().getStats().reset();
+    for (int y = 1; y <= PACK_MODULES; y++) getModule(y)->resetPacketCounts();
+    Logger::info("Bus telemetry cleared");
+}
+
+static void printLatency(const uint16_t *latency)
+{
+    SERIALCONSOLE.print("    Latency (us): ");
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+    {
+        if (latency[b] == 0) continue;
+        SERIALCONSOLE.print("<");
+        SERIALCONSOLE.print(BMSBusStats::bucketLimit(b));
+        SERIALCONSOLE.print(":");
+        SERIALCONSOLE.print(latency[b]);
+        SERIALCONSOLE.print(" ");
+    }
+    SERIALCONSOLE.println();
+}
+
+/*
+ * Dump the bus telemetry to the console. For each chain the whole chain first, then every address and register 
+ * that has seen traffic. Rates are per thousand transactions so a marginal link stands out even with a small count.
+ */
+void BMSModuleManager::printBusStats()
+{
+    BusCounters totals;
+    uint16_t latency[STATS_LATENCY_BUCKETS];
+
+    for (int c = 0; c < BMS_CHAIN_COUNT; c++)
+    {
+        BMSBusStats &stats = chains[c].getBus().getStats();
+
+        stats.getTotals(totals);
+        stats.getTotalLatency(latency);
+
+        Logger::console("");
+        Logger::console("Bus telemetry for chain %i", c);
+        Logger::console("  Transactions: %l  Retries: %l  CRC errors: %l  Short replies: %l  Timeouts: %l  Failed: %l",
+                        totals.transactions, totals.retries, totals.crcErrors, totals.shortReplies, totals.timeouts, totals.failures);
+        Logger::console("  Receive overruns: %l", stats.getOverruns());
+        if (totals.transactions > 0)
+        {
+            Logger::console("  Per 1000 transactions - retries: %l  CRC errors: %l", (totals.retries * 1000) / totals.transactions,
+                            (totals.crcErrors * 1000) / totals.transactions);
+        }
+        printLatency(latency);
+
+        Logger::console("");
+        Logger::console("Per module:");
+        for (int y = 0; y < STATS_SLOTS; y++)
+        {
+            const BusCounters &mod = stats.getModule(y);
+            if (mod.transactions == 0 && mod.retries == 0) continue;
+            if (y == 0) Logger::console("  Unaddressed");
+            else if (y == 0x3F) Logger::console("  Broadcast");
+            else Logger::console("  Module #%i  (good packets: %i  bad packets: %i)", (c * MAX_MODULE_ADDR) + y, 
+                                 chains[c].getModule(y).getGoodPackets(), chains[c].getModule(y).getBadPackets());
+            Logger::console("    Transactions: %l  Retries: %l  CRC errors: %l  Short replies: %l  Timeouts: %l  Failed: %l",
+                            mod.transactions, mod.retries, mod.crcErrors, mod.shortReplies, mod.timeouts, mod.failures);
+            printLatency(stats.getLatency(y));
+        }
+
+        Logger::console("");
+        Logger::console("Per register:");
+        for (int r = 0; r < STATS_SLOTS; r++)
+        {
+            const BusCounters &reg = stats.getRegister(r);
+            if (reg.transactions == 0 && reg.retries == 0) continue;
+            Logger::console("  Reg 0x%x  Transactions: %l  Retries: %l  CRC errors: %l  Short replies: %l  Timeouts: %l  Failed: %l",
+                            r, reg.transactions, reg.retries, reg.crcErrors, reg.shortReplies, reg.timeouts, reg.failures);
+        }
+    }
+}
+
 //The SerialConsole actually sets the battery ID to a specific value. We just have to set up the CAN filter here to
 //match.
 void BMSModuleManager::setBatteryID()
@@ -579,3 +1202,240 @@ void BMSModuleManager::setBatteryID()
     Can0.setRXFilter(0, canID, 0x1FFF0000ul, true);
 }
 
+/*
+ * Link state of one chain. Sent when asked for and whenever a break is found or heals.
+ * byte 0 modules found on the chain, byte 1 first address that can't be reached (0 if the chain is whole),
+ * byte 2 pack wide number of that module (0 if whole), byte 3 1 while a break is being looked for,
+ * bytes 4-5 length of the current or last break in seconds, bytes 6-7 ms from the last break healing to a full scan.
+ */
+void BMSModuleManager::sendChainStatus(int chain)
+{
+    CAN_FRAME outgoing;
+    if (chain < 0 || chain >= BMS_CHAIN_COUNT) return;
+
+    outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + ((chain & 0xFF) << 8) + CAN_CHAIN_STATUS;
+    outgoing.rtr = 0;
+    outgoing.priority = 1;
+    outgoing.extended = true;
+    outgoing.length = 8;
+
+    int linkBreak = chains[chain].getLinkBreak();
+    outgoing.data.byte[0] = chains[chain].getNumFoundModules();
+    outgoing.data.byte[1] = linkBreak;
+    outgoing.data.byte[2] = (linkBreak > 0) ? (chain * MAX_MODULE_ADDR) + linkBreak : 0;
+    outgoing.data.byte[3] = chains[chain].isLocatingBreak() ? 1 : 0;
+    uint16_t val = saturate16(chains[chain].getOutageTime() / 1000);
+    outgoing.data.byte[4] = val & 0xFF;
+    outgoing.data.byte[5] = val >> 8;
+    val = saturate16(chains[chain].getRecoveryTime() / 1000);
+    outgoing.data.byte[6] = val & 0xFF;
+    outgoing.data.byte[7] = val >> 8;
+
+    Can0.sendFrame(outgoing);
+}
+
+/*
+ * Lowest and highest cell in the pack as of the last scan, straight from the pack totals.
+ * bytes 0-1 lowest cell in mV, byte 2 its pack module number, byte 3 its cell (0-5),
+ * bytes 4-7 the same for the highest cell. All zero before the first scan.
+ */
+void BMSModuleManager::sendPackExtremes()
+{
+    CAN_FRAME outgoing;
+    outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + 0xFF00 + CAN_PACK_EXTREMES;
+    outgoing.rtr = 0;
+    outgoing.priority = 1;
+    outgoing.extended = true;
+    outgoing.length = 8;
+
+    uint16_t lowMV = 0, highMV = 0;
+    if (pack.cellCount > 0)
+    {
+        lowMV = cellCountsToMillivolts(pack.lowCellCounts);
+        highMV = cellCountsToMillivolts(pack.highCellCounts);
+    }
+    outgoing.data.byte[0] = lowMV & 0xFF;
+    outgoing.data.byte[1] = lowMV >> 8;
+    outgoing.data.byte[2] = pack.lowCellModule;
+    outgoing.data.byte[3] = pack.lowCellNum;
+    outgoing.data.byte[4] = highMV & 0xFF;
+    outgoing.data.byte[5] = highMV >> 8;
+    outgoing.data.byte[6] = pack.highCellModule;
+    outgoing.data.byte[7] = pack.highCellNum;
+
+    Can0.sendFrame(outgoing);
+}
+
+/*
+ * One rank of the lowest and highest cell lists, rank 0 being the very lowest and highest.
+ * bytes 0-1 the low cell in mV, byte 2 its pack module number, byte 3 its cell (0-5),
+ * bytes 4-7 the same for the high cell. Nothing is sent for a rank that isn't filled in.
+ */
+void BMSModuleManager::sendCellOutliers(int rank)
+{
+    CAN_FRAME outgoing;
+    int module, cell;
+    if (rank < 0 || rank >= pack.rankedCells) return;
+
+    outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + ((rank & 0xFF) << 8) + CAN_CELL_OUTLIERS;
+    outgoing.rtr = 0;
+    outgoing.priority = 1;
+    outgoing.extended = true;
+    outgoing.length = 8;
+
+    uint16_t mv = cellCountsToMillivolts(packCellCounts[pack.lowCells[rank]]);
+    getCellLocation(pack.lowCells[rank], module, cell);
+    outgoing.data.byte[0] = mv & 0xFF;
+    outgoing.data.byte[1] = mv >> 8;
+    outgoing.data.byte[2] = module;
+    outgoing.data.byte[3] = cell;
+    mv = cellCountsToMillivolts(packCellCounts[pack.highCells[rank]]);
+    getCellLocation(pack.highCells[rank], module, cell);
+    outgoing.data.byte[4] = mv & 0xFF;
+    outgoing.data.byte[5] = mv >> 8;
+    outgoing.data.byte[6] = module;
+    outgoing.data.byte[7] = cell;
+
+    Can0.sendFrame(outgoing);
+}
+
+void BMSModuleManager::printCellOutliers()
+{
+    int module, cell;
+
+    Logger::console("");
+    if (pack.rankedCells == 0)
+    {
+        Logger::console("No cells read yet");
+        return;
+    }
+    Logger::console("Lowest cells                              Highest cells");
+    for (int r = 0; r < pack.rankedCells; r++)
+    {
+        int low = pack.lowCells[r];
+        int high = pack.highCells[r];
+        getCellLocation(low, module, cell);
+        int lowModule = module, lowCell = cell;
+        getCellLocation(high, module, cell);
+        Logger::console("  Cell%i (module %i cell %i): %fV        Cell%i (module %i cell %i): %fV", low, lowModule, lowCell + 1, 
+                        getPackCellVoltage(low), high, module, cell + 1, getPackCellVoltage(high));
+    }
+    Logger::console("Spread: %fV over %i cells", getCellSpread(), getPackCellCount());
+
+    Logger::console("");
+    float mV = CELL_VOLTS_PER_COUNT * 1000.0f;
+    Logger::console("Cells standing out from the pack (mean deviation %fmV +/- %fmV, swing %fmV +/- %fmV):", cellStats.getPeerMean() * mV, 
+                    cellStats.getPeerMeanSD() * mV, cellStats.getPeerSpread() * mV, cellStats.getPeerSpreadSD() * mV);
+    bool any = false;
+    for (int n = 0; n < activeCount * 6; n++)
+    {
+        uint8_t flags = getCellAnomalies(n);
+        float mean, spread;
+        if (!flags || !getCellDeviation(n, mean, spread)) continue;
+        getCellLocation(n, module, cell);
+        Logger::console("  Cell%i (module %i cell %i): %fmV from the pack, swings %fmV%s%s", n, module, cell + 1, mean * 1000.0f, spread * 1000.0f,
+                        (flags & CAN_FAULT_CELL_OFFSET) ? "  OFFSET" : "", (flags & CAN_FAULT_CELL_ERRATIC) ? "  ERRATIC" : "");
+        any = true;
+    }
+    if (!any) Logger::console("  none");
+}
+
+/*
+ * History of one channel of a module. The request has the channel (0-5 cells, 6-7 thermistors) in data byte 0
+ * and the window in seconds in bytes 1-2, 60 seconds if left out. The reply has the lowest and highest
+ * reading in the window in bytes 0-1 and 2-3, the slope in bytes 4-5, the channel in byte 6 and the number of
+ * samples used in byte 7. Cells are in mV and 0.1mV per minute, thermistors in signed 0.1C and 0.01C per minute.
+ * Nothing is sent if the module has no history.
+ */
+void BMSModuleManager::sendHistory(int module, int channel, uint32_t window)
+{
+    CAN_FRAME outgoing;
+    HistoryWindow hist;
+    int m = activeSlot(module);
+    if (m < 0 || channel < 0 || channel > 7) return;
+    if (channel < 6 && !getCellHistory((m * 6) + channel, window, hist)) return;
+    if (channel >= 6 && !getTempHistory((m * 2) + channel - 6, window, hist)) return;
+
+    outgoing.id = (0x1BA00000ul) + ((settings.batteryID & 0xF) << 16) + ((module & 0xFF) << 8) + CAN_HISTORY;
+    outgoing.rtr = 0;
+    outgoing.priority = 1;
+    outgoing.extended = true;
+    outgoing.length = 8;
+
+    int16_t low, high, slope;
+    if (channel < 6)
+    {
+        low = cellCountsToMillivolts(hist.minimum);
+        high = cellCountsToMillivolts(hist.maximum);
+        slope = saturateSigned16(hist.slope * CELL_VOLTS_PER_COUNT * 600000.0f);
+    }
+    else
+    {
+        low = Thermistor::toCelsius(channel - 6, hist.minimum) * 10.0f;
+        high = Thermistor::toCelsius(channel - 6, hist.maximum) * 10.0f;
+        slope = saturateSigned16(hist.slope * Thermistor::slope(channel - 6, hist.newest) * 6000.0f);
+    }
+    outgoing.data.byte[0] = low & 0xFF;
+    outgoing.data.byte[1] = (low >> 8) & 0xFF;
+    outgoing.data.byte[2] = high & 0xFF;
+    outgoing.data.byte[3] = (high >> 8) & 0xFF;
+    outgoing.data.byte[4] = slope & 0xFF;
+    outgoing.data.byte[5] = (slope >> 8) & 0xFF;
+    outgoing.data.byte[6] = channel;
+    outgoing.data.byte[7] = saturate8(hist.samples);
+
+    Can0.sendFrame(outgoing);
+}
+
+/*
+ * What one cell or thermistor did over the whole of each history tier, so the short, medium and long term
+ * trends are all on screen at once.
+ */
+void BMSModuleManager::printHistory(int packChannel, bool temperature)
+{
+    HistoryWindow hist;
+    int module, cell;
+
+    Logger::console("");
+    if (temperature)
+    {
+        if (packChannel < 0 || packChannel >= activeCount * 2 || (packChannel / 2) >= HISTORY_MODULES)
+        {
+            Logger::console("No history for thermistor %i", packChannel);
+            return;
+        }
+        Logger::console("History of thermistor %i (module %i %s)", packChannel, activeModules[packChannel / 2], 
+                        (packChannel % 2) ? "positive terminal" : "negative terminal");
+    }
+    else
+    {
+        if (!getCellLocation(packChannel, module, cell) || (packChannel / 6) >= HISTORY_MODULES)
+        {
+            Logger::console("No history for cell %i", packChannel);
+            return;
+        }
+        Logger::console("History of Cell%i (module %i cell %i)", packChannel, module, cell + 1);
+    }
+
+    for (int t = 0; t < HISTORY_TIERS; t++)
+    {
+        uint32_t span = history.getSpan(t);
+        if (t > 0 && span == 0) break;
+        bool ok = temperature ? getTempHistory(packChannel, span, hist) : getCellHistory(packChannel, span, hist);
+        if (!ok || hist.tier != t) break;
+        if (temperature)
+        {
+            int therm = packChannel % 2;
+            Logger::console("  last %i s (%i samples): %fC-%fC  now %fC  slope %fC/min", hist.span / 1000, hist.samples, 
+                            Thermistor::toCelsius(therm, hist.minimum), Thermistor::toCelsius(therm, hist.maximum), 
+                            Thermistor::toCelsius(therm, hist.newest), hist.slope * Thermistor::slope(therm, hist.newest) * 60.0f);
+        }
+        else
+        {
+            Logger::console("  last %i s (%i samples): %fV-%fV  range %fmV  now %fV  slope %fmV/min", hist.span / 1000, hist.samples,
+                            BMSModule::cellCountsToVolts(hist.minimum), BMSModule::cellCountsToVolts(hist.maximum),
+                            BMSModule::cellCountsToVolts(hist.maximum - hist.minimum) * 1000.0f, BMSModule::cellCountsToVolts(hist.newest),
+                            hist.slope * CELL_VOLTS_PER_COUNT * 60000.0f);
+        }
+    }
+}
@@ -1,16 +1,64 @@
 #pragma once
 #include "config.h"
 #include "BMSModule.h"
+#include "BMSChain.h"
+#include "BMSCapture.h"
+#include "BMSHistory.h"
+#include "BMSCellStats.h"
 #include <due_can.h>
 
+#define CAN_BUS_STATS           0xF0    //cell id that requests bus telemetry instead of cell details
+#define CAN_BUS_STATS_RESET     0xF1    //cell id that clears the bus telemetry
+#define CAN_CHAIN_STATUS        0xF2    //cell id that requests the link state of a chain, module id is the chain or 0xFF for all
+#define CAN_PACK_EXTREMES       0xF3    //cell id that requests the lowest and highest cell in the pack and where they are
+#define CAN_CELL_OUTLIERS       0xF4    //cell id that requests the lowest and highest cells by rank, module id is the rank or 0xFF for all
+#define CAN_DETAIL_SPACING_US   500     //gap between the cell detail frames of an all modules request
+#define PACK_TOP_CELLS          4       //how many of the lowest and highest cells are kept track of
+#define CAN_HISTORY             0xF5    //cell id that requests the history of one channel of a module, see sendHistory
+#define STATUS_READ_INTERVAL    5   //in broadcast scan mode the status registers are only read every this many scans
+#define QUARANTINE_PROBE_INTERVAL 10 //quarantined modules are only tried every this many scans
+#define ENUMERATE_INTERVAL      10  //address 0 is checked for newly connected modules every this many scans
+#define CAN_FAULT_DEGRADED      0x01    //fault byte bits in the cell details frame
+#define CAN_FAULT_QUARANTINED   0x02
+#define CAN_FAULT_UNREACHABLE   0x04    //module is past a break in its chain, values are from before the break
+#define CAN_FAULT_CELL_OFFSET   0x08    //cell sits persistently above or below the rest of the pack
+#define CAN_FAULT_CELL_ERRATIC  0x10    //cell swings against the rest of the pack far more than the others do
+
+//Pack wide figures worked out from the readings of one complete scan. Only live modules count, see mirrorModules
+typedef struct {
+    uint32_t cellCountSum;      // every cell's raw counts added together
+    uint16_t cellCount;
+    uint32_t moduleCountSum;
+    uint16_t lowCellCounts;
+    uint16_t highCellCounts;
+    uint8_t lowCellModule;      // pack module number and cell (0-5) of the lowest and highest cell
+    uint8_t lowCellNum;
+    uint8_t highCellModule;
+    uint8_t highCellNum;
+    uint16_t tempCount;
+    uint16_t lowTempCounts[2];  // per thermistor channel, counts rise with temperature
+    uint16_t highTempCounts[2];
+    float lowTemp;              // the four above converted once at the end of the scan
+    float highTemp;
+    uint16_t lowCells[PACK_TOP_CELLS];  // pack cell numbers of the lowest cells, lowest first
+    uint16_t highCells[PACK_TOP_CELLS]; // and of the highest, highest first
+    uint8_t rankedCells;                // how many of each list are filled in
+} PackAggregates;
+
 class BMSModuleManager
 {
 public:
     BMSModuleManager();
+    void loop();
+    void setTransport(BMSTransport *port, int chain = 0);
+    BMSModule *getModule(int packModule);
+    bool isReachable(int packModule);
     void balanceCells();
     void setupBoards();
     void findBoards();
     void renumberBoardIDs();
+    bool warmBoot();
+    void saveTopology();
     void clearFaults();
     void sleepBoards();
     void wakeBoards();
@@ -20,9 +68,35 @@ public:
     float getPackVoltage();
     float getAvgTemperature();
     float getAvgCellVolt();
+    float getLowCellVolt();
+    float getHighCellVolt();
+    float getCellSpread();
+    int getLowCellModule();
+    int getLowCellNum();
+    int getHighCellModule();
+    int getHighCellNum();
+    float getLowTemp();
+    float getHighTemp();
+    int getPackCellCount();
+    bool getCellLocation(int packCell, int &module, int &cell);
+    float getPackCellVoltage(int packCell);
+    void printCellOutliers();
+    bool getCellHistory(int packCell, uint32_t window, HistoryWindow &result);
+    bool getTempHistory(int packTemp, uint32_t window, HistoryWindow &result);
+    void printHistory(int packChannel, bool temperature);
+    bool getCellDeviation(int packCell, float &mean, float &spread);
+    uint8_t getCellAnomalies(int packCell);
+    uint32_t getLastScanTime();
     void processCANMsg(CAN_FRAME &frame);
     void printPackSummary();
     void printPackDetails();
+    void printBusStats();
+    void resetBusStats();
+    void calibrateBaud();
+    void applyBaudSettings();
+    void setCapture(bool enable);
+    bool isCapturing();
+    void dumpCapture();
 
 private:
     float packVolt;                         // All modules added together
@@ -30,12 +104,50 @@ private:
     float highestPackVolt;
     float lowestPackTemp;
     float highestPackTemp;
-    BMSModule modules[MAX_MODULE_ADDR + 1]; // store data for as many modules as we've configured for.
-    int numFoundModules;                    // The number of modules that seem to exist
+    BMSChain chains[BMS_CHAIN_COUNT];       // each chain has its own port, bus and modules
+    int numFoundModules;                    // The number of modules that seem to exist across every chain
     bool isFaulted;
+    bool scanInProgress;
+    BMSCapture capture;                     // raw traffic from every chain while capturing
+    BMSCaptureTransport captureTaps[BMS_CHAIN_COUNT]; // slot in front of each chain's real transport while capturing
+    bool capturing;
+    uint32_t scanCount;
+    uint32_t scanStart;                     // micros() when the scan in progress started
+    uint32_t lastScanTime;                  // how long the last full pack scan took in microseconds
+    uint32_t savedFingerprint;              // fingerprint of the topology in EEPROM, so it is only written when it changes
+    uint8_t activeModules[PACK_MODULES];    // pack numbers of the modules that exist, lowest first
+    int activeCount;
+    uint32_t layoutSeen;                    // sum of the chain layout versions when activeModules was built
+    //Readings of every active module as of the end of the last scan, in activeModules order
+    uint16_t packCellCounts[PACK_MODULES * 6];
+    uint16_t packModuleCounts[PACK_MODULES];
+    uint16_t packTempCounts[PACK_MODULES * 2]; // both sensors of each module, only converted when asked for
+    uint8_t packFaults[PACK_MODULES];
+    uint8_t packAlerts[PACK_MODULES];
+    bool packLive[PACK_MODULES];            // read since it was found, not quarantined and not past a break
+    PackAggregates pack;                    // totals and extremes of the last complete scan, replaced as a whole at the end of each
+    float avgTemp;                          // pack average temperature, worked out on first use after each scan
+    bool avgTempValid;
+    BMSHistory history;                     // recent readings of the first HISTORY_MODULES active modules, in activeModules order
+    BMSCellStats cellStats;                 // how far each cell sits from the rest of the pack, in activeModules order
+    int detailCursor;                       // position in activeModules of the next cell details frame to send, past the end when idle
+    uint8_t detailCell;                     // cell those frames are for
+    uint32_t detailSentAt;                  // micros() when the last one went out
     
+    void finishScan();
+    void refreshIndex();
+    void saveBaudResults();
+    void mirrorModules();
+    void recordHistory();
+    int activeSlot(int module);
     void sendBatterySummary();
     void sendModuleSummary(int module);
     void sendCellDetails(int module, int cell);
+    void sendQueuedDetails();
+    void sendBusStats(int module);
+    void sendChainStatus(int chain);
+    void sendPackExtremes();
+    void sendCellOutliers(int rank);
+    void sendHistory(int module, int channel, uint32_t window);
     
 };
@@ -0,0 +1,329 @@
+#include "BMSSimulator.h"
+#include "CRC8.h"
+#include "ModuleDecode.h"
+
+#define SIM_DEFAULT_TEMP_COUNTS     4331    //about 25C through the thermistor formula in BMSModule
+
+BMSSimulator::BMSSimulator(uint32_t (*clock)())
+{
+    clockFunc = clock;
+    baudRate = BMS_BAUD;
+    wireLatency = 5;
+    hopDelay = 10;
+    bitErrorRate = 0.0f;
+    randState = 12345;
+    cmdLen = 0;
+    cmdEnd = 0;
+    rxHead = 0;
+    rxTail = 0;
+    setModuleCount(0);
+}
+
+/*
+ * Builds a fresh chain of count modules. They all come up unaddressed just as they would after power on.
+ * Cells start out at 3.7V with a little spread between them so balancing has something to do.
+ */
+void BMSSimulator::setModuleCount(int count)
+{
+    if (count < 0) count = 0;
+    if (count > SIM_MAX_MODULES) count = SIM_MAX_MODULES;
+    moduleCount = count;
+    linkBreak = count;
+    for (int i = 0; i < count; i++)
+    {
+        resetModule(modules[i]);
+        for (int c = 0; c < 6; c++) modules[i].cellVolt[c] = 3.7f + ((i * 6 + c) % 7) * 0.01f;
+        modules[i].tempCounts[0] = SIM_DEFAULT_TEMP_COUNTS;
+        modules[i].tempCounts[1] = SIM_DEFAULT_TEMP_COUNTS;
+    }
+}
+
+int BMSSimulator::getModuleCount()
+{
+    return moduleCount;
+}
+
+void BMSSimulator::setBaud(uint32_t baud)
+{
+    baudRate = baud;
+}
+
+//Fixed delay between the master and the first module, each way
+void BMSSimulator::setWireLatency(uint32_t micros)
+{
+    wireLatency = micros;
+}
+
+//Time each module takes to pass a byte on to the next, each way
+void BMSSimulator::setHopDelay(uint32_t micros)
+{
+    hopDelay = micros;
+}
+
+//Probability of any one reply bit being flipped on its way back
+void BMSSimulator::setBitErrorRate(float rate)
+{
+    bitErrorRate = rate;
+}
+
+//Nothing gets to or from the module at position (0 based) or anything after it. Pass the module count to repair.
+void BMSSimulator::setLinkBreak(int position)
+{
+    if (position < 0) position = 0;
+    if (position > moduleCount) position = moduleCount;
+    linkBreak = position;
+}
+
+void BMSSimulator::setCellVoltage(int module, int cell, float volts)
+{
+    if (module < 0 || module >= moduleCount || cell < 0 || cell > 5) return;
+    modules[module].cellVolt[cell] = volts;
+}
+
+void BMSSimulator::setTemperatureCounts(int module, int sensor, uint16_t counts)
+{
+    if (module < 0 || module >= moduleCount || sensor < 0 || sensor > 1) return;
+    modules[module].tempCounts[sensor] = counts;
+}
+
+SimModule *BMSSimulator::getModule(int module)
+{
+    if (module < 0 || module >= moduleCount) return 0;
+    return &modules[module];
+}
+
+void BMSSimulator::resetModule(SimModule &mod)
+{
+    mod.address = 0;
+    for (int r = 0; r < SIM_REG_COUNT; r++) mod.regs[r] = 0;
+    mod.regs[REG_DEV_STATUS] = 0x01;
+    mod.regs[REG_ALERT_STATUS] = 0x80;  //address not registered
+    mod.regs[REG_FAULT_STATUS] = 0x08;  //power on reset
+}
+
+uint32_t BMSSimulator::now()
+{
+    return clockFunc();
+}
+
+uint32_t BMSSimulator::byteTime()
+{
+    return 10000000ul / baudRate;
+}
+
+uint32_t BMSSimulator::random()
+{
+    randState = randState * 1664525ul + 1013904223ul;
+    return randState;
+}
+
+//Bytes that have made it all the way back to the master by now
+int BMSSimulator::available()
+{
+    uint32_t t = now();
+    uint32_t idx = rxTail;
+    int count = 0;
+    while (idx != rxHead && (int32_t)(t - rxTime[idx]) >= 0)
+    {
+        count++;
+        idx = (idx + 1) & (SIM_RX_BUFF_SIZE - 1);
+    }
+    return count;
+}
+
+int BMSSimulator::read()
+{
+    if (available() == 0) return -1;
+    uint8_t data = rxBuff[rxTail];
+    rxTail = (rxTail + 1) & (SIM_RX_BUFF_SIZE - 1);
+    return data;
+}
+
+//Like a real UART this only throws away what has arrived. Anything still on its way will show up later.
+void BMSSimulator::flushInput()
+{
+    int avail = available();
+    rxTail = (rxTail + avail) & (SIM_RX_BUFF_SIZE - 1);
+}
+
+void BMSSimulator::write(const uint8_t *data, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        cmd[cmdLen++] = data[i];
+        //reads are address, register, length. Writes (odd address) also carry a value and CRC
+        if ((cmdLen == 3 && !(cmd[0] & 1)) || cmdLen == 4)
+        {
+            cmdEnd = now() + (cmdLen * byteTime());
+            handleCommand();
+            cmdLen = 0;
+        }
+    }
+}
+
+//How many modules the master can currently talk to
+int BMSSimulator::reachable()
+{
+    return linkBreak;
+}
+
+//Address 0 means the first module that hasn't been given an address yet
+SimModule *BMSSimulator::findModule(int addr, int &position)
+{
+    for (int i = 0; i < reachable(); i++)
+    {
+        if (modules[i].address == addr)
+        {
+            position = i;
+            return &modules[i];
+        }
+    }
+    return 0;
+}
+
+void BMSSimulator::handleCommand()
+{
+    uint8_t out[3 + SIM_REG_COUNT + 1];
+    bool isWrite = cmd[0] & 1;
+    int addr = (cmd[0] >> 1) & 0x3F;
+    uint8_t reg = cmd[1];
+    uint8_t value = cmd[2];
+    int position = 0;
+    SimModule *mod;
+
+    if (reg >= SIM_REG_COUNT && reg != 0x3C) return;
+
+    if (addr == 0x3F) //broadcast, every module we can reach acts on it and the end of the chain echos it
+    {
+        if (!isWrite) return;
+        if (CRC8::calc(cmd, 3) != cmd[3])
+        {
+            for (int i = 0; i < reachable(); i++) modules[i].regs[REG_FAULT_STATUS] |= 0x04;
+            return;
+        }
+        for (int i = 0; i < reachable(); i++)
+        {
+            if (reg == 0x3C)
+            {
+                if (value == 0xA5) resetModule(modules[i]);
+            }
+            else writeRegister(modules[i], reg, value);
+        }
+        out[0] = cmd[0];
+        out[1] = reg;
+        out[2] = value;
+        out[3] = CRC8::calc(out, 3);
+        reply(out, 4, reachable());
+        return;
+    }
+
+    mod = findModule(addr, position);
+    if (!mod) return; //nobody there, nobody answers
+
+    out[0] = cmd[0] | ((mod->address == 0) ? 0x80 : 0); //unaddressed modules flag their replies
+    out[1] = reg;
+
+    if (isWrite)
+    {
+        if (CRC8::calc(cmd, 3) != cmd[3])
+        {
+            mod->regs[REG_FAULT_STATUS] |= 0x04;
+            return;
+        }
+        writeRegister(*mod, reg, value);
+        out[2] = value;
+        out[3] = CRC8::calc(out, 3);
+        reply(out, 4, position + 1);
+        return;
+    }
+
+    if (value == 0 || reg + value > SIM_REG_COUNT) return;
+    out[2] = value;
+    for (int i = 0; i < value; i++) out[3 + i] = mod->regs[reg + i];
+    out[3 + value] = CRC8::calc(out, 3 + value);
+    reply(out, 4 + value, position + 1);
+}
+
+void BMSSimulator::writeRegister(SimModule &mod, uint8_t reg, uint8_t value)
+{
+    switch (reg)
+    {
+    case REG_ADDR_CTRL:
+        mod.regs[reg] = value;
+        if (value & 0x80)
+        {
+            mod.address = value & 0x3F;
+            mod.regs[REG_ALERT_STATUS] &= ~0x80;
+        }
+        break;
+    case REG_ADC_CONV:
+        if (value & 1) convert(mod);
+        break;
+    case REG_ALERT_STATUS:
+    case REG_FAULT_STATUS:
+        mod.regs[reg] &= ~value; //writing a one clears that flag
+        break;
+    case REG_IO_CTRL:
+        mod.regs[reg] = value;
+        if (value & 0x04) mod.regs[REG_ALERT_STATUS] |= 0x04; //sleep
+        break;
+    default:
+        mod.regs[reg] = value;
+        break;
+    }
+}
+
+/*
+ * Fill in the measurement registers the way the real ADC would, with a couple of counts of noise.
+ * Cells with their balance resistor switched on lose a little charge each time.
+ */
+void BMSSimulator::convert(SimModule &mod)
+{
+    float total = 0.0f;
+    uint16_t counts;
+
+    for (int c = 0; c < 6; c++)
+    {
+        if (mod.regs[REG_BAL_CTRL] & (1 << c)) mod.cellVolt[c] -= 0.0005f;
+        total += mod.cellVolt[c];
+        counts = (uint16_t)(mod.cellVolt[c] / CELL_VOLTS_PER_COUNT) + (random() >> 30);
+        mod.regs[REG_VCELL1 + (c * 2)] = counts >> 8;
+        mod.regs[REG_VCELL1 + (c * 2) + 1] = counts & 0xFF;
+    }
+
+    counts = (uint16_t)(total / MODULE_VOLTS_PER_COUNT);
+    mod.regs[REG_GPAI] = counts >> 8;
+    mod.regs[REG_GPAI + 1] = counts & 0xFF;
+
+    for (int t = 0; t < 2; t++)
+    {
+        counts = mod.tempCounts[t] + (random() >> 30);
+        mod.regs[REG_TEMPERATURE1 + (t * 2)] = counts >> 8;
+        mod.regs[REG_TEMPERATURE1 + (t * 2) + 1] = counts & 0xFF;
+    }
+}
+
+/*
+ * Queue a reply that passed through hops modules. Each byte becomes readable once it has made it all the way
+ * back: the command itself, the wire latency and forwarding delay both ways and the reply's own wire time.
+ */
+void BMSSimulator::reply(const uint8_t *data, int len, int hops)
+{
+    uint32_t start = cmdEnd + (2 * wireLatency) + (2 * hops * hopDelay);
+
+    for (int i = 0; i < len; i++)
+    {
+        uint8_t b = data[i];
+        if (bitErrorRate > 0.0f)
+        {
+            for (int bit = 0; bit < 8; bit++)
+            {
+                if ((random() / 4294967296.0f) < bitErrorRate) b ^= (1 << bit);
+            }
+        }
+        if (((rxHead + 1) & (SIM_RX_BUFF_SIZE - 1)) == rxTail) return; //receive buffer overrun, the rest is lost
+        rxBuff[rxHead] = b;
+        rxTime[rxHead] = start + ((i + 1) * byteTime());
+        rxHead = (rxHead + 1) & (SIM_RX_BUFF_SIZE - 1);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+#include "BMSTransport.h"
+
+#define SIM_MAX_MODULES     MAX_MODULE_ADDR
+#define SIM_REG_COUNT       0x40
+#define SIM_RX_BUFF_SIZE    128     //must be a power of two
+
+typedef struct {
+    uint8_t address;                //0 until the master assigns one
+    uint8_t regs[SIM_REG_COUNT];
+    float cellVolt[6];
+    uint16_t tempCounts[2];         //raw thermistor readings
+} SimModule;
+
+/*
+ * A chain of virtual modules that behaves like the real daisy chain on the wire. Implements enough of the
+ * register map in config.h to run the firmware against: addressing through REG_ADDR_CTRL, 0x7F broadcasts,
+ * the 0x3C/0xA5 reset, write CRC checking, ADC conversions, status/fault registers and balancing.
+ *
+ * Reply bytes only become readable once they would have arrived on a real chain. That is the wire time at
+ * the configured baud rate plus a fixed wire latency plus a forwarding delay for every module the request
+ * and reply pass through. Bits in replies can be flipped at a configurable rate and the chain can be broken
+ * after any module to see how the firmware copes.
+ *
+ * Plain C++ so it runs on a PC (see tools/) as well as on the board in place of the real serial port.
+ */
+class BMSSimulator : public BMSTransport
+{
+public:
+    BMSSimulator(uint32_t (*clock)());
+    void setModuleCount(int count);
+    int getModuleCount();
+    void setBaud(uint32_t baud);
+    void setWireLatency(uint32_t micros);
+    void setHopDelay(uint32_t micros);
+    void setBitErrorRate(float rate);
+    void setLinkBreak(int position);
+    void setCellVoltage(int module, int cell, float volts);
+    void setTemperatureCounts(int module, int sensor, uint16_t counts);
+    SimModule *getModule(int module);
+
+    int available();
+    int read();
+    void write(const uint8_t *data, int len);
+    void flushInput();
+    uint32_t now();
+
+private:
+    uint32_t (*clockFunc)();
+    SimModule modules[SIM_MAX_MODULES];
+    int moduleCount;
+    int linkBreak;                  //modules at this position and beyond can't be reached
+    uint32_t baudRate;
+    uint32_t wireLatency;
+    uint32_t hopDelay;
+    float bitErrorRate;
+    uint32_t randState;
+
+    uint8_t cmd[4];
+    int cmdLen;
+    uint32_t cmdEnd;                //when the last byte of the command finished arriving
+
+    uint8_t rxBuff[SIM_RX_BUFF_SIZE];
+    uint32_t rxTime[SIM_RX_BUFF_SIZE];
+    uint32_t rxHead;
+    uint32_t rxTail;
+
+    void resetModule(SimModule &mod);
+    void handleCommand();
+    void writeRegister(SimModule &mod, uint8_t reg, uint8_t value);
+    void convert(SimModule &mod);
+    void reply(const uint8_t *data, int len, int hops);
+    int reachable();
+    SimModule *findModule(int addr, int &position);
+    uint32_t byteTime();
+    uint32_t random();
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Byte level connection to a chain of modules. The bus and the enumeration code only talk to the chain
+ * through this so they can be pointed at the real serial port or at a simulated chain.
+ */
+class BMSTransport
+{
+public:
+    virtual ~BMSTransport() {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual void write(const uint8_t *data, int len) = 0;
+    virtual void flushInput() = 0;
+    virtual uint32_t now() = 0;     //microsecond clock that reply timing is measured against
+
+    //Baud rate divisor in eighths, baud = peripheral clock / divisor. Ports that can't be tuned return 0 and refuse changes.
+    virtual uint16_t getBaudDivisor() { return 0; }
+    virtual bool setBaudDivisor(uint16_t) { return false; }
+
+    //Times received bytes were lost because they came in faster than they could be stored, cleared by the call
+    virtual uint32_t takeOverruns() { return 0; }
+};
@@ -0,0 +1,199 @@
+#include "config.h"
+#include "BMSUart.h"
+
+BMSUart::BMSUart(HardwareSerial *serialPort)
+{
+    port = serialPort;
+    readPos = 0;
+#if defined (__arm__) && defined (__SAM3X8E__)
+    usart = NULL;
+    armedCount = 0;
+    overruns = 0;
+#else
+    fillPos = 0;
+#endif
+}
+
+#if defined (__arm__) && defined (__SAM3X8E__)
+
+/*
+ * Must be called after the port has been set up (serialSpecialInit) since that resets the receiver.
+ * The PDC is given the first half of the ring as the current buffer and the second half as the next one.
+ * Each time it moves on to the next buffer the half it just finished is handed back as the new next buffer
+ * once everything in it has been read, so it just keeps going around and can never write over bytes
+ * that haven't been read yet. If it does run out of room the USART flags an overrun, see service().
+ */
+void BMSUart::begin(Usart *pUsart)
+{
+    usart = pUsart;
+    usart->US_IDR = 0xFFFFFFFF;
+    if (usart == USART0) NVIC_DisableIRQ(USART0_IRQn);
+    else if (usart == USART1) NVIC_DisableIRQ(USART1_IRQn);
+    else if (usart == USART2) NVIC_DisableIRQ(USART2_IRQn);
+    else if (usart == USART3) NVIC_DisableIRQ(USART3_IRQn);
+    usart->US_PTCR = US_PTCR_RXTDIS | US_PTCR_TXTDIS;
+    usart->US_RPR = (uint32_t)rxBuff;
+    usart->US_RCR = UART_RX_BUFF_SIZE / 2;
+    usart->US_RNPR = (uint32_t)(rxBuff + (UART_RX_BUFF_SIZE / 2));
+    usart->US_RNCR = UART_RX_BUFF_SIZE / 2;
+    usart->US_TCR = 0;
+    usart->US_TNCR = 0;
+    usart->US_CR = US_CR_RSTSTA;
+    armedCount = UART_RX_BUFF_SIZE;
+    readPos = 0;
+    overruns = 0;
+    usart->US_PTCR = US_PTCR_RXTEN | US_PTCR_TXTEN;
+}
+
+//Bytes the PDC has stored since begin. RNCR is read first so a buffer switch in between can only make this short
+uint32_t BMSUart::received()
+{
+    uint32_t next = usart->US_RNCR;
+    return armedCount - usart->US_RCR - next;
+}
+
+/*
+ * Hands the PDC its next buffer once the half it will go to has been read out and counts overruns.
+ * Runs whenever the ring is looked at. The modules only ever talk in answer to a request and the bus
+ * flushes the ring before sending each one, so a reply always has at least half the ring to land in
+ * however long it is until loop() gets back here.
+ */
+void BMSUart::service()
+{
+    if (usart->US_RNCR == 0 && (armedCount + (UART_RX_BUFF_SIZE / 2) - readPos) <= UART_RX_BUFF_SIZE)
+    {
+        usart->US_RNPR = (uint32_t)(rxBuff + (armedCount & (UART_RX_BUFF_SIZE - 1)));
+        usart->US_RNCR = UART_RX_BUFF_SIZE / 2;
+        armedCount += UART_RX_BUFF_SIZE / 2;
+    }
+    //the PDC only looks at the next buffer as the current one fills, if it had already stopped start it by hand
+    if (usart->US_RCR == 0 && usart->US_RNCR != 0)
+    {
+        usart->US_RPR = usart->US_RNPR;
+        usart->US_RCR = usart->US_RNCR;
+        usart->US_RNCR = 0;
+    }
+    if (usart->US_CSR & US_CSR_OVRE)
+    {
+        overruns++;
+        usart->US_CR = US_CR_RSTSTA;
+    }
+}
+
+int BMSUart::available()
+{
+    if (!usart) return 0;
+    service();
+    return received() - readPos;
+}
+
+uint32_t BMSUart::takeOverruns()
+{
+    uint32_t count = overruns;
+    overruns = 0;
+    return count;
+}
+
+//Only waits if an earlier write is still going out, which only the blocking enumeration code does
+void BMSUart::write(const uint8_t *data, int len)
+{
+    if (!usart)
+    {
+        port->write(data, len);
+        return;
+    }
+    while (len > 0)
+    {
+        int chunk = (len > UART_TX_BUFF_SIZE) ? UART_TX_BUFF_SIZE : len;
+        while (usart->US_TCR != 0) {}
+        memcpy(txBuff, data, chunk);
+        usart->US_TPR = (uint32_t)txBuff;
+        usart->US_TCR = chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+//With the 8x oversampling serialSpecialInit sets up the divisor is CD * 8 + FP, the same split it uses to program BRGR
+uint16_t BMSUart::getBaudDivisor()
+{
+    if (!usart) return 0;
+    return ((usart->US_BRGR & 0xFFFF) << 3) | ((usart->US_BRGR >> 16) & 7);
+}
+
+bool BMSUart::setBaudDivisor(uint16_t divisor)
+{
+    if (!usart || divisor < 8) return false;
+    usart->US_BRGR = (divisor >> 3) | ((divisor & 7) << 16);
+    flushInput(); //anything caught mid change is garbage
+    return true;
+}
+
+#else
+
+void BMSUart::begin()
+{
+    readPos = 0;
+    fillPos = 0;
+}
+
+//The core serial drivers elsewhere don't give us the divisor to play with
+uint16_t BMSUart::getBaudDivisor()
+{
+    return 0;
+}
+
+bool BMSUart::setBaudDivisor(uint16_t)
+{
+    return false;
+}
+
+int BMSUart::available()
+{
+    while (port->available() && (fillPos - readPos) < UART_RX_BUFF_SIZE)
+    {
+        rxBuff[fillPos & (UART_RX_BUFF_SIZE - 1)] = port->read();
+        fillPos++;
+    }
+    return fillPos - readPos;
+}
+
+//Anything the core driver dropped is out of sight here
+uint32_t BMSUart::takeOverruns()
+{
+    return 0;
+}
+
+void BMSUart::write(const uint8_t *data, int len)
+{
+    port->write(data, len);
+}
+
+#endif
+
+int BMSUart::read()
+{
+    if (available() == 0) return -1;
+    uint8_t data = rxBuff[readPos & (UART_RX_BUFF_SIZE - 1)];
+    readPos++;
+    return data;
+}
+
+//Throw away everything received so far
+void BMSUart::flushInput()
+{
+    readPos += available();
+}
+
+uint32_t BMSUart::now()
+{
+    return micros();
+}
+
+BMSUart bmsUart(&SERIAL);
+#if BMS_CHAIN_COUNT > 1
+BMSUart bmsUart2(&SERIAL_CHAIN1);
+#endif
+#if BMS_CHAIN_COUNT > 2
+BMSUart bmsUart3(&SERIAL_CHAIN2);
+#endif
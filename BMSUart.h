@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+#include "config.h"
+#include "BMSTransport.h"
+
+#define UART_RX_BUFF_SIZE   128 //must be a power of two. Split in two halves for the PDC on the Due
+#define UART_TX_BUFF_SIZE   8   //longest single write handed to the PDC, longer ones go out in pieces
+
+/*
+ * The module bus serial port. On the Due the USART's peripheral DMA controller writes incoming bytes
+ * straight into a ring buffer and sends outgoing ones, so nothing has to run per byte. The core serial
+ * driver's interrupt is switched off for the port as its handler would otherwise read received bytes out
+ * from under the PDC whenever it ran. Elsewhere the ring is filled from the core serial driver's own
+ * ISR fed buffer and writes go through the driver.
+ */
+class BMSUart : public BMSTransport
+{
+public:
+    BMSUart(HardwareSerial *serialPort);
+#if defined (__arm__) && defined (__SAM3X8E__)
+    void begin(Usart *pUsart);
+#else
+    void begin();
+#endif
+    int available();
+    int read();
+    void flushInput();
+    void write(const uint8_t *data, int len);
+    uint32_t now();
+    uint16_t getBaudDivisor();
+    bool setBaudDivisor(uint16_t divisor);
+    uint32_t takeOverruns();
+
+private:
+    HardwareSerial *port;
+    uint8_t rxBuff[UART_RX_BUFF_SIZE];
+    uint32_t readPos;           //bytes read out of the ring since begin, wraps
+#if defined (__arm__) && defined (__SAM3X8E__)
+    Usart *usart;
+    uint32_t armedCount;        //bytes of ring handed to the PDC since begin, both of its buffers included
+    uint32_t overruns;          //times the receiver lost bytes because the PDC had nowhere to put them
+    uint8_t txBuff[UART_TX_BUFF_SIZE];
+
+    uint32_t received();
+    void service();
+#else
+    uint32_t fillPos;           //bytes put into the ring since begin, wraps
+#endif
+};
+
+extern BMSUart bmsUart;     //chain 0 on SERIAL
+#if BMS_CHAIN_COUNT > 1
+extern BMSUart bmsUart2;    //chain 1 on SERIAL_CHAIN1
+#endif
+#if BMS_CHAIN_COUNT > 2
+extern BMSUart bmsUart3;    //chain 2 on SERIAL_CHAIN2
+#endif
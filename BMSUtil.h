@@ -1,43 +1,41 @@
+#pragma once
+
 #include <Arduino.h>
 #include "Logger.h"
+#include "CRC8.h"
+#include "BMSTransport.h"
+#include "BMSBus.h"
 
 class BMSUtil {    
 public:
     
     static uint8_t genCRC(uint8_t *input, int lenInput)
     {
-        uint8_t generator = 0x07;
-        uint8_t crc = 0;
-
-        for (int x = 0; x < lenInput; x++)
-        {
-            crc ^= input[x]; /* XOR-in the next input byte */
-
-            for (int i = 0; i < 8; i++)
-            {
-                if ((crc & 0x80) != 0)
-                {
-                    crc = (uint8_t)((crc << 1) ^ generator);
-                }
-                else
-                {
-                    crc <<= 1;
-                }
-            }
-        }
+        return CRC8::calc(input, lenInput);
+    }
 
-        return crc;
+    //Wait until len bytes have arrived or timeout microseconds have passed. Returns how many bytes are waiting.
+    static int waitForReply(BMSTransport *port, int len, uint32_t timeout)
+    {
+        uint32_t start = port->now();
+        while (port->available() < len && (port->now() - start) < timeout) {}
+        return port->available();
     }
 
-    static void sendData(uint8_t *data, uint8_t dataLen, bool isWrite)
+    static void sendData(BMSTransport *port, uint8_t *data, uint8_t dataLen, bool isWrite)
     {
         uint8_t orig = data[0];
         uint8_t addrByte = data[0];
+        uint8_t crc = 0;
         if (isWrite) addrByte |= 1;
-        SERIAL.write(addrByte);
-        SERIAL.write(&data[1], dataLen - 1);  //assumes that there are at least 2 bytes sent every time. There should be, addr and cmd at the least.
+        port->write(&addrByte, 1);
+        port->write(&data[1], dataLen - 1);  //assumes that there are at least 2 bytes sent every time. There should be, addr and cmd at the least.
         data[0] = addrByte;
-        if (isWrite) SERIAL.write(genCRC(data, dataLen));        
+        if (isWrite) 
+        {
+            crc = genCRC(data, dataLen);
+            port->write(&crc, 1);
+        }
 
         if (Logger::isDebug())
         {
@@ -48,20 +46,28 @@ public:
                 SERIALCONSOLE.print(data[x], HEX);
                 SERIALCONSOLE.print(" ");
             }
-            if (isWrite) SERIALCONSOLE.print(genCRC(data, dataLen), HEX);
+            if (isWrite) SERIALCONSOLE.print(crc, HEX);
             SERIALCONSOLE.println();
         }
         
         data[0] = orig;
     }
 
-    static int getReply(uint8_t *data, int maxLen)
+    //If crcOut is given the CRC is folded in as each byte is read. On return it holds the CRC of every
+    //byte except the last one, which is the CRC byte the module sent, so the two can be compared directly.
+    static int getReply(BMSTransport *port, uint8_t *data, int maxLen, uint8_t *crcOut = NULL)
     { 
         int numBytes = 0; 
+        CRC8 crc;
         if (Logger::isDebug()) SERIALCONSOLE.print("Reply: ");
-        while (SERIAL.available() && numBytes < maxLen)
+        while (port->available() && numBytes < maxLen)
         {
-            data[numBytes] = SERIAL.read();
+            data[numBytes] = port->read();
+            if (crcOut)
+            {
+                *crcOut = crc.get();
+                crc.update(data[numBytes]);
+            }
             if (Logger::isDebug()) {
                 SERIALCONSOLE.print(data[numBytes], HEX);
                 SERIALCONSOLE.print(" ");
@@ -70,7 +76,7 @@ public:
         }
         if (maxLen == numBytes)
         {
-            while (SERIAL.available()) SERIAL.read();
+            port->flushInput();
         }
         if (Logger::isDebug()) SERIALCONSOLE.println();
         return numBytes;
@@ -79,18 +85,39 @@ public:
     //Uses above functions to send data then get the response. Will auto retry if response not 
     //the expected return length. This helps to alleviate any comm issues. The Due cannot exactly
     //match the correct comm speed so sometimes there are data glitches.
-    static int sendDataWithReply(uint8_t *data, uint8_t dataLen, bool isWrite, uint8_t *retData, int retLen)
+    //Returns as soon as the whole reply is in. Only used while enumerating, when we don't know how
+    //long the chain is, so the timeout allows for the longest possible chain.
+    //If stats is given every attempt is counted there the same way the bus counts its own traffic.
+    static int sendDataWithReply(BMSTransport *port, uint8_t *data, uint8_t dataLen, bool isWrite, uint8_t *retData, int retLen, 
+                                 uint8_t *crcOut = NULL, BMSBusStats *stats = NULL)
     {
         int attempts = 1;
         int returnedLength;
+        uint32_t sentAt;
         while (attempts < 4)
         {
-            sendData(data, dataLen, isWrite);
-            delay(2 * ((retLen / 8) + 1));
-            returnedLength = getReply(retData, retLen);
-            if (returnedLength == retLen) return returnedLength;
+            if (stats && attempts > 1) stats->noteRetry(data[0], data[1]);
+            sendData(port, data, dataLen, isWrite);
+            sentAt = port->now();
+            waitForReply(port, retLen, BMSBus::replyTimeout(dataLen + (isWrite ? 1 : 0), retLen, BMSBus::hopsFor(data[0], MAX_MODULE_ADDR)));
+            returnedLength = getReply(port, retData, retLen, crcOut);
+            if (returnedLength == retLen) 
+            {
+                if (stats)
+                {
+                    stats->noteLatency(data[0], port->now() - sentAt);
+                    stats->noteComplete(data[0], data[1], true);
+                }
+                return returnedLength;
+            }
+            if (stats)
+            {
+                if (returnedLength > 0) stats->noteShortReply(data[0], data[1]);
+                else stats->noteTimeout(data[0], data[1]);
+            }
             attempts++;
         }
+        if (stats) stats->noteComplete(data[0], data[1], false);
         return returnedLength; //failed to get a proper response.
     }
 };
\ No newline at end of file
@@ -0,0 +1,9 @@
+#include "CRC8.h"
+
+#define CRC8_T4(n)      CRC8::crcEntry(n), CRC8::crcEntry(n + 1), CRC8::crcEntry(n + 2), CRC8::crcEntry(n + 3)
+#define CRC8_T16(n)     CRC8_T4(n), CRC8_T4(n + 4), CRC8_T4(n + 8), CRC8_T4(n + 12)
+#define CRC8_T64(n)     CRC8_T16(n), CRC8_T16(n + 16), CRC8_T16(n + 32), CRC8_T16(n + 48)
+#define CRC8_T256(n)    CRC8_T64(n), CRC8_T64(n + 64), CRC8_T64(n + 128), CRC8_T64(n + 192)
+
+//every entry is a constant expression so this ends up as a plain table in flash
+const uint8_t CRC8::table[256] = { CRC8_T256(0) };
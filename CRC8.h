@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * CRC-8 with polynomial 0x07 as used by the module bus. The table is filled in by the compiler from
+ * crcEntry() so there is no bitwise loop left at run time. Can either be used all at once with calc()
+ * or fed a byte at a time with update() as bytes come off the wire. Running the CRC over a whole
+ * frame including its trailing CRC byte gives 0 for a good frame.
+ */
+class CRC8
+{
+public:
+    CRC8() : crc(0) {}
+
+    void reset() { crc = 0; }
+    void update(uint8_t data) { crc = table[crc ^ data]; }
+    uint8_t get() const { return crc; }
+
+    static uint8_t calc(const uint8_t *input, int lenInput)
+    {
+        uint8_t c = 0;
+        for (int x = 0; x < lenInput; x++) c = table[c ^ input[x]];
+        return c;
+    }
+
+    static constexpr uint8_t crcShift(uint8_t c, int bits)
+    {
+        return (bits == 0) ? c : crcShift((c & 0x80) ? (uint8_t)((c << 1) ^ 0x07) : (uint8_t)(c << 1), bits - 1);
+    }
+
+    static constexpr uint8_t crcEntry(int idx)
+    {
+        return crcShift((uint8_t)idx, 8);
+    }
+
+    static const uint8_t table[256];
+
+private:
+    uint8_t crc;
+};
@@ -0,0 +1,33 @@
+#include "ModuleDecode.h"
+#include "Thermistor.h"
+
+//regs points at REG_GPAI: 2 bytes gpai, 2 bytes for each of 6 cell voltages, 2 bytes for each of two temperatures
+void ModuleDecode::measurements(const uint8_t *regs, ModuleMeasurements &result)
+{
+    result.moduleCounts = (regs[0] << 8) | regs[1];
+    for (int i = 0; i < 6; i++) result.cellCounts[i] = (regs[2 + (i * 2)] << 8) | regs[3 + (i * 2)];
+    for (int i = 0; i < 2; i++) result.tempCounts[i] = (regs[14 + (i * 2)] << 8) | regs[15 + (i * 2)];
+}
+
+float ModuleDecode::cellVolts(uint16_t counts)
+{
+    return counts * CELL_VOLTS_PER_COUNT;
+}
+
+uint16_t ModuleDecode::cellCounts(float volts)
+{
+    if (volts <= 0.0f) return 0;
+    if (volts >= 0xFFFF * CELL_VOLTS_PER_COUNT) return 0xFFFF;
+    return (uint16_t)(volts / CELL_VOLTS_PER_COUNT);
+}
+
+float ModuleDecode::moduleVolts(uint16_t counts)
+{
+    return counts * MODULE_VOLTS_PER_COUNT;
+}
+
+//Steinhart/hart equation for the module thermistors, worked out ahead of time into a table. See Thermistor.h
+float ModuleDecode::celsius(int channel, uint16_t counts)
+{
+    return Thermistor::toCelsius(channel, counts);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CELL_VOLTS_PER_COUNT    0.000381493f    //cells are 6.25V full scale over 14 bits
+#define MODULE_VOLTS_PER_COUNT  0.002034609f    //the module total is 33.333V full scale
+#define MEASUREMENT_LEN         0x12            //REG_GPAI through the end of REG_TEMPERATURE2
+
+//One module's measurement registers pulled apart, still in counts
+typedef struct {
+    uint16_t moduleCounts;
+    uint16_t cellCounts[6];
+    uint16_t tempCounts[2];
+} ModuleMeasurements;
+
+/*
+ * Turns the measurement registers of a module into counts and counts into volts and degrees. Kept apart
+ * from BMSModule with no Arduino dependencies so tools/replay.cpp decodes a capture exactly the way the
+ * firmware does.
+ */
+class ModuleDecode
+{
+public:
+    static void measurements(const uint8_t *regs, ModuleMeasurements &result);
+    static float cellVolts(uint16_t counts);
+    static uint16_t cellCounts(float volts);
+    static float moduleVolts(uint16_t counts);
+    static float celsius(int channel, uint16_t counts);
+};
@@ -81,10 +81,29 @@ void SerialConsole::printMenu() {
     Logger::console("   B = Attempt balancing for 5 seconds");
     Logger::console("   p = Toggle output of pack summary every 3 seconds");
     Logger::console("   d = Toggle output of pack details every 3 seconds");
+    Logger::console("   T = Show module bus telemetry (retries, CRC errors, timeouts, reply latency)");
+    Logger::console("   Z = Zero module bus telemetry");
+    Logger::console("   K = Calibrate module bus baud rate and save the result");
+    Logger::console("   X = Dump captured module bus traffic as hex (see CAPTURE=)");
+    Logger::console("   O = Show the lowest and highest cells in the pack");
 
     Logger::console("   LOGLEVEL=%i - set log level (0=debug, 1=info, 2=warn, 3=error, 4=off)", Logger::getLogLevel());
     Logger::console("   CANSPEED=%i - set first CAN bus speed", settings.canSpeed);
     Logger::console("   BATTERYID=%i - Set battery ID for CAN protocol (1-14)", settings.batteryID);
+    Logger::console("   SCANMODE=%i - Pack scan mode (0=convert and read each module, 1=broadcast convert then read all)", settings.scanMode);
+    Logger::console("   READMODE=%i - Module read (0=status and measurements separately, 1=single snapshot read)", settings.readMode);
+    Logger::console("   AUTOBAUD=%i - Recalibrate baud rate when bus errors climb (0=off, 1=on)", settings.autoBaudCal);
+    Logger::console("   BAUDRESET=1 - Forget calibrated baud rates and go back to BMS_BAUD at next power up");
+    Logger::console("   CAPTURE=%i - Record raw module bus traffic to RAM (0=off, 1=on, not saved)", bms.isCapturing());
+    Logger::console("   FILTERMEDIAN=%i - Reject single reading spikes with a 3 reading median (0=off, 1=on)", settings.filterMedian);
+    Logger::console("   CELLFILTER=%i - Cell voltage low pass, each reading moves the value 1/2^n of the way (0=off, 1-8)", settings.filterCellShift);
+    Logger::console("   TEMPFILTER=%i - Same for temperatures (0=off, 1-8)", settings.filterTempShift);
+    Logger::console("   CELLSTEP=%i - Most a cell may move in one reading in ADC counts, 0.38mV each (0=no limit)", settings.filterCellStep);
+    Logger::console("   TEMPSTEP=%i - Most a thermistor may move in one reading in ADC counts (0=no limit)", settings.filterTempStep);
+    Logger::console("   ANOMALYZ=%f - Standard deviations from the pack before a cell is flagged (0=off)", settings.anomalyZ);
+    Logger::console("   ANOMALYMV=%f - And the least difference in mV before it is flagged", settings.anomalyMinMV);
+    Logger::console("   HISTCELL=n - Show the recent history of pack cell n (numbered as in the pack details)");
+    Logger::console("   HISTTEMP=n - Show the recent history of pack thermistor n (0 and 1 on the first module, 2 and 3 on the next...)");
 
     Logger::console("\nBATTERY MANAGEMENT CONTROLS\n");
     Logger::console("   VOLTLIMHI=%f - High limit for cells in volts", settings.OverVSetpoint);
@@ -212,6 +231,90 @@ void SerialConsole::handleConfigCmd() {
             Logger::console("Battery ID set to: %i", newValue);
         }
         else Logger::console("Invalid battery ID. Please enter a value between 1 and 14");
+    } else if (cmdString == String("SCANMODE")) {
+        if (newValue == SCAN_PER_MODULE || newValue == SCAN_BROADCAST) {
+            settings.scanMode = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Scan mode set to: %i", newValue);
+        }
+        else Logger::console("Invalid scan mode. Please enter 0 or 1");
+    } else if (cmdString == String("READMODE")) {
+        if (newValue == READ_SPLIT || newValue == READ_SNAPSHOT) {
+            settings.readMode = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Read mode set to: %i", newValue);
+        }
+        else Logger::console("Invalid read mode. Please enter 0 or 1");
+    } else if (cmdString == String("AUTOBAUD")) {
+        if (newValue == 0 || newValue == 1) {
+            settings.autoBaudCal = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Automatic baud calibration set to: %i", newValue);
+        }
+        else Logger::console("Invalid setting. Please enter 0 or 1");
+    } else if (cmdString == String("CAPTURE")) {
+        if (newValue == 0 || newValue == 1) {
+            bms.setCapture(newValue == 1);
+            Logger::console("Bus capture %s", newValue ? "started" : "stopped");
+        }
+        else Logger::console("Invalid setting. Please enter 0 or 1");
+    } else if (cmdString == String("FILTERMEDIAN")) {
+        if (newValue == 0 || newValue == 1) {
+            settings.filterMedian = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Median filter set to: %i", newValue);
+        }
+        else Logger::console("Invalid setting. Please enter 0 or 1");
+    } else if (cmdString == String("CELLFILTER")) {
+        if (newValue >= 0 && newValue <= 8) {
+            settings.filterCellShift = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Cell voltage low pass set to: %i", newValue);
+        }
+        else Logger::console("Invalid setting. Please enter a value 0 to 8");
+    } else if (cmdString == String("TEMPFILTER")) {
+        if (newValue >= 0 && newValue <= 8) {
+            settings.filterTempShift = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Temperature low pass set to: %i", newValue);
+        }
+        else Logger::console("Invalid setting. Please enter a value 0 to 8");
+    } else if (cmdString == String("CELLSTEP")) {
+        if (newValue >= 0 && newValue <= 16383) {
+            settings.filterCellStep = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Cell step limit set to: %i", newValue);
+        }
+        else Logger::console("Invalid setting. Please enter a value 0 to 16383");
+    } else if (cmdString == String("TEMPSTEP")) {
+        if (newValue >= 0 && newValue <= 16383) {
+            settings.filterTempStep = newValue;
+            needEEPROMWrite = true;
+            Logger::console("Temperature step limit set to: %i", newValue);
+        }
+        else Logger::console("Invalid setting. Please enter a value 0 to 16383");
+    } else if (cmdString == String("ANOMALYZ")) {
+        if (newFloat >= 0.0f && newFloat <= 20.0f) {
+            settings.anomalyZ = newFloat;
+            needEEPROMWrite = true;
+            Logger::console("Cell anomaly threshold set to: %f", settings.anomalyZ);
+        }
+        else Logger::console("Invalid setting. Please enter a value 0.0 to 20.0");
+    } else if (cmdString == String("ANOMALYMV")) {
+        if (newFloat >= 0.0f && newFloat <= 1000.0f) {
+            settings.anomalyMinMV = newFloat;
+            needEEPROMWrite = true;
+            Logger::console("Cell anomaly minimum set to: %fmV", settings.anomalyMinMV);
+        }
+        else Logger::console("Invalid setting. Please enter a value 0.0 to 1000.0");
+    } else if (cmdString == String("HISTCELL")) {
+        bms.printHistory(newValue, false);
+    } else if (cmdString == String("HISTTEMP")) {
+        bms.printHistory(newValue, true);
+    } else if (cmdString == String("BAUDRESET")) {
+        for (int c = 0; c < MAX_BMS_CHAINS; c++) settings.baudDivisor[c] = 0;
+        needEEPROMWrite = true;
+        Logger::console("Calibrated baud rates cleared. BMS_BAUD will be used from the next power up");
     } else if (cmdString == String("VOLTLIMHI")) {
         if (newFloat >= 0.0f && newFloat <= 6.00f) {
             settings.OverVSetpoint = newFloat; 
@@ -294,6 +397,22 @@ void SerialConsole::handleShortCmd() {
     case 'B':
         bms.balanceCells();
         break;
+    case 'T':
+        bms.printBusStats();
+        break;
+    case 'Z':
+        bms.resetBusStats();
+        break;
+    case 'X':
+        bms.dumpCapture();
+        break;
+    case 'O':
+        bms.printCellOutliers();
+        break;
+    case 'K':
+        Logger::console("Calibrating module bus baud rate");
+        bms.calibrateBaud();
+        break;
     case 'p':
         if (whichDisplay == 1 && printPrettyDisplay) whichDisplay = 0;
         else
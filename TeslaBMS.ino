@@ -7,18 +7,21 @@
 #include "SerialConsole.h"
 #include "BMSModuleManager.h"
 #include "SystemIO.h"
+#include "BMSUart.h"
+#ifdef BMS_SIMULATED_MODULES
+#include "BMSSimulator.h"
+#endif
 #include <due_can.h>
 #include <due_wire.h>
 #include <Wire_EEPROM.h>
 
-//#define BMS_BAUD  612500
-#define BMS_BAUD  617647
-//#define BMS_BAUD  608695
-
 BMSModuleManager bms;
 EEPROMSettings settings;
 SerialConsole console;
 uint32_t lastUpdate;
+#ifdef BMS_SIMULATED_MODULES
+BMSSimulator simChain(micros);
+#endif
 
 //This code only applicable to Due to fixup lack of functionality in the arduino core.
 #if defined (__arm__) && defined (__SAM3X8E__)
@@ -64,6 +67,17 @@ void loadSettings()
         settings.balanceVoltage = 3.9f;
         settings.balanceHyst = 0.04f;
         settings.logLevel = 2;
+        settings.scanMode = SCAN_BROADCAST;
+        settings.readMode = READ_SNAPSHOT;
+        for (int c = 0; c < MAX_BMS_CHAINS; c++) settings.baudDivisor[c] = 0;
+        settings.autoBaudCal = 0;
+        settings.filterMedian = 1;
+        settings.filterCellShift = 1;
+        settings.filterTempShift = 2;
+        settings.filterCellStep = 0;    //real load steps are fast, leave cells to the median
+        settings.filterTempStep = 64;   //about 0.5C at room temperature, far faster than a module can really warm up
+        settings.anomalyZ = 3.0f;
+        settings.anomalyMinMV = 10.0f;
         EEPROM.write(EEPROM_PAGE, settings);
     }
     else {
@@ -90,16 +104,45 @@ void initializeCAN()
 
 void setup() 
 {
-    delay(4000);  //just for easy debugging. It takes a few seconds for USB to come up properly on most OS's
+    delay(STARTUP_DELAY);  //just for easy debugging. It takes a few seconds for USB to come up properly on most OS's
     SERIALCONSOLE.begin(115200);
     SERIALCONSOLE.println("Starting up!");
     SERIAL.begin(BMS_BAUD);
+#if BMS_CHAIN_COUNT > 1
+    SERIAL_CHAIN1.begin(BMS_BAUD);
+#endif
+#if BMS_CHAIN_COUNT > 2
+    SERIAL_CHAIN2.begin(BMS_BAUD);
+#endif
 #if defined (__arm__) && defined (__SAM3X8E__)
     serialSpecialInit(USART0, BMS_BAUD); //required for Due based boards as the stock core files don't support 612500 baud.
+    bmsUart.begin(USART0); //DMA in and out, the core serial driver is switched off for this port
+#if BMS_CHAIN_COUNT > 1
+    serialSpecialInit(USART1, BMS_BAUD);
+    bmsUart2.begin(USART1);
+#endif
+#if BMS_CHAIN_COUNT > 2
+    serialSpecialInit(USART3, BMS_BAUD);
+    bmsUart3.begin(USART3);
+#endif
+#else
+    bmsUart.begin();
+#if BMS_CHAIN_COUNT > 1
+    bmsUart2.begin();
+#endif
+#if BMS_CHAIN_COUNT > 2
+    bmsUart3.begin();
+#endif
 #endif
 
     SERIALCONSOLE.println("Started serial interface to BMS.");
 
+#ifdef BMS_SIMULATED_MODULES
+    simChain.setModuleCount(BMS_SIMULATED_MODULES);
+    bms.setTransport(&simChain); //no real modules needed, everything talks to the virtual chain instead
+    SERIALCONSOLE.println("Using simulated module chain.");
+#endif
+
     pinMode(13, INPUT);
 
     loadSettings();
@@ -107,13 +150,18 @@ void setup()
 
     systemIO.setup();
 
-    bms.renumberBoardIDs();
+    bms.applyBaudSettings();
+    //modules keep their addresses while the BMS board is off so there is usually no need to reset and renumber them
+    if (!bms.warmBoot())
+    {
+        bms.renumberBoardIDs();
+        bms.clearFaults(); //a reset leaves every module with a power on reset fault
+    }
 
     //Logger::setLoglevel(Logger::Debug);
 
-    lastUpdate = 0;
-
-    bms.clearFaults();
+    lastUpdate = millis();
+    bms.getAllVoltTemp(); //first readings straight away rather than after the first update interval
 }
 
 void loop() 
@@ -121,6 +169,7 @@ void loop()
     CAN_FRAME incoming;
 
     console.loop();
+    bms.loop();
 
     if (millis() > (lastUpdate + 1000))
     {    
@@ -0,0 +1,30 @@
+#include "Thermistor.h"
+
+#define THERM_T4(c, n)      Thermistor::entry(c, n), Thermistor::entry(c, n + 1), Thermistor::entry(c, n + 2), Thermistor::entry(c, n + 3)
+#define THERM_T16(c, n)     THERM_T4(c, n), THERM_T4(c, n + 4), THERM_T4(c, n + 8), THERM_T4(c, n + 12)
+#define THERM_T64(c, n)     THERM_T16(c, n), THERM_T16(c, n + 16), THERM_T16(c, n + 32), THERM_T16(c, n + 48)
+#define THERM_T256(c, n)    THERM_T64(c, n), THERM_T64(c, n + 64), THERM_T64(c, n + 128), THERM_T64(c, n + 192)
+#define THERM_T513(c)       THERM_T256(c, 0), THERM_T256(c, 256), Thermistor::entry(c, 512)
+
+static_assert(THERM_TABLE_SIZE == 513, "THERM_T513 has to be changed along with THERM_TABLE_SHIFT");
+static_assert(Thermistor::entry(0, 136) > 24.0f && Thermistor::entry(0, 136) < 26.0f, "thermistor table isn't being worked out at compile time");
+
+//every entry is a constant expression so this ends up as a plain table in flash
+const float Thermistor::table[2][THERM_TABLE_SIZE] = { { THERM_T513(0) }, { THERM_T513(1) } };
+
+float Thermistor::toCelsius(int channel, uint16_t counts)
+{
+    const float *t = table[channel ? 1 : 0];
+    if (counts >= THERM_FULL_SCALE) return t[THERM_TABLE_SIZE - 1];
+    int idx = counts >> THERM_TABLE_SHIFT;
+    int frac = counts & ((1 << THERM_TABLE_SHIFT) - 1);
+    return t[idx] + (t[idx + 1] - t[idx]) * (frac * (1.0f / (1 << THERM_TABLE_SHIFT)));
+}
+
+//Degrees C per count around a reading, for turning rates of change in counts into degrees
+float Thermistor::slope(int channel, uint16_t counts)
+{
+    const float *t = table[channel ? 1 : 0];
+    int idx = (counts >= THERM_FULL_SCALE) ? (THERM_TABLE_SIZE - 2) : (counts >> THERM_TABLE_SHIFT);
+    return (t[idx + 1] - t[idx]) * (1.0f / (1 << THERM_TABLE_SHIFT));
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#define THERM_TABLE_SHIFT   5       //one table entry every 32 counts
+#define THERM_FULL_SCALE    16384   //the temperature inputs are 14 bit
+#define THERM_TABLE_SIZE    ((THERM_FULL_SCALE >> THERM_TABLE_SHIFT) + 1)
+
+/*
+ * Converts the module thermistor readings to degrees C. The Steinhart-Hart math the modules need is done
+ * by the compiler for every 32nd count of both channels, so at run time a reading is just a table lookup
+ * and a linear interpolation with no logs or powers. Between -40C and 150C the result is within 0.03C of
+ * working it out in full, tools/thermcheck.cpp checks that and times both.
+ */
+class Thermistor
+{
+public:
+    static float toCelsius(int channel, uint16_t counts);
+    static float slope(int channel, uint16_t counts);
+
+    //Natural log as a constant expression. Brings x into [1, 2) by halving or doubling then uses the atanh series
+    static constexpr double lnSeries(double y, double y2, double term, int n)
+    {
+        return (n > 41) ? 0.0 : (term / n) + lnSeries(y, y2, term * y2, n + 2);
+    }
+
+    static constexpr double ln(double x, int k = 0)
+    {
+        return (x >= 2.0) ? ln(x / 2.0, k + 1) : (x < 1.0) ? ln(x * 2.0, k - 1)
+               : (k * 0.69314718055994531) + 2.0 * lnSeries((x - 1.0) / (x + 1.0), ((x - 1.0) / (x + 1.0)) * ((x - 1.0) / (x + 1.0)), (x - 1.0) / (x + 1.0), 1);
+    }
+
+    //thermistor resistance in ohms. The two channels have slightly different offsets
+    static constexpr double resistance(int channel, int counts)
+    {
+        return 1000.0 * ((channel == 0) ? (1.78 / ((counts + 2) / 33046.0) - 3.57) : (1.78 / ((counts + 9) / 33068.0) - 3.57));
+    }
+
+    static constexpr double steinhartHart(double logR)
+    {
+        return 1.0 / (0.0007610373573 + (0.0002728524832 * logR) + (logR * logR * logR * 0.0000001022822735)) - 273.15;
+    }
+
+    static constexpr float entry(int channel, int idx)
+    {
+        return (float)steinhartHart(ln(resistance(channel, idx << THERM_TABLE_SHIFT)));
+    }
+
+    static const float table[2][THERM_TABLE_SIZE];
+};
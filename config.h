@@ -1,6 +1,10 @@
 #pragma once
 
+#if defined(ARDUINO)
 #include <Arduino.h>
+#else
+#include <stdint.h>     //the bus, frame parser and chain simulator also build on a PC, see tools/
+#endif
 
 //Set to the proper port for your USB connection - SerialUSB on Due (Native) or Serial for Due (Programming) or Teensy
 #define SERIALCONSOLE   SerialUSB
@@ -9,6 +13,23 @@
 //On the Due you need to use a USART port (Serial1, Serial2, Serial3) and update the call to serialSpecialInit if not Serial1
 #define SERIAL  Serial1
 
+//Larger packs can be split over up to three separate module chains, each on its own USART with its own 62 addresses.
+//All chains are polled at the same time so a pack scan takes about as long as the longest chain.
+//Chain 0 is always on SERIAL. The others use the ports below (USART1 and USART3 on the Due).
+#define BMS_CHAIN_COUNT 1
+#define MAX_BMS_CHAINS  3       //per chain settings in EEPROM are kept for this many
+#define SERIAL_CHAIN1   Serial2
+#define SERIAL_CHAIN2   Serial3
+
+//#define BMS_BAUD  612500
+#define BMS_BAUD  617647
+//#define BMS_BAUD  608695
+
+//Time allowed per module for a request and its reply to be passed along the daisy chain. Replies are
+//expected within the time it takes to put every byte on the wire plus this for each module in between.
+#define BUS_HOP_ALLOWANCE_US    20
+#define BUS_TURNAROUND_US       100     //fixed slack on every reply for the module to start answering
+
 #define REG_DEV_STATUS      0
 #define REG_GPAI            1
 #define REG_VCELL1          3
@@ -30,10 +51,48 @@
 #define REG_ADC_CONV        0x34
 #define REG_ADDR_CTRL       0x3B
 
+#define SNAPSHOT_LEN        0x24        //registers REG_DEV_STATUS through REG_CUV_FAULT
+#define ADC_CTRL_SETTING    0b00111101  //ADC Auto mode, read every ADC input we can (Both Temps, Pack, 6 cells)
+#define IO_CTRL_SETTING     0b00000011  //enable temperature measurement VSS pins
+#define ADC_CONVERSION_US   2000        //time given to the modules to convert every channel before reading them
+
 #define MAX_MODULE_ADDR     0x3E
+#define PACK_MODULES        (BMS_CHAIN_COUNT * MAX_MODULE_ADDR)  //highest pack wide module number, must stay under 0xFF for CAN
+#define DISCOVERY_MISSES    2       //findBoards stops after this many addresses in a row don't answer
+
+#define SHADOW_VERIFY_INTERVAL  60  //scans between reading module config registers back to check them. 0 to never check
+
+//History kept in RAM for every cell and thermistor. With the settings below each of the 8 channels of a module costs 88 bytes,
+//so a full chain of 62 modules takes a bit under 43KB. Tier 0 has a sample every scan, each tier after has the mean of
+//HISTORY_DECIMATION samples of the one below, so at one scan a second the tiers go back about 32s, 4 minutes and 33 minutes.
+#define HISTORY_MODULES     62      //the first this many modules in the pack have history kept
+#define HISTORY_TIERS       3
+#define HISTORY_SAMPLES     32      //samples per tier, must be even
+#define HISTORY_DECIMATION  8
+#define HISTORY_SHIFT       2       //readings are stored in steps of this many bits of counts, 2 is about 1.5mV for a cell
+#define HISTORY_ESCAPES     4       //steps too big for 4 bits that each tier of a channel can keep whole at once
+
+//Define to run against a simulated chain of this many modules instead of the real serial port. Handy for
+//exercising the scan, enumeration and recovery code without a pack on the bench.
+//#define BMS_SIMULATED_MODULES   4
 
-#define EEPROM_VERSION      0x10    //update any time EEPROM struct below is changed.
+#define BAUD_CAL_SPAN           3       //calibration tries this many divisor steps (each 1/8 of a bit clock) either side of the current one
+#define BAUD_CAL_READS          40      //snapshot reads per setting while calibrating
+#define BAUD_CHECK_TRANSACTIONS 2000    //bus transactions between checks of the error rate when auto calibration is on
+#define BAUD_RECAL_PERMILLE     20      //failed attempts per thousand transactions that trigger a new calibration
+
+#define EEPROM_VERSION      0x15    //update any time EEPROM struct below is changed.
 #define EEPROM_PAGE         0
+#define TOPOLOGY_VERSION    0x01    //update any time the ChainTopology struct below is changed.
+#define TOPOLOGY_PAGE       1       //the chain topology is kept on its own page so saving it never touches the settings
+
+#define STARTUP_DELAY       4000    //ms setup waits for USB to come up so early messages can be seen. 0 starts scanning right away
+
+#define SCAN_PER_MODULE     0       //every module is told to convert and then read on its own
+#define SCAN_BROADCAST      1       //one broadcast starts conversions pack wide then every module is read back to back
+
+#define READ_SPLIT          0       //status registers and measurements are read separately
+#define READ_SNAPSHOT       1       //registers 0x00 - 0x23 are read in one go
 
 #define DIN1                55
 #define DIN2                54
@@ -60,4 +119,24 @@ typedef struct {
     float UnderTSetpoint;
     float balanceVoltage;
     float balanceHyst;
-} EEPROMSettings;
\ No newline at end of file
+    uint8_t scanMode;   //SCAN_PER_MODULE or SCAN_BROADCAST
+    uint8_t readMode;   //READ_SPLIT or READ_SNAPSHOT
+    uint16_t baudDivisor[MAX_BMS_CHAINS]; //calibrated divisor for each possible chain, 0 to use the one worked out from BMS_BAUD
+    uint8_t autoBaudCal;    //1 to recalibrate a chain on its own if its error rate climbs
+    uint8_t filterMedian;   //1 to take the median of the last 3 readings of every channel to throw out single reading spikes
+    uint8_t filterCellShift;    //low pass on cell and module voltages, each reading moves the value 1/2^n of the way. 0 for none
+    uint8_t filterTempShift;    //same for the thermistors
+    uint16_t filterCellStep;    //most a cell or module voltage may change in one reading in counts. 0 for no limit
+    uint16_t filterTempStep;    //same for the thermistors
+    float anomalyZ;         //how many standard deviations from the rest of the pack a cell has to be to be flagged. 0 to never flag
+    float anomalyMinMV;     //and how far in mV, so a pack that is very evenly matched doesn't flag cells over nothing
+} EEPROMSettings;
+
+//What the chains looked like when last numbered, so a reboot can carry on with them instead of renumbering
+typedef struct {
+    uint8_t version;
+    uint8_t chainCount;
+    uint8_t moduleCount[MAX_BMS_CHAINS];
+    uint8_t addressMap[MAX_BMS_CHAINS][8];  //bit (addr & 7) of byte (addr >> 3) set for each address in use
+    uint32_t fingerprint;                   //hash of everything above, a mismatch means the page can't be trusted
+} ChainTopology;
@@ -0,0 +1,156 @@
+/*
+ * Runs BMSCellStats over a simulated pack of 62 modules and checks that it flags the cells it should and
+ * nothing else. Every cell has noise and a small fixed offset of its own, and the whole pack is loaded and
+ * unloaded in a slow cycle. Two cells are bad: one sits 15mV low all the time and one sags an extra 50mV
+ * under load. Part way through one module is quarantined and its last readings go stale at nonsense values,
+ * the way a module that stopped answering mid reply leaves them.
+ *
+ * The same scans are run twice: once with the quarantined module left out the way BMSModuleManager passes
+ * packLive, and once with every module counted, to show what the stale readings would do to the pack
+ * average and the flags. Exits with 1 if the first run flags anything other than the two bad cells.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. anomalycheck.cpp ../BMSCellStats.cpp -o anomalycheck
+ *
+ * Usage: anomalycheck [-z standard deviations] [-m min mV] [-s scans]
+ *   without -z/-m the EEPROM defaults are used
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "BMSCellStats.h"
+
+#define MODULES         62
+#define CELLS           (MODULES * 6)
+#define COUNTS_PER_MV   2.62128f    //1 / CELL_VOLTS_PER_COUNT in mV
+#define OFFSET_CELL     63          //module 11 cell 4, sits low
+#define SAG_CELL        200         //module 34 cell 3, high resistance
+#define QUARANTINED     40          //module slot quarantined part way through
+#define QUARANTINE_AT   150         //scan it happens on
+#define STALE_COUNTS    1200        //what its cells are left reading, about 0.46V
+
+static float noise()
+{
+    //roughly normal, sd of about 1.2 counts
+    float sum = 0.0f;
+    for (int i = 0; i < 4; i++) sum += (rand() % 1001) / 1000.0f;
+    return (sum - 2.0f) * 2.0f;
+}
+
+typedef struct {
+    int offsetFlagged;      //cells flagged offset at the end
+    int erraticFlagged;
+    bool offsetCellOk;      //the low cell is flagged offset
+    bool sagCellOk;         //the sagging cell is flagged erratic
+    bool quarantinedClean;  //none of the quarantined module's cells are flagged
+    int others;             //cells flagged that aren't one of the two bad ones
+    int warnings;           //newly flagged callbacks over the whole run
+    float lastAvg;          //pack average of the cells counted in the last scan, mV
+} RunResult;
+
+static void countWarning(void *context, int slot, int cell, bool offset)
+{
+    (void)slot; (void)cell; (void)offset;
+    (*(int *)context)++;
+}
+
+static void run(bool liveOnly, float z, float minMV, int scans, RunResult &r)
+{
+    static BMSCellStats stats; //too big for the stack
+    uint16_t counts[CELLS];
+    bool live[MODULES];
+    float fixed[CELLS];
+
+    stats.clear();
+    memset(&r, 0, sizeof(r));
+    srand(7);
+    for (int n = 0; n < CELLS; n++) fixed[n] = ((rand() % 7) - 3) * COUNTS_PER_MV; //-3mV to +3mV
+    fixed[OFFSET_CELL] = -15.0f * COUNTS_PER_MV;
+
+    for (int scan = 0; scan < scans; scan++)
+    {
+        //a load cycle every 40 scans pulling the pack down by up to 200mV
+        float load = 0.5f - 0.5f * cosf(scan * 2.0f * 3.14159265f / 40.0f);
+        for (int m = 0; m < MODULES; m++)
+        {
+            live[m] = !liveOnly || m != QUARANTINED || scan < QUARANTINE_AT;
+            for (int c = 0; c < 6; c++)
+            {
+                int n = (m * 6) + c;
+                if (m == QUARANTINED && scan >= QUARANTINE_AT)
+                {
+                    counts[n] = STALE_COUNTS;
+                    continue;
+                }
+                float mv = 3700.0f - (200.0f * load);
+                if (n == SAG_CELL) mv -= 50.0f * load;
+                counts[n] = (uint16_t)lroundf((mv * COUNTS_PER_MV) + fixed[n] + noise());
+            }
+        }
+        stats.update(counts, live, MODULES, z, minMV * COUNTS_PER_MV, countWarning, &r.warnings);
+
+        uint32_t sum = 0;
+        int cells = 0;
+        for (int m = 0; m < MODULES; m++)
+        {
+            if (!live[m]) continue;
+            for (int c = 0; c < 6; c++) sum += counts[(m * 6) + c];
+            cells += 6;
+        }
+        r.lastAvg = (sum / (float)cells) / COUNTS_PER_MV;
+    }
+
+    r.offsetCellOk = (stats.getOffsetCells(OFFSET_CELL / 6) >> (OFFSET_CELL % 6)) & 1;
+    r.sagCellOk = (stats.getErraticCells(SAG_CELL / 6) >> (SAG_CELL % 6)) & 1;
+    r.quarantinedClean = (stats.getOffsetCells(QUARANTINED) | stats.getErraticCells(QUARANTINED)) == 0;
+    for (int n = 0; n < CELLS; n++)
+    {
+        uint8_t offset = (stats.getOffsetCells(n / 6) >> (n % 6)) & 1;
+        uint8_t erratic = (stats.getErraticCells(n / 6) >> (n % 6)) & 1;
+        r.offsetFlagged += offset;
+        r.erraticFlagged += erratic;
+        if (!offset && !erratic) continue;
+        if (n != OFFSET_CELL && n != SAG_CELL) r.others++;
+        float mean, spread;
+        stats.getDeviation(n, mean, spread);
+        printf("    module %2i cell %i: %7.1fmV from the pack, swings %5.1fmV%s%s\n", (n / 6) + 1, (n % 6) + 1,
+               mean / COUNTS_PER_MV, spread / COUNTS_PER_MV, offset ? "  OFFSET" : "", erratic ? "  ERRATIC" : "");
+    }
+    printf("    peers: mean deviation %.2fmV +/- %.2fmV, swing %.2fmV +/- %.2fmV\n", stats.getPeerMean() / COUNTS_PER_MV,
+           stats.getPeerMeanSD() / COUNTS_PER_MV, stats.getPeerSpread() / COUNTS_PER_MV, stats.getPeerSpreadSD() / COUNTS_PER_MV);
+}
+
+int main(int argc, char **argv)
+{
+    float z = 3.0f, minMV = 10.0f;
+    int scans = 600;
+
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (!strcmp(argv[i], "-z")) z = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-m")) minMV = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-s")) scans = atoi(argv[++i]);
+    }
+
+    printf("%i cells, %i scans, flag at %.1f standard deviations and %.1fmV. Module %i quarantined from scan %i\n\n",
+           CELLS, scans, z, minMV, QUARANTINED + 1, QUARANTINE_AT);
+
+    RunResult live, all;
+    printf("quarantined module left out (firmware):\n");
+    run(true, z, minMV, scans, live);
+    printf("  pack average %.1fmV, %i offset and %i erratic flags, %i warnings\n\n", live.lastAvg, live.offsetFlagged,
+           live.erraticFlagged, live.warnings);
+
+    printf("every module counted:\n");
+    run(false, z, minMV, scans, all);
+    printf("  pack average %.1fmV, %i offset and %i erratic flags, %i warnings\n\n", all.lastAvg, all.offsetFlagged,
+           all.erraticFlagged, all.warnings);
+
+    //the sagging cell sits low on average too so it may be flagged offset as well, nothing else may be
+    bool pass = live.offsetCellOk && live.sagCellOk && live.quarantinedClean && live.others == 0;
+    printf("%s: low cell %s, sagging cell %s, quarantined module %s, %i other cells flagged\n", pass ? "PASS" : "FAIL",
+           live.offsetCellOk ? "flagged" : "missed", live.sagCellOk ? "flagged" : "missed",
+           live.quarantinedClean ? "not flagged" : "flagged", live.others);
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+/*
+ * Runs the module bus against a simulated chain on a PC and reports how long a full pack scan takes
+ * for every chain length in both scan modes. Uses a virtual clock so results don't depend on the host.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -I.. chainsim.cpp ../BMSBus.cpp ../BMSBusStats.cpp ../BMSSimulator.cpp ../BMSFrameParser.cpp ../CRC8.cpp -o chainsim
+ *
+ * Options: chainsim [bit error rate] [hop delay us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "BMSBus.h"
+#include "config.h"
+#include "BMSSimulator.h"
+
+static uint32_t simTime = 0;
+static int good = 0;
+static int bad = 0;
+static int found = 0;
+
+static uint32_t simClock()
+{
+    return simTime;
+}
+
+static void countReply(void *context, BMSReply &reply)
+{
+    if (reply.status == BUS_OK) good++;
+    else bad++;
+}
+
+static void probeReply(void *context, BMSReply &reply)
+{
+    //unaddressed module answering a read of the device status register
+    if (reply.status == BUS_OK && reply.length > 4 && reply.data[3] > 0) found++;
+}
+
+static void runUntilIdle(BMSBus &bus)
+{
+    while (!bus.isIdle())
+    {
+        bus.loop();
+        simTime++;
+    }
+}
+
+//Same sequence as BMSModuleManager::setupBoards but queued through the bus
+static int enumerate(BMSBus &bus, int maxModules)
+{
+    bus.queueWrite(0x3F << 1, 0x3C, 0xA5, countReply, NULL);
+    runUntilIdle(bus);
+    for (int addr = 1; addr <= maxModules; addr++)
+    {
+        int before = found;
+        bus.queueRead(0, REG_DEV_STATUS, 1, probeReply, NULL);
+        runUntilIdle(bus);
+        if (found == before) break;
+        bus.queueWrite(0, REG_ADDR_CTRL, addr | 0x80, countReply, NULL);
+        runUntilIdle(bus);
+    }
+    return found;
+}
+
+static uint32_t scanPerModule(BMSBus &bus, int modules)
+{
+    uint32_t start = simTime;
+    for (int addr = 1; addr <= modules; addr++)
+    {
+        uint8_t addrByte = addr << 1;
+        bus.queueWrite(addrByte, REG_ADC_CTRL, ADC_CTRL_SETTING, countReply, NULL);
+        bus.queueWrite(addrByte, REG_IO_CTRL, IO_CTRL_SETTING, countReply, NULL);
+        bus.queueWrite(addrByte, REG_ADC_CONV, 1, countReply, NULL);
+        bus.queuePause(ADC_CONVERSION_US);
+        bus.queueRead(addrByte, REG_GPAI, 0x12, countReply, NULL, BUS_FLAG_CHECK_CRC);
+        runUntilIdle(bus);
+    }
+    return simTime - start;
+}
+
+static uint32_t scanBroadcast(BMSBus &bus, int modules)
+{
+    uint32_t start = simTime;
+    bus.queueWrite(0x3F << 1, REG_ADC_CTRL, ADC_CTRL_SETTING, countReply, NULL);
+    bus.queueWrite(0x3F << 1, REG_IO_CTRL, IO_CTRL_SETTING, countReply, NULL);
+    bus.queueWrite(0x3F << 1, REG_ADC_CONV, 1, countReply, NULL);
+    bus.queuePause(ADC_CONVERSION_US);
+    for (int addr = 1; addr <= modules; addr++)
+    {
+        bus.queueRead(addr << 1, REG_DEV_STATUS, SNAPSHOT_LEN, countReply, NULL, BUS_FLAG_CHECK_CRC);
+        if (bus.freeSlots() == 0) runUntilIdle(bus);
+    }
+    runUntilIdle(bus);
+    return simTime - start;
+}
+
+int main(int argc, char **argv)
+{
+    float errorRate = (argc > 1) ? atof(argv[1]) : 0.0f;
+    int hopDelay = (argc > 2) ? atoi(argv[2]) : 10;
+
+    printf("modules  found  per-module(us)  broadcast(us)  good  bad  retries  crc  timeouts\n");
+    for (int count = 1; count <= SIM_MAX_MODULES; count++)
+    {
+        static BMSSimulator sim(simClock);
+        BMSBus bus;
+
+        sim.setModuleCount(count);
+        sim.setHopDelay(hopDelay);
+        sim.setBitErrorRate(errorRate);
+        bus.setTransport(&sim);
+        good = bad = found = 0;
+
+        int modules = enumerate(bus, MAX_MODULE_ADDR);
+        bus.setChainLength(modules);
+        uint32_t perModule = scanPerModule(bus, modules);
+        uint32_t broadcast = scanBroadcast(bus, modules);
+        BusCounters totals;
+        bus.getStats().getTotals(totals);
+        printf("%7i  %5i  %14u  %13u  %4i  %3i  %7u  %3u  %8u\n", count, modules, perModule, broadcast, good, bad,
+               totals.retries, totals.crcErrors, totals.timeouts);
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Times the CRC8 table against the bit at a time loop BMSUtil::genCRC used to run, over the frame lengths
+ * the module bus actually sends: a read request (3 bytes plus CRC), a write (4 plus CRC), a measurement
+ * reply (22) and a snapshot reply (40). Also checks the two agree on every frame timed.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. crcbench.cpp ../CRC8.cpp -o crcbench
+ *
+ * Usage: crcbench [frames per length]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "CRC8.h"
+
+#define FRAME_SETS  64  //different frames of each length so the loops can't be folded away
+
+//exactly what BMSUtil::genCRC did before the table
+static uint8_t bitwiseCRC(const uint8_t *input, int lenInput)
+{
+    uint8_t generator = 0x07;
+    uint8_t crc = 0;
+
+    for (int x = 0; x < lenInput; x++)
+    {
+        crc ^= input[x];
+        for (int i = 0; i < 8; i++)
+        {
+            if ((crc & 0x80) != 0) crc = (uint8_t)((crc << 1) ^ generator);
+            else crc <<= 1;
+        }
+    }
+    return crc;
+}
+
+int main(int argc, char **argv)
+{
+    long frames = (argc > 1) ? atol(argv[1]) : 10000000;
+    const int lengths[] = { 4, 7, 22, 40 };
+    static uint8_t data[FRAME_SETS][40];
+    bool agree = true;
+
+    srand(1);
+    for (int s = 0; s < FRAME_SETS; s++) for (int b = 0; b < 40; b++) data[s][b] = rand() & 0xFF;
+
+    printf("bytes   bitwise ns   table ns   streaming ns   speedup\n");
+    for (int l = 0; l < 4; l++)
+    {
+        int len = lengths[l];
+        volatile uint8_t sink;
+        uint8_t acc = 0;
+
+        for (int s = 0; s < FRAME_SETS; s++) if (bitwiseCRC(data[s], len) != CRC8::calc(data[s], len)) agree = false;
+
+        auto start = std::chrono::steady_clock::now();
+        for (long n = 0; n < frames; n++) acc ^= bitwiseCRC(data[n & (FRAME_SETS - 1)], len);
+        double bitNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames;
+        sink = acc;
+
+        start = std::chrono::steady_clock::now();
+        for (long n = 0; n < frames; n++) acc ^= CRC8::calc(data[n & (FRAME_SETS - 1)], len);
+        double tableNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames;
+        sink = acc;
+
+        //a byte at a time as the frame parser does while bytes come off the wire
+        start = std::chrono::steady_clock::now();
+        for (long n = 0; n < frames; n++)
+        {
+            CRC8 crc;
+            const uint8_t *frame = data[n & (FRAME_SETS - 1)];
+            for (int b = 0; b < len; b++) crc.update(frame[b]);
+            acc ^= crc.get();
+        }
+        double streamNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames;
+        sink = acc;
+        (void)sink;
+
+        printf("%5i   %10.2f   %8.2f   %12.2f   %6.1fx\n", len, bitNs, tableNs, streamNs, bitNs / tableNs);
+    }
+    printf("%s over %li frames per length\n", agree ? "table and bitwise agree" : "MISMATCH between table and bitwise", frames);
+    return agree ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+/*
+ * Compares the work done per module reading before and after measurements were kept as raw ADC counts.
+ * The old path is the float decode BMSModule used to run on every reply: volts for every cell and the
+ * module total, Steinhart-Hart for both thermistors and float min/max tracking. The new path is
+ * ModuleDecode::measurements plus the min/max tracking BMSModule now does in counts (the filter stage
+ * added later is left out so only the storage change is measured).
+ *
+ * Both are timed on this machine over the same replies, and the old path is also run once with a float
+ * stand-in that counts every arithmetic operation and library call, which is what turns into soft-float
+ * calls on the Cortex-M3. Host time is only a guide to the ratio, not to Due cycles.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. decodebench.cpp ../ModuleDecode.cpp ../Thermistor.cpp -o decodebench
+ *
+ * Usage: decodebench [readings to time]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include "ModuleDecode.h"
+
+static long adds, muls, divs, compares, logs, pows;
+
+//float that counts what is done with it
+struct Counted
+{
+    float v;
+    Counted(float val = 0.0f) : v(val) {}
+};
+static Counted operator+(Counted a, Counted b) { adds++; return a.v + b.v; }
+static Counted operator-(Counted a, Counted b) { adds++; return a.v - b.v; }
+static Counted operator*(Counted a, Counted b) { muls++; return a.v * b.v; }
+static Counted operator/(Counted a, Counted b) { divs++; return a.v / b.v; }
+static Counted &operator*=(Counted &a, Counted b) { muls++; a.v *= b.v; return a; }
+static bool operator<(Counted a, Counted b) { compares++; return a.v < b.v; }
+static bool operator>(Counted a, Counted b) { compares++; return a.v > b.v; }
+static Counted logf(Counted a) { logs++; return ::logf(a.v); }
+static Counted powf(Counted a, Counted b) { pows++; return ::powf(a.v, b.v); }
+
+//What BMSModule kept per module before, all floats
+template <typename F> struct FloatReadings
+{
+    F cellVolt[6];
+    F lowestCellVolt[6];
+    F highestCellVolt[6];
+    F moduleVolt;
+    F temperatures[2];
+    F lowestTemperature;
+    F highestTemperature;
+    F lowestModuleVolt;
+    F highestModuleVolt;
+};
+
+//And what it keeps now
+struct CountReadings
+{
+    uint16_t cellCounts[6];
+    uint16_t lowestCellCounts[6];
+    uint16_t highestCellCounts[6];
+    uint16_t moduleCounts;
+    uint16_t lowestModuleCounts;
+    uint16_t highestModuleCounts;
+    uint16_t tempCounts[2];
+    uint16_t lowestTempCounts[2];
+    uint16_t highestTempCounts[2];
+};
+
+//The old BMSModule::decodeMeasurements. The original had one double constant in the Steinhart-Hart line, which
+//made the rest of that expression double. It is float here so the old path's counts err on the low side.
+template <typename F> static void floatDecode(const uint8_t *regs, FloatReadings<F> &r)
+{
+    F tempCalc;
+    F tempTemp;
+
+    r.moduleVolt = F(regs[0] * 256 + regs[1]) * F(0.002034609f);
+    if (r.moduleVolt > r.highestModuleVolt) r.highestModuleVolt = r.moduleVolt;
+    if (r.moduleVolt < r.lowestModuleVolt) r.lowestModuleVolt = r.moduleVolt;
+    for (int i = 0; i < 6; i++)
+    {
+        r.cellVolt[i] = F(regs[2 + (i * 2)] * 256 + regs[3 + (i * 2)]) * F(0.000381493f);
+        if (r.lowestCellVolt[i] > r.cellVolt[i]) r.lowestCellVolt[i] = r.cellVolt[i];
+        if (r.highestCellVolt[i] < r.cellVolt[i]) r.highestCellVolt[i] = r.cellVolt[i];
+    }
+
+    tempTemp = (F(1.78f) / (F(regs[14] * 256 + regs[15] + 2) / F(33046.0f)) - F(3.57f));
+    tempTemp *= F(1000.0f);
+    tempCalc = F(1.0f) / (F(0.0007610373573f) + (F(0.0002728524832f) * logf(tempTemp)) + (powf(logf(tempTemp), F(3)) * F(0.0000001022822735f)));
+    r.temperatures[0] = tempCalc - F(273.15f);
+
+    tempTemp = F(1.78f) / (F(regs[16] * 256 + regs[17] + 9) / F(33068.0f)) - F(3.57f);
+    tempTemp *= F(1000.0f);
+    tempCalc = F(1.0f) / (F(0.0007610373573f) + (F(0.0002728524832f) * logf(tempTemp)) + (powf(logf(tempTemp), F(3)) * F(0.0000001022822735f)));
+    r.temperatures[1] = tempCalc - F(273.15f);
+
+    F low = (r.temperatures[0] < r.temperatures[1]) ? r.temperatures[0] : r.temperatures[1];
+    F high = (r.temperatures[0] > r.temperatures[1]) ? r.temperatures[0] : r.temperatures[1];
+    if (low < r.lowestTemperature) r.lowestTemperature = low;
+    if (high > r.highestTemperature) r.highestTemperature = high;
+}
+
+static void countDecode(const uint8_t *regs, CountReadings &r)
+{
+    ModuleMeasurements raw;
+    ModuleDecode::measurements(regs, raw);
+
+    r.moduleCounts = raw.moduleCounts;
+    if (r.moduleCounts > r.highestModuleCounts) r.highestModuleCounts = r.moduleCounts;
+    if (r.moduleCounts < r.lowestModuleCounts) r.lowestModuleCounts = r.moduleCounts;
+    for (int i = 0; i < 6; i++)
+    {
+        r.cellCounts[i] = raw.cellCounts[i];
+        if (r.lowestCellCounts[i] > r.cellCounts[i]) r.lowestCellCounts[i] = r.cellCounts[i];
+        if (r.highestCellCounts[i] < r.cellCounts[i]) r.highestCellCounts[i] = r.cellCounts[i];
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        r.tempCounts[i] = raw.tempCounts[i];
+        if (r.lowestTempCounts[i] > r.tempCounts[i]) r.lowestTempCounts[i] = r.tempCounts[i];
+        if (r.highestTempCounts[i] < r.tempCounts[i]) r.highestTempCounts[i] = r.tempCounts[i];
+    }
+}
+
+//A believable module reply: cells around 3.7V, module total to match, thermistors near room temperature
+static void makeRegs(uint8_t *regs)
+{
+    uint16_t vals[9];
+    vals[0] = 10900 + (rand() % 40);
+    for (int i = 0; i < 6; i++) vals[1 + i] = 9700 + (rand() % 40);
+    vals[7] = 12300 + (rand() % 200);
+    vals[8] = 12300 + (rand() % 200);
+    for (int i = 0; i < 9; i++)
+    {
+        regs[i * 2] = vals[i] >> 8;
+        regs[(i * 2) + 1] = vals[i] & 0xFF;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long readings = (argc > 1) ? atol(argv[1]) : 2000000;
+    const int replies = 256;
+    static uint8_t regs[replies][MEASUREMENT_LEN];
+    FloatReadings<float> floats;
+    FloatReadings<Counted> counted;
+    CountReadings counts;
+
+    srand(1);
+    for (int i = 0; i < replies; i++) makeRegs(regs[i]);
+
+    floatDecode(regs[0], counted);
+    printf("old path per reading: %li adds/subtracts, %li multiplies, %li divides, %li compares, %li logf, %li powf\n",
+           adds, muls, divs, compares, logs, pows);
+    printf("new path per reading: no float work, 9 byte pair loads and 18 integer compares\n");
+
+    memset(&floats, 0, sizeof(floats));
+    memset(&counts, 0, sizeof(counts));
+
+    auto start = std::chrono::steady_clock::now();
+    for (long n = 0; n < readings; n++) floatDecode(regs[n & (replies - 1)], floats);
+    double floatNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / readings;
+
+    start = std::chrono::steady_clock::now();
+    for (long n = 0; n < readings; n++) countDecode(regs[n & (replies - 1)], counts);
+    double countNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / readings;
+
+    //keep the compiler from dropping either loop
+    volatile float sink = floats.highestTemperature + counts.highestTempCounts[0];
+    (void)sink;
+
+    printf("this machine: float decode %.1f ns, count decode %.1f ns per reading (%.0fx)\n", floatNs, countNs, floatNs / countNs);
+    printf("storage per module: %i bytes as floats, %i bytes as counts\n", (int)sizeof(FloatReadings<float>), (int)sizeof(CountReadings));
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Runs BMSFilter over glitchy cell and thermistor traces and reports how far the raw and filtered values
+ * stray from the clean signal, how long a real step takes to come through, then times the filter.
+ * The built in traces are a clean signal with noise plus the kinds of glitch seen on the bench: single
+ * readings that jump to nonsense, back to back bad readings and real load steps. Any other trace can be fed
+ * in with -f, one raw count per line (for example a column pulled out of replay output), and the raw and
+ * filtered values are printed side by side.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. filtercheck.cpp ../BMSFilter.cpp -o filtercheck
+ *
+ * Usage: filtercheck [-m median] [-s shift] [-c max step] [-f trace.txt]
+ *   without -m/-s/-c the firmware defaults for each built in trace are used
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "BMSFilter.h"
+
+#define TRACE_LEN   2000
+
+typedef struct {
+    const char *name;
+    FilterConfig config;
+    std::vector<int> clean;
+    std::vector<int> raw;
+    int stepAt;             //sample where the clean signal steps, -1 if it doesn't
+} Trace;
+
+static uint32_t seed = 12345;
+static int noise(int amplitude)
+{
+    seed = seed * 1103515245u + 12345u;
+    return (int)((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static int clampCounts(int v)
+{
+    return (v < 0) ? 0 : (v > 16383) ? 16383 : v;
+}
+
+//a module warming slowly from about 20C with a glitch every 97 readings, every third one two readings long
+static void makeTemperature(Trace &t)
+{
+    t.name = "thermistor glitches";
+    t.config = (FilterConfig){ 1, 2, 64 };
+    t.stepAt = -1;
+    int glitches = 0;
+    for (int n = 0; n < TRACE_LEN; n++)
+    {
+        int c = 3700 + (n / 4);
+        t.clean.push_back(c);
+        int r = c + noise(3);
+        if ((n % 97) == 50 || ((n % 97) == 51 && (glitches % 3) == 2)) r = (glitches & 1) ? 0 : c + 2500;
+        if ((n % 97) == 51) glitches++;
+        t.raw.push_back(clampCounts(r));
+    }
+}
+
+//a cell at 3.8V with single reading spikes and a 100mV load step in the middle
+static void makeCell(Trace &t)
+{
+    t.name = "cell spikes and load step";
+    t.config = (FilterConfig){ 1, 1, 0 };
+    t.stepAt = TRACE_LEN / 2;
+    for (int n = 0; n < TRACE_LEN; n++)
+    {
+        int c = (n < t.stepAt) ? 9960 : 9698;
+        t.clean.push_back(c);
+        int r = c + noise(4);
+        if ((n % 61) == 30) r += ((n / 61) & 1) ? 800 : -800;
+        t.raw.push_back(clampCounts(r));
+    }
+}
+
+static void run(Trace &t, bool overridden, const FilterConfig &override)
+{
+    FilterConfig cfg = overridden ? override : t.config;
+    FilterState state;
+    uint8_t primed = 0;
+    double rawWorst = 0, filtWorst = 0, rawSq = 0, filtSq = 0;
+    int settle = -1;
+
+    for (size_t n = 0; n < t.raw.size(); n++)
+    {
+        int out = BMSFilter::apply(state, t.raw[n], primed, cfg);
+        if (primed < FILTER_PRIME) primed++;
+        double rawErr = fabs((double)t.raw[n] - t.clean[n]);
+        double filtErr = fabs((double)out - t.clean[n]);
+        if (rawErr > rawWorst) rawWorst = rawErr;
+        rawSq += rawErr * rawErr;
+        filtSq += filtErr * filtErr;
+        //the step itself isn't an error, only how long the output takes to follow it
+        if (t.stepAt >= 0 && (int)n >= t.stepAt && settle < 0)
+        {
+            if (fabs((double)out - t.clean[n]) <= 4) settle = n - t.stepAt;
+            continue;
+        }
+        if (filtErr > filtWorst) filtWorst = filtErr;
+    }
+
+    printf("%s (median %i, shift %i, max step %i)\n", t.name, cfg.median, cfg.shift, cfg.maxStep);
+    printf("  worst error   raw %6.0f counts   filtered %6.0f counts\n", rawWorst, filtWorst);
+    printf("  rms error     raw %6.1f counts   filtered %6.1f counts\n", sqrt(rawSq / t.raw.size()), sqrt(filtSq / t.raw.size()));
+    if (t.stepAt >= 0) printf("  step followed to within 4 counts after %i readings\n", settle);
+}
+
+int main(int argc, char **argv)
+{
+    FilterConfig override = { 1, 1, 0 };
+    bool overridden = false;
+    const char *file = NULL;
+
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (!strcmp(argv[i], "-m")) { override.median = atoi(argv[++i]); overridden = true; }
+        else if (!strcmp(argv[i], "-s")) { override.shift = atoi(argv[++i]); overridden = true; }
+        else if (!strcmp(argv[i], "-c")) { override.maxStep = atoi(argv[++i]); overridden = true; }
+        else if (!strcmp(argv[i], "-f")) file = argv[++i];
+    }
+
+    if (file)
+    {
+        FILE *f = fopen(file, "r");
+        if (!f)
+        {
+            printf("Can't open %s\n", file);
+            return 1;
+        }
+        FilterState state;
+        uint8_t primed = 0;
+        int raw;
+        while (fscanf(f, "%i", &raw) == 1)
+        {
+            printf("%i %i\n", raw, BMSFilter::apply(state, clampCounts(raw), primed, override));
+            if (primed < FILTER_PRIME) primed++;
+        }
+        fclose(f);
+        return 0;
+    }
+
+    Trace traces[2];
+    makeTemperature(traces[0]);
+    makeCell(traces[1]);
+    for (int t = 0; t < 2; t++) run(traces[t], overridden, override);
+
+    //every stage on, which is the slowest path through
+    const long samples = 50000000;
+    FilterConfig all = { 1, 2, 64 };
+    FilterState state;
+    uint8_t primed = 0;
+    volatile uint32_t sink = 0;
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long n = 0; n < samples; n++)
+    {
+        sum += BMSFilter::apply(state, traces[0].raw[n % TRACE_LEN], primed, all);
+        primed = FILTER_PRIME;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+    sink = sum;
+    (void)sink;
+    printf("%.2f ns per reading with every stage on over %li readings, %i bytes of state per channel\n", ns, samples, (int)sizeof(FilterState));
+    return 0;
+}
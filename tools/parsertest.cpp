@@ -0,0 +1,244 @@
+/*
+ * Checks BMSFrameParser against the awkward cases the module bus produces: replies that arrive over
+ * several reads, leftovers from a previous reply sitting in front of the next one, corrupted CRCs,
+ * replies from the wrong board or register and write echoes. Then times the parser a byte at a time
+ * over measurement sized replies.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. parsertest.cpp ../BMSFrameParser.cpp ../CRC8.cpp -o parsertest
+ *
+ * Usage: parsertest [frames to time]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "BMSFrameParser.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    printf("%s  %s\n", ok ? "pass" : "FAIL", what);
+    if (!ok) failures++;
+}
+
+//Build a read reply the way a module sends it: address, register, length, data, CRC. Returns the frame length
+static int makeReply(uint8_t *out, uint8_t addrByte, uint8_t reg, const uint8_t *data, int dataLen)
+{
+    out[0] = addrByte;
+    out[1] = reg;
+    out[2] = dataLen;
+    memcpy(&out[3], data, dataLen);
+    out[dataLen + 3] = CRC8::calc(out, dataLen + 3);
+    return dataLen + 4;
+}
+
+static int makeEcho(uint8_t *out, uint8_t addrByte, uint8_t reg, uint8_t value)
+{
+    out[0] = addrByte | 1;
+    out[1] = reg;
+    out[2] = value;
+    out[3] = CRC8::calc(out, 3);
+    return 4;
+}
+
+//Feed bytes and count the frames that come out, keeping a copy of the last one
+static int feedAll(BMSFrameParser &parser, const uint8_t *data, int len, BMSFrame &last, uint8_t *lastCopy)
+{
+    int frames = 0;
+    BMSFrame frame;
+
+    for (int i = 0; i < len; i++)
+    {
+        if (parser.feed(data[i], frame))
+        {
+            frames++;
+            last = frame;
+            memcpy(lastCopy, frame.data, frame.length);
+            last.data = lastCopy;
+            last.payload = lastCopy + (frame.payload - frame.data);
+        }
+    }
+    return frames;
+}
+
+static void testSplitReads()
+{
+    BMSFrameParser parser;
+    BMSFrame frame;
+    uint8_t copy[FRAME_MAX_LEN];
+    uint8_t data[18];
+    uint8_t reply[FRAME_MAX_LEN];
+
+    for (int i = 0; i < 18; i++) data[i] = i * 7;
+    int len = makeReply(reply, 0x04, 0x01, data, 18);
+
+    //every way of cutting the reply into two reads, plus one byte per read
+    bool allGood = true;
+    for (int cut = 1; cut < len; cut++)
+    {
+        parser.expect(0x04, 0x01);
+        int first = feedAll(parser, reply, cut, frame, copy);
+        if (first != 0 || parser.pending() != cut) allGood = false;
+        int second = feedAll(parser, reply + cut, len - cut, frame, copy);
+        if (second != 1 || !frame.crcGood || frame.payloadLen != 18 || memcmp(frame.payload, data, 18)) allGood = false;
+    }
+    check(allGood, "reply split across two reads at every position");
+
+    parser.expect(0x04, 0x01);
+    int frames = 0;
+    for (int i = 0; i < len; i++) frames += feedAll(parser, reply + i, 1, frame, copy);
+    check(frames == 1 && frame.crcGood && frame.length == len, "reply fed one byte per read");
+}
+
+static void testLeftovers()
+{
+    BMSFrameParser parser;
+    BMSFrame frame;
+    uint8_t copy[FRAME_MAX_LEN];
+    uint8_t data[6] = { 1, 2, 3, 4, 5, 6 };
+    uint8_t stream[2 * FRAME_MAX_LEN];
+
+    //tail of an earlier reply from board 3 still in the buffer when board 2 answers
+    uint8_t old[FRAME_MAX_LEN];
+    int oldLen = makeReply(old, 0x06, 0x00, data, 6);
+    int tail = 5;
+    memcpy(stream, old + oldLen - tail, tail);
+    int len = tail + makeReply(stream + tail, 0x04, 0x00, data, 6);
+
+    parser.expect(0x04, 0x00);
+    uint32_t before = parser.getDiscarded();
+    int frames = feedAll(parser, stream, len, frame, copy);
+    check(frames == 1 && frame.crcGood && frame.addrByte == 0x04 && parser.pending() == 0, "leftover tail skipped, new reply parsed");
+    check(parser.getDiscarded() - before == (uint32_t)tail, "leftover bytes counted as discarded");
+
+    //leftover that looks like the right address but has the wrong register behind it
+    stream[0] = 0x04;
+    stream[1] = 0x33;
+    len = 2 + makeReply(stream + 2, 0x04, 0x00, data, 6);
+    parser.expect(0x04, 0x00);
+    frames = feedAll(parser, stream, len, frame, copy);
+    check(frames == 1 && frame.crcGood && frame.length == 10, "false start dropped and the real header picked up");
+
+    //two complete replies back to back without filtering both come out
+    int first = makeReply(stream, 0x04, 0x00, data, 6);
+    len = first + makeReply(stream + first, 0x04, 0x00, data, 3);
+    parser.reset();
+    frames = feedAll(parser, stream, len, frame, copy);
+    check(frames == 2 && frame.payloadLen == 3 && frame.crcGood, "back to back replies both parsed");
+}
+
+static void testBadCRC()
+{
+    BMSFrameParser parser;
+    BMSFrame frame;
+    uint8_t copy[FRAME_MAX_LEN];
+    uint8_t data[4] = { 0x10, 0x20, 0x30, 0x40 };
+    uint8_t reply[FRAME_MAX_LEN];
+
+    int len = makeReply(reply, 0x04, 0x01, data, 4);
+    reply[len - 1] ^= 0x01;
+    parser.expect(0x04, 0x01);
+    int frames = feedAll(parser, reply, len, frame, copy);
+    check(frames == 1 && !frame.crcGood, "corrupted CRC byte reported as bad");
+
+    len = makeReply(reply, 0x04, 0x01, data, 4);
+    reply[4] ^= 0x80;
+    parser.expect(0x04, 0x01);
+    frames = feedAll(parser, reply, len, frame, copy);
+    check(frames == 1 && !frame.crcGood, "corrupted data byte reported as bad");
+
+    //a broken length byte must not run the buffer past its end
+    reply[2] = 200;
+    parser.reset();
+    frames = feedAll(parser, reply, 3, frame, copy);
+    check(frames == 0 && parser.pending() < 3, "impossible length rejected");
+}
+
+static void testWrongReply()
+{
+    BMSFrameParser parser;
+    BMSFrame frame;
+    uint8_t copy[FRAME_MAX_LEN];
+    uint8_t data[4] = { 9, 8, 7, 6 };
+    uint8_t reply[FRAME_MAX_LEN];
+
+    int len = makeReply(reply, 0x08, 0x01, data, 4);
+    parser.expect(0x04, 0x01);
+    int frames = feedAll(parser, reply, len, frame, copy);
+    check(frames == 0 && parser.pending() == 0, "reply from the wrong address ignored");
+
+    len = makeReply(reply, 0x04, 0x02, data, 4);
+    parser.expect(0x04, 0x01);
+    frames = feedAll(parser, reply, len, frame, copy);
+    check(frames == 0 && parser.pending() == 0, "reply for the wrong register ignored");
+
+    //boards that haven't been addressed yet answer with the top bit set
+    len = makeReply(reply, 0x80, 0x00, data, 4);
+    parser.expect(0x00, 0x00);
+    frames = feedAll(parser, reply, len, frame, copy);
+    check(frames == 1 && frame.crcGood && frame.addrByte == 0x80, "unaddressed board reply accepted");
+}
+
+static void testWriteEcho()
+{
+    BMSFrameParser parser;
+    BMSFrame frame;
+    uint8_t copy[FRAME_MAX_LEN];
+    uint8_t echo[4];
+
+    int len = makeEcho(echo, 0x04, 0x34, 0x03);
+    parser.expect(0x05, 0x34);
+    int frames = feedAll(parser, echo, len, frame, copy);
+    check(frames == 1 && frame.isWrite && frame.crcGood && frame.length == 4, "write echo parsed");
+    check(frame.payloadLen == 1 && frame.payload[0] == 0x03, "write echo carries the written value");
+
+    //a value byte that looks like a long length must not stretch the echo
+    len = makeEcho(echo, 0x04, 0x3C, 0x2C);
+    parser.expect(0x05, 0x3C);
+    frames = feedAll(parser, echo, len, frame, copy);
+    check(frames == 1 && frame.length == 4 && frame.crcGood, "write echo with a large value stays 4 bytes");
+}
+
+static void timeParser(long frames)
+{
+    BMSFrameParser parser;
+    BMSFrame frame;
+    uint8_t data[18];
+    uint8_t reply[FRAME_MAX_LEN];
+    long good = 0;
+
+    for (int i = 0; i < 18; i++) data[i] = rand() & 0xFF;
+    int len = makeReply(reply, 0x04, 0x01, data, 18);
+
+    auto start = std::chrono::steady_clock::now();
+    for (long n = 0; n < frames; n++)
+    {
+        parser.expect(0x04, 0x01);
+        for (int i = 0; i < len; i++)
+        {
+            if (parser.feed(reply[i], frame) && frame.crcGood) good++;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%li %i byte replies: %.1f ns per reply, %.2f ns per byte\n", frames, len, ns / frames, ns / frames / len);
+    check(good == frames, "every timed reply parsed with a good CRC");
+}
+
+int main(int argc, char **argv)
+{
+    long frames = (argc > 1) ? atol(argv[1]) : 5000000;
+
+    srand(1);
+    testSplitReads();
+    testLeftovers();
+    testBadCRC();
+    testWrongReply();
+    testWriteEcho();
+    timeParser(frames);
+
+    printf("%i failure%s\n", failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Decodes a module bus capture taken with CAPTURE=1 and dumped with X on the console. Every received byte goes
+ * through the same BMSFrameParser the bus uses, primed by each request the same way BMSBus primes it, so what
+ * comes out is what the firmware would have seen. Reports each transaction with its round trip time, decodes
+ * measurement, status and presence replies and can time the parser over the whole capture.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. replay.cpp ../BMSCapture.cpp ../BMSFrameParser.cpp ../CRC8.cpp ../ModuleDecode.cpp ../Thermistor.cpp -o replay
+ *
+ * Usage: replay [-q] [-b passes] capture.txt
+ *   -q          only print the summary
+ *   -b passes   feed the received bytes through the parser this many times and report throughput
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <vector>
+#include "config.h"
+#include "BMSCapture.h"
+#include "BMSFrameParser.h"
+#include "ModuleDecode.h"
+
+typedef struct {
+    uint8_t type;
+    uint32_t time;
+    std::vector<uint8_t> data;
+} Record;
+
+static bool quiet = false;
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    c = toupper(c);
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//Pull the hex between the BEGIN and END markers out of a saved console log
+static bool loadDump(FILE *in, std::vector<uint8_t> &bytes)
+{
+    char line[512];
+    bool inside = false;
+
+    while (fgets(line, sizeof(line), in))
+    {
+        if (strstr(line, "CAPTURE BEGIN")) { inside = true; bytes.clear(); continue; }
+        if (strstr(line, "CAPTURE END")) return inside;
+        if (!inside) continue;
+        for (char *p = line; p[0] && p[1]; p += 2)
+        {
+            int hi = hexValue(p[0]);
+            int lo = hexValue(p[1]);
+            if (hi < 0 || lo < 0) break;
+            bytes.push_back((hi << 4) | lo);
+        }
+    }
+    return false;
+}
+
+static bool splitRecords(const std::vector<uint8_t> &bytes, std::vector<Record> &records)
+{
+    size_t pos = 0;
+    while (pos + CAPTURE_HEADER_LEN <= bytes.size())
+    {
+        Record rec;
+        int len = bytes[pos + 1];
+        rec.type = bytes[pos];
+        rec.time = bytes[pos + 2] | (bytes[pos + 3] << 8) | (bytes[pos + 4] << 16) | ((uint32_t)bytes[pos + 5] << 24);
+        if (pos + CAPTURE_HEADER_LEN + len > bytes.size()) return false;
+        rec.data.assign(bytes.begin() + pos + CAPTURE_HEADER_LEN, bytes.begin() + pos + CAPTURE_HEADER_LEN + len);
+        records.push_back(rec);
+        pos += CAPTURE_HEADER_LEN + len;
+    }
+    return pos == bytes.size();
+}
+
+//Decoded by the same code BMSModule uses, before any of the firmware's filtering
+static void printMeasurements(const uint8_t *regs)
+{
+    ModuleMeasurements m;
+    ModuleDecode::measurements(regs, m);
+    printf("      module %.3fV  cells", ModuleDecode::moduleVolts(m.moduleCounts));
+    for (int i = 0; i < 6; i++) printf(" %.4f", ModuleDecode::cellVolts(m.cellCounts[i]));
+    printf("V  temps %.2fC %.2fC\n", ModuleDecode::celsius(0, m.tempCounts[0]), ModuleDecode::celsius(1, m.tempCounts[1]));
+}
+
+static void printFrame(const BMSFrame &frame, uint32_t latency)
+{
+    int addr = (frame.addrByte >> 1) & 0x3F;
+
+    printf("    reply after %uus from %s%i reg %02X%s", latency, (frame.addrByte & 0x80) ? "unaddressed " : "", addr, 
+           frame.reg, frame.crcGood ? "" : " BAD CRC");
+    if (frame.isWrite)
+    {
+        printf(" write echo %02X\n", frame.payload[0]);
+        return;
+    }
+    printf(" %i bytes\n", frame.payloadLen);
+    if (frame.reg == REG_DEV_STATUS && frame.payloadLen == 1)
+    {
+        //findBoards counts a module as present if it answers this with something other than 0
+        printf("      %s\n", (frame.payload[0] > 0) ? "module present" : "module reports status 0");
+    }
+    else if (frame.reg == REG_GPAI && frame.payloadLen == MEASUREMENT_LEN) printMeasurements(frame.payload);
+    else if (frame.reg == REG_DEV_STATUS && frame.payloadLen == SNAPSHOT_LEN)
+    {
+        printMeasurements(&frame.payload[REG_GPAI]);
+        printf("      alerts %02X faults %02X COV %02X CUV %02X\n", frame.payload[REG_ALERT_STATUS], frame.payload[REG_FAULT_STATUS],
+               frame.payload[REG_COV_FAULT], frame.payload[REG_CUV_FAULT]);
+    }
+    else if (frame.reg == REG_ALERT_STATUS && frame.payloadLen == 4)
+    {
+        printf("      alerts %02X faults %02X COV %02X CUV %02X\n", frame.payload[0], frame.payload[1], frame.payload[2], frame.payload[3]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 0;
+    const char *fileName = NULL;
+    std::vector<uint8_t> bytes;
+    std::vector<Record> records;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-q")) quiet = true;
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc) passes = atoi(argv[++i]);
+        else fileName = argv[i];
+    }
+    FILE *in = fileName ? fopen(fileName, "r") : stdin;
+    if (!in || !loadDump(in, bytes))
+    {
+        fprintf(stderr, "No CAPTURE BEGIN ... CAPTURE END block found\n");
+        return 1;
+    }
+    if (!splitRecords(bytes, records)) fprintf(stderr, "Capture ends part way through a record, ignoring the rest\n");
+
+    BMSFrameParser parsers[16];     //one per chain
+    uint32_t sentAt[16] = {0};
+    uint32_t frames = 0, badCRC = 0, discarded = 0, requests = 0;
+    uint32_t minLatency = 0xFFFFFFFF, maxLatency = 0;
+    uint64_t totalLatency = 0;
+    BMSFrame frame;
+
+    for (size_t r = 0; r < records.size(); r++)
+    {
+        Record &rec = records[r];
+        int chain = rec.type & 0x0F;
+        switch (rec.type & 0xF0)
+        {
+        case CAPTURE_TX:
+            requests++;
+            if (rec.data.size() >= 2) parsers[chain].expect(rec.data[0], rec.data[1]); //what BMSBus::send does
+            sentAt[chain] = rec.time;
+            if (!quiet)
+            {
+                printf("%10u chain %i sent", rec.time, chain);
+                for (size_t i = 0; i < rec.data.size(); i++) printf(" %02X", rec.data[i]);
+                printf("\n");
+            }
+            break;
+        case CAPTURE_RX:
+            for (size_t i = 0; i < rec.data.size(); i++)
+            {
+                if (!parsers[chain].feed(rec.data[i], frame)) continue;
+                uint32_t latency = rec.time - sentAt[chain];
+                frames++;
+                if (!frame.crcGood) badCRC++;
+                if (latency < minLatency) minLatency = latency;
+                if (latency > maxLatency) maxLatency = latency;
+                totalLatency += latency;
+                if (!quiet) printFrame(frame, latency);
+            }
+            break;
+        case CAPTURE_DISCARD:
+            discarded += rec.data.size();
+            if (!quiet) printf("%10u chain %i flushed %i stray bytes\n", rec.time, chain, (int)rec.data.size());
+            break;
+        }
+    }
+
+    printf("\n%i records, %i requests, %i frames (%i bad CRC), %i bytes flushed unread\n", (int)records.size(), requests, frames, badCRC, discarded);
+    if (frames > 0) printf("Round trip: min %uus  avg %uus  max %uus\n", minLatency, (uint32_t)(totalLatency / frames), maxLatency);
+    if (requests > frames) printf("%i requests got no complete reply\n", requests - frames);
+
+    if (passes > 0)
+    {
+        uint64_t fed = 0;
+        uint32_t parsed = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int p = 0; p < passes; p++)
+        {
+            BMSFrameParser parser;
+            for (size_t r = 0; r < records.size(); r++)
+            {
+                Record &rec = records[r];
+                if ((rec.type & 0xF0) == CAPTURE_TX && rec.data.size() >= 2) parser.expect(rec.data[0], rec.data[1]);
+                else if ((rec.type & 0xF0) == CAPTURE_RX)
+                {
+                    for (size_t i = 0; i < rec.data.size(); i++) if (parser.feed(rec.data[i], frame)) parsed++;
+                    fed += rec.data.size();
+                }
+            }
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("Parser: %llu bytes, %u frames in %.3fs = %.1f MB/s, %.0f frames/s\n", (unsigned long long)fed, parsed, secs, 
+               fed / secs / 1e6, parsed / secs);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Checks the compile time thermistor table in Thermistor.cpp against the Steinhart-Hart formula the firmware
+ * used to work out for every reading, for every count of both channels, then times both on this machine.
+ * Exits with 1 if the table is further off than the limit anywhere between -40C and 150C.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -I.. thermcheck.cpp ../Thermistor.cpp -o thermcheck
+ *
+ * Usage: thermcheck [conversions to time]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include "Thermistor.h"
+
+#define BAND_LOW        -40.0f
+#define BAND_HIGH       150.0f
+#define BAND_LIMIT      0.05    //worst error allowed inside the band in degrees C
+
+//exactly what BMSModule::countsToTemperature did before the table
+static float reference(int temp, uint16_t counts)
+{
+    float resistance;
+    float logR;
+
+    if (temp == 0) resistance = 1.78f / ((counts + 2) / 33046.0f) - 3.57f;
+    else resistance = 1.78f / ((counts + 9) / 33068.0f) - 3.57f;
+    resistance *= 1000.0f;
+    logR = logf(resistance);
+    return 1.0f / (0.0007610373573f + (0.0002728524832f * logR) + (logR * logR * logR * 0.0000001022822735f)) - 273.15f;
+}
+
+int main(int argc, char **argv)
+{
+    long conversions = (argc > 1) ? atol(argv[1]) : 20000000;
+    bool pass = true;
+
+    printf("chan   worst in %.0fC..%.0fC          worst anywhere\n", BAND_LOW, BAND_HIGH);
+    for (int ch = 0; ch < 2; ch++)
+    {
+        double bandWorst = 0.0, worst = 0.0;
+        int bandAt = 0, worstAt = 0;
+        for (int c = 0; c < THERM_FULL_SCALE; c++)
+        {
+            float ref = reference(ch, c);
+            double err = fabs((double)Thermistor::toCelsius(ch, c) - ref);
+            if (err > worst) { worst = err; worstAt = c; }
+            if (ref >= BAND_LOW && ref <= BAND_HIGH && err > bandWorst) { bandWorst = err; bandAt = c; }
+        }
+        printf("  %i    %.4fC at %5i (%.1fC)    %.4fC at %5i (%.1fC)\n", ch, bandWorst, bandAt, reference(ch, bandAt),
+               worst, worstAt, reference(ch, worstAt));
+        if (bandWorst > BAND_LIMIT) pass = false;
+    }
+    printf("table: %i entries per channel, %i bytes\n", THERM_TABLE_SIZE, (int)sizeof(Thermistor::table));
+
+    //same spread of counts for both so the branch predictor doesn't favour either
+    volatile float sink = 0.0f;
+    float sum = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for (long n = 0; n < conversions; n++) sum += reference(n & 1, (n * 7919) & (THERM_FULL_SCALE - 1));
+    double refNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / conversions;
+    sink = sum;
+    sum = 0.0f;
+    start = std::chrono::steady_clock::now();
+    for (long n = 0; n < conversions; n++) sum += Thermistor::toCelsius(n & 1, (n * 7919) & (THERM_FULL_SCALE - 1));
+    double tableNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / conversions;
+    sink = sum;
+    (void)sink;
+
+    printf("formula %.2f ns, table %.2f ns per conversion (%.1fx) over %li conversions\n", refNs, tableNs, refNs / tableNs, conversions);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}